@@ -0,0 +1,257 @@
+//counts_file.cpp
+//Reading and writing counts files.
+//
+//The layout is, with every integer little endian:
+//
+//  8 bytes     magic, "SUNSTARC"
+//  u32         version
+//  u32         flags, bit 0 is finished
+//  u64         seed, input_hash, begin, end, completed, log_offset
+//  u64         number of entries
+//  entries     u64 key hi, u64 key lo, u64 count, u32 length, newick string
+#include "counts_file.h"
+#include <fstream>
+using std::ifstream;
+using std::ofstream;
+#include <string>
+using std::string;
+#include <vector>
+using std::vector;
+#include <stdexcept>
+#include <cstdio>
+#include <iterator>
+#include <algorithm>
+#include <unordered_map>
+
+const char COUNTS_MAGIC[8] = {'S','U','N','S','T','A','R','C'};
+const uint32_t COUNTS_VERSION = 1;
+
+static void put_u32(string& buf, uint32_t v){
+    for(size_t i = 0; i < 4; ++i){
+        buf.push_back((char)(v >> (8*i)));
+    }
+}
+
+static void put_u64(string& buf, uint64_t v){
+    for(size_t i = 0; i < 8; ++i){
+        buf.push_back((char)(v >> (8*i)));
+    }
+}
+
+/*
+ * Pulls little endian integers and strings out of a buffer, and throws if we
+ * run off the end, so a truncated file is caught instead of read as garbage.
+ */
+class counts_reader_t{
+    public:
+        counts_reader_t(const string& buf, const string& filename):
+            _buf(buf), _filename(filename), _pos(0) {};
+
+        uint64_t get(size_t bytes){
+            check(bytes);
+            uint64_t v = 0;
+            for(size_t i = 0; i < bytes; ++i){
+                v |= (uint64_t)(unsigned char)_buf[_pos++] << (8*i);
+            }
+            return v;
+        }
+
+        string get_string(size_t len){
+            check(len);
+            string ret = _buf.substr(_pos, len);
+            _pos += len;
+            return ret;
+        }
+
+        bool done() const { return _pos == _buf.size(); }
+
+    private:
+        void check(size_t bytes){
+            if(_buf.size() - _pos < bytes){
+                throw std::runtime_error("Counts file '" + _filename
+                        + "' is truncated");
+            }
+        }
+
+        const string& _buf;
+        const string& _filename;
+        size_t _pos;
+};
+
+void write_counts_file(const string& filename, const counts_file_t& cf){
+    string buf(COUNTS_MAGIC, sizeof(COUNTS_MAGIC));
+    put_u32(buf, COUNTS_VERSION);
+    put_u32(buf, cf.finished ? 1 : 0);
+    put_u64(buf, cf.seed);
+    put_u64(buf, cf.input_hash);
+    put_u64(buf, cf.begin);
+    put_u64(buf, cf.end);
+    put_u64(buf, cf.completed);
+    put_u64(buf, cf.log_offset);
+    put_u64(buf, cf.entries.size());
+    for(auto& e : cf.entries){
+        put_u64(buf, e.key.hi);
+        put_u64(buf, e.key.lo);
+        put_u64(buf, e.count);
+        put_u32(buf, e.newick.size());
+        buf += e.newick;
+    }
+
+    string tmp = filename + ".tmp";
+    {
+        ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+        out.write(buf.data(), buf.size());
+        out.close();
+        if(!out){
+            throw std::runtime_error("Could not write counts file '" + tmp
+                    + "'");
+        }
+    }
+    if(std::rename(tmp.c_str(), filename.c_str()) != 0){
+        throw std::runtime_error("Could not move '" + tmp + "' to '"
+                + filename + "'");
+    }
+}
+
+counts_file_t read_counts_file(const string& filename){
+    ifstream in(filename.c_str(), std::ios::binary);
+    if(!in){
+        throw std::runtime_error("Could not open counts file '" + filename
+                + "'");
+    }
+    string buf((std::istreambuf_iterator<char>(in)),
+            std::istreambuf_iterator<char>());
+
+    counts_reader_t r(buf, filename);
+    if(r.get_string(sizeof(COUNTS_MAGIC))
+            != string(COUNTS_MAGIC, sizeof(COUNTS_MAGIC))){
+        throw std::runtime_error("'" + filename + "' is not a counts file");
+    }
+    if(r.get(4) != COUNTS_VERSION){
+        throw std::runtime_error("Counts file '" + filename
+                + "' has an unknown version");
+    }
+    counts_file_t cf;
+    cf.finished = r.get(4) & 1;
+    cf.seed = r.get(8);
+    cf.input_hash = r.get(8);
+    cf.begin = r.get(8);
+    cf.end = r.get(8);
+    cf.completed = r.get(8);
+    cf.log_offset = r.get(8);
+    uint64_t entries = r.get(8);
+    for(uint64_t i = 0; i < entries; ++i){
+        counts_entry_t e;
+        e.key.hi = r.get(8);
+        e.key.lo = r.get(8);
+        e.count = r.get(8);
+        e.newick = r.get_string(r.get(4));
+        cf.entries.push_back(std::move(e));
+    }
+    if(!r.done()){
+        throw std::runtime_error("Counts file '" + filename
+                + "' has trailing data");
+    }
+    return cf;
+}
+
+counts_file_t merge_counts_files(vector<counts_file_t> files){
+    if(files.empty()){
+        throw std::runtime_error("No counts files to merge");
+    }
+    std::sort(files.begin(), files.end(),
+            [](const counts_file_t& a, const counts_file_t& b){
+                return a.begin < b.begin;
+            });
+
+    counts_file_t merged;
+    merged.seed = files[0].seed;
+    merged.input_hash = files[0].input_hash;
+    merged.finished = true;
+    std::unordered_map<topology_key_t, size_t> index;
+    for(auto& cf : files){
+        if(cf.seed != merged.seed || cf.input_hash != merged.input_hash){
+            throw std::runtime_error("Counts files are from different runs");
+        }
+        if(!cf.finished){
+            throw std::runtime_error("Counts file for trials "
+                    + std::to_string(cf.begin) + " to "
+                    + std::to_string(cf.end) + " isn't finished");
+        }
+        if(cf.begin != merged.end){
+            throw std::runtime_error("Counts files leave out or repeat the "
+                    "trials from " + std::to_string(std::min(cf.begin,
+                            merged.end)));
+        }
+        if(files.size() > 1 && cf.completed != cf.end - cf.begin){
+            throw std::runtime_error("Counts file for trials "
+                    + std::to_string(cf.begin) + " to "
+                    + std::to_string(cf.end) + " stopped early");
+        }
+        merged.end = cf.end;
+        merged.completed += cf.completed;
+        for(auto& e : cf.entries){
+            auto it = index.find(e.key);
+            if(it == index.end()){
+                index[e.key] = merged.entries.size();
+                merged.entries.push_back(e);
+            }
+            else{
+                merged.entries[it->second].count += e.count;
+            }
+        }
+    }
+    return merged;
+}
+
+//FNV-1a, with a separator between the strings so that moving text from one
+//string to the next changes the hash
+uint64_t hash_inputs(const vector<string>& newick_strings,
+        const string& outgroup){
+    uint64_t h = 0xcbf29ce484222325ull;
+    auto add = [&h](unsigned char c){
+        h ^= c;
+        h *= 0x100000001b3ull;
+    };
+    for(auto& s : newick_strings){
+        for(auto c : s) add(c);
+        add('\n');
+    }
+    for(auto c : outgroup) add(c);
+    return h;
+}
+
+counts_writer_t::~counts_writer_t(){
+    if(_thread.joinable()){
+        _thread.join();
+    }
+}
+
+void counts_writer_t::write(counts_file_t&& snapshot,
+        std::function<uint64_t()> log_offset){
+    if(_thread.joinable()){
+        _thread.join();
+    }
+    _busy = true;
+    _thread = std::thread([this](counts_file_t cf,
+                std::function<uint64_t()> log_offset){
+        try{
+            if(log_offset) cf.log_offset = log_offset();
+            write_counts_file(_filename, cf);
+        }
+        catch(const std::exception& e){
+            _error = e.what();
+            _failed = true;
+        }
+        _busy = false;
+    }, std::move(snapshot), std::move(log_offset));
+}
+
+void counts_writer_t::finish(){
+    if(_thread.joinable()){
+        _thread.join();
+    }
+    if(_failed){
+        throw std::runtime_error(_error);
+    }
+}
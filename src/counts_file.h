@@ -0,0 +1,114 @@
+//counts_file.h
+//A small binary file for the topology counts of a run of random schedules.
+//It is used for checkpoints, so that a run that gets killed can pick up where
+//it left off, and it is laid out so that files from separate runs over
+//different trials of the same job can be added together.
+#pragma once
+
+#include "topology.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+struct counts_entry_t{
+    topology_key_t key;
+    uint64_t count;
+    std::string newick;
+};
+
+/*
+ * Everything we need to know to carry on a run of random schedules.
+ *
+ *  seed:       The seed of the run. Trial i uses stream i of it.
+ *
+ *  input_hash: Hash of the gene trees and the outgroup, so that we don't
+ *              carry on a run with the wrong data.
+ *
+ *  begin, end: The trials the run is meant to do, [begin, end).
+ *
+ *  completed:  How many of those are done. Trials [begin, begin+completed)
+ *              are in the counts. This is also where the generator picks
+ *              up, since the stream of a trial is just its index.
+ *
+ *  log_offset: How long the schedule log was when the snapshot was taken.
+ *
+ *  finished:   True if the run is over, either because it did all the
+ *              trials, or because it converged.
+ *
+ *  entries:    The count and newick string for every topology seen.
+ */
+struct counts_file_t{
+    uint64_t seed = 0;
+    uint64_t input_hash = 0;
+    uint64_t begin = 0;
+    uint64_t end = 0;
+    uint64_t completed = 0;
+    uint64_t log_offset = 0;
+    bool finished = false;
+    std::vector<counts_entry_t> entries;
+};
+
+/*
+ * Writes the file to a temporary name first, and then renames it over the
+ * old one, so that there is always a whole file on disk even if we get killed
+ * in the middle. Throws a std::runtime_error if it can't.
+ */
+void write_counts_file(const std::string& filename, const counts_file_t&);
+
+/*
+ * Throws a std::runtime_error if the file can't be read, or isn't a counts
+ * file.
+ */
+counts_file_t read_counts_file(const std::string& filename);
+
+/*
+ * Adds up the counts files from the shards of one run. The shards have to
+ * have the same seed and inputs, be finished, and their trials have to fit
+ * together into [0, end) with no gaps or overlaps. Then the result is exactly
+ * what one run of all the trials would have counted. Throws a
+ * std::runtime_error if the files don't fit together.
+ */
+counts_file_t merge_counts_files(std::vector<counts_file_t> files);
+
+/*
+ * Hash of the gene trees and outgroup of a run, for counts_file_t::input_hash.
+ */
+uint64_t hash_inputs(const std::vector<std::string>& newick_strings,
+        const std::string& outgroup);
+
+/*
+ * Writes counts files on a thread of its own, so that the trial loop doesn't
+ * have to wait on the disk. Only one write is in flight at a time. If the
+ * last one isn't done yet, busy() says so, and the caller should just try
+ * again later.
+ */
+class counts_writer_t{
+    public:
+        counts_writer_t(const std::string& filename): _filename(filename),
+            _busy(false), _failed(false) {};
+        ~counts_writer_t();
+
+        bool busy() const { return _busy; }
+
+        /*
+         * Hands the snapshot off to the writer thread. If log_offset is
+         * given, the writer thread calls it first and puts what it returns
+         * in the snapshot's log_offset, so that the caller doesn't have to
+         * wait for the log either.
+         */
+        void write(counts_file_t&& snapshot,
+                std::function<uint64_t()> log_offset = nullptr);
+
+        //waits for the write in flight, and throws if any write failed
+        void finish();
+
+    private:
+        std::string _filename;
+        std::thread _thread;
+        std::atomic<bool> _busy;
+        std::atomic<bool> _failed;
+        std::string _error;
+};
@@ -0,0 +1,259 @@
+//dirichlet.cpp
+//Drawing random schedules, see dirichlet.h.
+#include "dirichlet.h"
+#include <vector>
+using std::vector;
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+/*
+ * Uniform doubles from the words of a block. They are made with bit tricks and
+ * signed 32 bit conversions, which every vector unit has, rather than by
+ * converting unsigned or 64 bit ints, which AVX2 can't.
+ *
+ * open52() is in (0,1), from the top 52 bits of two words, so it is safe to
+ * take the log of. uniform32() is in [0,1) and open32() is in (0,1).
+ */
+inline double open52(uint32_t lo, uint32_t hi){
+    uint64_t bits = ((((uint64_t)hi << 32) | lo) >> 12)
+        | 0x3ff0000000000000ULL;
+    double m;
+    std::memcpy(&m, &bits, sizeof(m));
+    return (m - 1.0) + 1.0/9007199254740992.0;
+}
+
+inline double uniform32(uint32_t w){
+    return ((double)(int32_t)(w ^ 0x80000000u) + 2147483648.0)
+        * (1.0/4294967296.0);
+}
+
+inline double open32(uint32_t w){
+    return ((double)(int32_t)(w ^ 0x80000000u) + 2147483648.5)
+        * (1.0/4294967296.0);
+}
+
+/*
+ * The log and cos from the standard library are calls the compiler can't
+ * turn into vector instructions, so the lanes use these. They are only as
+ * careful as drawing schedules needs: lane_log() wants a positive, normal x,
+ * and both are good to within a few units in the last place.
+ *
+ * lane_log() splits x into 2^e*m, with m between sqrt(1/2) and sqrt(2), and
+ * sums the series log(m) = 2*atanh(s), s = (m-1)/(m+1), which only needs ten
+ * terms since |s| < 0.172. The exponent is pulled out as a double by putting
+ * its bits under 2^52, since the compiler can't always convert 64 bit ints.
+ */
+inline double lane_log(double x){
+    const double LN2 = 0.6931471805599453;
+    const double SQRT2 = 1.4142135623730951;
+    uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    uint64_t e_bits = (bits >> 52) | 0x4330000000000000ULL;
+    uint64_t m_bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    double e, m;
+    std::memcpy(&e, &e_bits, sizeof(e));
+    std::memcpy(&m, &m_bits, sizeof(m));
+    e -= 4503599627370496.0 + 1023.0;
+    double big = m > SQRT2 ? 1.0 : 0.0;
+    m *= 1.0 - 0.5*big;
+    e += big;
+    double s = (m - 1.0)/(m + 1.0);
+    double s2 = s*s;
+    double p = 1.0/21;
+    for(int k = 19; k >= 3; k -= 2){
+        p = p*s2 + 1.0/k;
+    }
+    return e*LN2 + 2.0*s + 2.0*s*s2*p;
+}
+
+/*
+ * cos(2*pi*u) for u in [0,1). The angle is folded into [0, pi/2], where the
+ * Taylor series of cos is within 2e-17 after the x^22 term.
+ */
+inline double lane_cos_2pi(double u){
+    const double PI = 3.141592653589793;
+    double a = u > 0.5 ? 1.0 - u : u;
+    double sign = a > 0.25 ? -1.0 : 1.0;
+    a = a > 0.25 ? 0.5 - a : a;
+    double x2 = (2.0*PI*a)*(2.0*PI*a);
+    double p = 1.0;
+    for(int n = 11; n >= 1; --n){
+        p = 1.0 - p*x2*(1.0/((2*n)*(2*n-1)));
+    }
+    return sign*p;
+}
+
+/*
+ * The streams of a block of trials, one to a lane. Each call gives every lane
+ * the next block of its stream, but only moves on the streams of the lanes
+ * that are still drawing. The other lanes get numbers they ignore.
+ */
+class lane_streams_t{
+    public:
+        lane_streams_t(uint64_t seed, uint64_t first): _key{(uint32_t)seed,
+            (uint32_t)(seed>>32)}{
+            for(size_t l = 0; l < PHILOX_LANES; ++l){
+                _stream[l] = first + l;
+                _block[l] = 0;
+            }
+        }
+
+        void operator()(uint32_t words[4][PHILOX_LANES],
+                const uint64_t active[PHILOX_LANES]){
+            for(size_t l = 0; l < PHILOX_LANES; ++l){
+                words[0][l] = (uint32_t)_block[l];
+                words[1][l] = (uint32_t)(_block[l]>>32);
+                words[2][l] = (uint32_t)_stream[l];
+                words[3][l] = (uint32_t)(_stream[l]>>32);
+            }
+            philox4x32_lanes(words, _key);
+            for(size_t l = 0; l < PHILOX_LANES; ++l){
+                _block[l] += active[l];
+            }
+        }
+
+    private:
+        uint32_t _key[2];
+        uint64_t _stream[PHILOX_LANES];
+        uint64_t _block[PHILOX_LANES];
+};
+
+//a single stream, as a lane of its own
+class one_stream_t{
+    public:
+        one_stream_t(philox_t& gen): _gen(gen){}
+
+        void operator()(uint32_t words[4][1], const uint64_t*){
+            uint32_t out[4];
+            _gen.next_block(out);
+            for(int k = 0; k < 4; ++k) words[k][0] = out[k];
+        }
+
+    private:
+        philox_t& _gen;
+};
+
+/*
+ * Draws a schedule for each of the first lanes lanes into out, lane l in
+ * out[l*len, (l+1)*len).
+ *
+ * A shape of 1, which is what a uniform schedule needs, is just an
+ * exponential, so each block gives two weights and nothing is rejected.
+ *
+ * Otherwise each weight is Marsaglia and Tsang's method, "A Simple Method for
+ * Generating Gamma Variables" (2000). Every try takes one block: three words
+ * for the normal, through Box-Muller, and one for the uniform. All the lanes
+ * make their tries together, and a lane that has its weight just sits out the
+ * rest of the tries for it. Nearly all tries are accepted, so that doesn't
+ * waste much. A shape below 1 is drawn as shape+1 and scaled by U^(1/shape),
+ * with U from a block of its own. Those can be too small for a double, so
+ * they are kept as logs until the schedule is normalized.
+ */
+template<size_t L, typename source_t>
+void draw_lanes(source_t& source, size_t lanes, size_t len, double shape,
+        double* out){
+    uint32_t words[4][L];
+    uint64_t active[L];
+    if(shape == 1.0){
+        for(size_t l = 0; l < L; ++l) active[l] = l < lanes;
+        for(size_t k = 0; k < len; k += 2){
+            source(words, active);
+            for(size_t l = 0; l < lanes; ++l){
+                out[l*len+k] = -lane_log(open52(words[0][l], words[1][l]));
+                if(k+1 < len){
+                    out[l*len+k+1] = -lane_log(open52(words[2][l],
+                                words[3][l]));
+                }
+            }
+        }
+    }
+    else{
+        bool boost = shape < 1.0;
+        double d = (boost ? shape + 1.0 : shape) - 1.0/3.0;
+        double c = 1.0/std::sqrt(9.0*d);
+        double g[L], log_u[L], x[L], v_[L], u[L];
+        uint64_t ok[L];
+        //a lane keeps its g until it has a new one, and the lanes past lanes
+        //never do, so they all start out at zero
+        for(size_t l = 0; l < L; ++l) g[l] = 0.0;
+        for(size_t k = 0; k < len; ++k){
+            for(size_t l = 0; l < L; ++l) active[l] = l < lanes;
+            if(boost){
+                source(words, active);
+                for(size_t l = 0; l < L; ++l){
+                    log_u[l] = lane_log(open52(words[0][l], words[1][l]));
+                }
+            }
+            size_t left = lanes;
+            while(left > 0){
+                source(words, active);
+                uint64_t unsure = 0;
+                for(size_t l = 0; l < L; ++l){
+                    x[l] = std::sqrt(-2.0*lane_log(open52(words[0][l],
+                                    words[1][l])))
+                        * lane_cos_2pi(uniform32(words[2][l]));
+                    double v = 1.0 + c*x[l];
+                    v_[l] = v*v*v;
+                    u[l] = open32(words[3][l]);
+                    double x2 = x[l]*x[l];
+                    ok[l] = (v_[l] > 0.0) & (u[l] < 1.0 - 0.0331*x2*x2);
+                    unsure |= active[l] & (v_[l] > 0.0) & (ok[l] ^ 1);
+                }
+                //the squeeze above takes nearly every try, so the logs for
+                //the rest are only worked out when some lane needs them
+                if(unsure){
+                    for(size_t l = 0; l < L; ++l){
+                        double safe_v = v_[l] > 0.0 ? v_[l] : 1.0;
+                        ok[l] |= (v_[l] > 0.0) & (lane_log(u[l])
+                                < 0.5*x[l]*x[l]
+                                + d*(1.0 - v_[l] + lane_log(safe_v)));
+                    }
+                }
+                left = 0;
+                for(size_t l = 0; l < L; ++l){
+                    g[l] = active[l] & ok[l] ? d*v_[l] : g[l];
+                    active[l] &= ok[l] ^ 1;
+                    left += active[l];
+                }
+            }
+            for(size_t l = 0; l < lanes; ++l){
+                out[l*len+k] = boost ? lane_log(g[l]) + log_u[l]/shape : g[l];
+            }
+        }
+        if(boost){
+            for(size_t l = 0; l < lanes; ++l){
+                double* s = out + l*len;
+                double top = *std::max_element(s, s + len);
+                for(size_t k = 0; k < len; ++k){
+                    s[k] = std::exp(s[k] - top);
+                }
+            }
+        }
+    }
+    for(size_t l = 0; l < lanes; ++l){
+        double total = 0.0;
+        for(size_t k = 0; k < len; ++k){
+            total += out[l*len+k];
+        }
+        for(size_t k = 0; k < len; ++k){
+            out[l*len+k] /= total;
+        }
+    }
+}
+
+void dirichlet_block(uint64_t seed, uint64_t first, size_t count, size_t len,
+        double shape, double* out){
+    for(size_t t = 0; t < count; t += PHILOX_LANES){
+        lane_streams_t source(seed, first + t);
+        draw_lanes<PHILOX_LANES>(source, std::min(PHILOX_LANES, count - t),
+                len, shape, out + t*len);
+    }
+}
+
+vector<double> draw_schedule(philox_t& gen, size_t len, double shape){
+    vector<double> ret(len);
+    one_stream_t source(gen);
+    draw_lanes<1>(source, 1, len, shape, ret.data());
+    return ret;
+}
@@ -0,0 +1,40 @@
+//dirichlet.h
+//Random schedules, drawn a block at a time.
+//
+//A random schedule is a draw from a symmetric Dirichlet distribution: one
+//gamma variate per weight, divided by their total. std::gamma_distribution
+//draws those one at a time, with a rejection loop and branches the compiler
+//can't do much with, and which algorithm it uses is up to the standard
+//library. Here the schedules of PHILOX_LANES trials are drawn side by side, one
+//trial to a lane. Philox and the Marsaglia-Tsang gamma method are written as
+//loops over the lanes, so with -march=native the compiler uses whatever vector
+//instructions the machine has, and without it they are ordinary scalar code.
+//
+//A lane only ever reads the stream of its own trial, and only moves it on when
+//it needs another number, so trial i gets the same schedule whichever block
+//it is drawn in, and the same one draw_schedule() gives on its own.
+#pragma once
+
+#include "rng.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Draws the schedules of trials [first, first+count), trial i from stream i
+ * of seed, and writes them one after the other to out, which needs room for
+ * count*len doubles.
+ *
+ *  shape:  The shape of each of the gamma draws. 1 is uniform on the simplex.
+ *          Less than 1 pushes the schedules out towards the corners, where a
+ *          few weights have most of the total, and more than 1 pulls them in
+ *          towards the middle, where the weights are all about the same.
+ */
+void dirichlet_block(uint64_t seed, uint64_t first, size_t count, size_t len,
+        double shape, double* out);
+
+/*
+ * One schedule from gen, which should be a fresh stream. It is the same as
+ * dirichlet_block() gives for the trial of that stream.
+ */
+std::vector<double> draw_schedule(philox_t& gen, size_t len, double shape);
@@ -0,0 +1,374 @@
+//dtoa.cpp
+//Shortest round trip formatting of doubles and floats.
+//
+//This is Grisu2, from Loitsch 2010, "Printing Floating-Point Numbers Quickly
+//and Accurately with Integers", laid out the way Milo Yip's dtoa does it. The
+//number is scaled by a cached power of ten so that its digits can be made with
+//64 bit integer arithmetic. The boundaries of the interval that rounds back to
+//the number are pulled in by one unit, so whatever digits come out are always
+//inside it, and the digits stop as soon as they are. That gives the shortest
+//output nearly every time, and one that reads back to the same number every
+//time.
+#include "dtoa.h"
+#include <cstring>
+#include <cstdint>
+
+struct diy_fp_t{
+    uint64_t f;
+    int e;
+};
+
+static diy_fp_t operator-(const diy_fp_t& a, const diy_fp_t& b){
+    return {a.f - b.f, a.e};
+}
+
+//the top 64 bits of the 128 bit product, rounded
+static diy_fp_t operator*(const diy_fp_t& a, const diy_fp_t& b){
+    const uint64_t M32 = 0xFFFFFFFFull;
+    uint64_t ah = a.f >> 32, al = a.f & M32;
+    uint64_t bh = b.f >> 32, bl = b.f & M32;
+    uint64_t hh = ah*bh, hl = ah*bl, lh = al*bh, ll = al*bl;
+    uint64_t mid = (ll >> 32) + (hl & M32) + (lh & M32) + (1ull << 31);
+    return {hh + (hl >> 32) + (lh >> 32) + (mid >> 32), a.e + b.e + 64};
+}
+
+static diy_fp_t normalize(diy_fp_t x){
+    int shift = __builtin_clzll(x.f);
+    return {x.f << shift, x.e - shift};
+}
+
+//10^k for k = -348, -340, ..., 340, as a normalized 64 bit significand and a
+//binary exponent
+static const uint64_t CACHED_POWERS_F[] = {
+    0xfa8fd5a0081c0288ull,
+    0xbaaee17fa23ebf76ull,
+    0x8b16fb203055ac76ull,
+    0xcf42894a5dce35eaull,
+    0x9a6bb0aa55653b2dull,
+    0xe61acf033d1a45dfull,
+    0xab70fe17c79ac6caull,
+    0xff77b1fcbebcdc4full,
+    0xbe5691ef416bd60cull,
+    0x8dd01fad907ffc3cull,
+    0xd3515c2831559a83ull,
+    0x9d71ac8fada6c9b5ull,
+    0xea9c227723ee8bcbull,
+    0xaecc49914078536dull,
+    0x823c12795db6ce57ull,
+    0xc21094364dfb5637ull,
+    0x9096ea6f3848984full,
+    0xd77485cb25823ac7ull,
+    0xa086cfcd97bf97f4ull,
+    0xef340a98172aace5ull,
+    0xb23867fb2a35b28eull,
+    0x84c8d4dfd2c63f3bull,
+    0xc5dd44271ad3cdbaull,
+    0x936b9fcebb25c996ull,
+    0xdbac6c247d62a584ull,
+    0xa3ab66580d5fdaf6ull,
+    0xf3e2f893dec3f126ull,
+    0xb5b5ada8aaff80b8ull,
+    0x87625f056c7c4a8bull,
+    0xc9bcff6034c13053ull,
+    0x964e858c91ba2655ull,
+    0xdff9772470297ebdull,
+    0xa6dfbd9fb8e5b88full,
+    0xf8a95fcf88747d94ull,
+    0xb94470938fa89bcfull,
+    0x8a08f0f8bf0f156bull,
+    0xcdb02555653131b6ull,
+    0x993fe2c6d07b7facull,
+    0xe45c10c42a2b3b06ull,
+    0xaa242499697392d3ull,
+    0xfd87b5f28300ca0eull,
+    0xbce5086492111aebull,
+    0x8cbccc096f5088ccull,
+    0xd1b71758e219652cull,
+    0x9c40000000000000ull,
+    0xe8d4a51000000000ull,
+    0xad78ebc5ac620000ull,
+    0x813f3978f8940984ull,
+    0xc097ce7bc90715b3ull,
+    0x8f7e32ce7bea5c70ull,
+    0xd5d238a4abe98068ull,
+    0x9f4f2726179a2245ull,
+    0xed63a231d4c4fb27ull,
+    0xb0de65388cc8ada8ull,
+    0x83c7088e1aab65dbull,
+    0xc45d1df942711d9aull,
+    0x924d692ca61be758ull,
+    0xda01ee641a708deaull,
+    0xa26da3999aef774aull,
+    0xf209787bb47d6b85ull,
+    0xb454e4a179dd1877ull,
+    0x865b86925b9bc5c2ull,
+    0xc83553c5c8965d3dull,
+    0x952ab45cfa97a0b3ull,
+    0xde469fbd99a05fe3ull,
+    0xa59bc234db398c25ull,
+    0xf6c69a72a3989f5cull,
+    0xb7dcbf5354e9beceull,
+    0x88fcf317f22241e2ull,
+    0xcc20ce9bd35c78a5ull,
+    0x98165af37b2153dfull,
+    0xe2a0b5dc971f303aull,
+    0xa8d9d1535ce3b396ull,
+    0xfb9b7cd9a4a7443cull,
+    0xbb764c4ca7a44410ull,
+    0x8bab8eefb6409c1aull,
+    0xd01fef10a657842cull,
+    0x9b10a4e5e9913129ull,
+    0xe7109bfba19c0c9dull,
+    0xac2820d9623bf429ull,
+    0x80444b5e7aa7cf85ull,
+    0xbf21e44003acdd2dull,
+    0x8e679c2f5e44ff8full,
+    0xd433179d9c8cb841ull,
+    0x9e19db92b4e31ba9ull,
+    0xeb96bf6ebadf77d9ull,
+    0xaf87023b9bf0ee6bull
+};
+
+static const int16_t CACHED_POWERS_E[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066
+};
+
+/*
+ * Picks the cached power c = 10^-K so that the exponent of c*2^e lands in
+ * [-60, -32], which leaves room for the integer part of the digits in 32 bits.
+ */
+static diy_fp_t get_cached_power(int e, int& K){
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int k = (int)dk;
+    if(dk - k > 0.0) k++;
+    unsigned index = (unsigned)((k >> 3) + 1);
+    K = -(-348 + (int)(index * 8));
+    return {CACHED_POWERS_F[index], CACHED_POWERS_E[index]};
+}
+
+static const uint32_t POW10[] = {1, 10, 100, 1000, 10000, 100000, 1000000,
+    10000000, 100000000, 1000000000};
+
+static int count_digits(uint32_t n){
+    int d = 1;
+    while(d < 10 && n >= POW10[d]) ++d;
+    return d;
+}
+
+/*
+ * Nudges the last digit down while that brings it closer to the real value
+ * and keeps it inside the safe interval.
+ */
+static void grisu_round(char* buf, int len, uint64_t delta, uint64_t rest,
+        uint64_t ten_kappa, uint64_t wp_w){
+    while(rest < wp_w && delta - rest >= ten_kappa &&
+            (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)){
+        buf[len-1]--;
+        rest += ten_kappa;
+    }
+}
+
+static void digit_gen(const diy_fp_t& W, const diy_fp_t& Mp, uint64_t delta,
+        char* buf, int& len, int& K){
+    const diy_fp_t one = {1ull << -Mp.e, Mp.e};
+    const diy_fp_t wp_w = Mp - W;
+    uint32_t p1 = (uint32_t)(Mp.f >> -one.e);
+    uint64_t p2 = Mp.f & (one.f - 1);
+    int kappa = count_digits(p1);
+    len = 0;
+
+    while(kappa > 0){
+        uint32_t d = p1 / POW10[kappa-1];
+        p1 %= POW10[kappa-1];
+        if(d || len){
+            buf[len++] = (char)('0' + d);
+        }
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if(rest <= delta){
+            K += kappa;
+            grisu_round(buf, len, delta, rest,
+                    (uint64_t)POW10[kappa] << -one.e, wp_w.f);
+            return;
+        }
+    }
+
+    //10^index, where index is the number of digits after the point so far,
+    //or zero once that doesn't fit
+    uint64_t scale = 1;
+    for(;;){
+        p2 *= 10;
+        delta *= 10;
+        scale = scale > UINT64_MAX/10 ? 0 : scale*10;
+        char d = (char)(p2 >> -one.e);
+        if(d || len){
+            buf[len++] = (char)('0' + d);
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if(p2 < delta){
+            K += kappa;
+            grisu_round(buf, len, delta, p2, one.f, wp_w.f * scale);
+            return;
+        }
+    }
+}
+
+/*
+ * The number is f*2^e, and hidden is the implicit leading bit of the format.
+ * If f is exactly hidden, the next number down is half as far away, so the
+ * lower boundary is closer.
+ */
+static void grisu2(uint64_t f, int e, uint64_t hidden, bool normal, char* buf,
+        int& len, int& K){
+    diy_fp_t v = {f, e};
+    diy_fp_t plus = normalize({(f << 1) + 1, e - 1});
+    diy_fp_t minus = (f == hidden && normal) ?
+        diy_fp_t{(f << 2) - 1, e - 2} : diy_fp_t{(f << 1) - 1, e - 1};
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    diy_fp_t c_mk = get_cached_power(plus.e, K);
+    diy_fp_t W = normalize(v) * c_mk;
+    diy_fp_t Wp = plus * c_mk;
+    diy_fp_t Wm = minus * c_mk;
+    Wm.f++;
+    Wp.f--;
+    digit_gen(W, Wp, Wp.f - Wm.f, buf, len, K);
+}
+
+static size_t write_exponent(int K, char* buf){
+    char* start = buf;
+    *buf++ = 'e';
+    if(K < 0){
+        *buf++ = '-';
+        K = -K;
+    }
+    else{
+        *buf++ = '+';
+    }
+    if(K >= 100){
+        *buf++ = (char)('0' + K/100);
+        K %= 100;
+        *buf++ = (char)('0' + K/10);
+    }
+    else{
+        *buf++ = (char)('0' + K/10);
+    }
+    *buf++ = (char)('0' + K%10);
+    return buf - start;
+}
+
+/*
+ * Turns the digits and the exponent into a number a person would write, with
+ * an exponent only if the number is very big or very small.
+ */
+static size_t prettify(char* buf, int len, int k){
+    const int kk = len + k;
+    if(0 <= k && kk <= 21){
+        //1234e7 -> 12340000000
+        for(int i = len; i < kk; ++i){
+            buf[i] = '0';
+        }
+        return kk;
+    }
+    else if(0 < kk && kk <= 21){
+        //1234e-2 -> 12.34
+        std::memmove(&buf[kk+1], &buf[kk], len - kk);
+        buf[kk] = '.';
+        return len + 1;
+    }
+    else if(-6 < kk && kk <= 0){
+        //1234e-6 -> 0.001234
+        const int offset = 2 - kk;
+        std::memmove(&buf[offset], &buf[0], len);
+        buf[0] = '0';
+        buf[1] = '.';
+        for(int i = 2; i < offset; ++i){
+            buf[i] = '0';
+        }
+        return len + offset;
+    }
+    else if(len == 1){
+        //1e30
+        return 1 + write_exponent(kk - 1, &buf[1]);
+    }
+    else{
+        //1234e30 -> 1.234e+33
+        std::memmove(&buf[2], &buf[1], len - 1);
+        buf[1] = '.';
+        return len + 1 + write_exponent(kk - 1, &buf[len+1]);
+    }
+}
+
+/*
+ * Handles the sign, zero, and the things that aren't numbers, and leaves the
+ * rest to grisu2.
+ */
+static size_t format_special(bool negative, bool zero, bool inf, bool nan,
+        char*& buf){
+    if(nan){
+        std::memcpy(buf, "nan", 3);
+        return 3;
+    }
+    size_t sign = 0;
+    if(negative){
+        *buf++ = '-';
+        sign = 1;
+    }
+    if(inf){
+        std::memcpy(buf, "inf", 3);
+        return sign + 3;
+    }
+    if(zero){
+        *buf = '0';
+        return sign + 1;
+    }
+    return sign;
+}
+
+size_t format_double(double value, char* buf){
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const uint64_t HIDDEN = 1ull << 52;
+    uint64_t sig = bits & (HIDDEN - 1);
+    int biased_e = (int)((bits >> 52) & 0x7FF);
+    bool negative = bits >> 63;
+    char* start = buf;
+    size_t n = format_special(negative, biased_e == 0 && sig == 0,
+            biased_e == 0x7FF && sig == 0, biased_e == 0x7FF && sig != 0, buf);
+    if(biased_e == 0x7FF || (biased_e == 0 && sig == 0)) return n;
+
+    uint64_t f = biased_e ? sig + HIDDEN : sig;
+    int e = biased_e ? biased_e - 1075 : -1074;
+    int len, K;
+    grisu2(f, e, HIDDEN, biased_e > 1, buf, len, K);
+    return (buf - start) + prettify(buf, len, K);
+}
+
+size_t format_float(float value, char* buf){
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const uint64_t HIDDEN = 1ull << 23;
+    uint64_t sig = bits & (HIDDEN - 1);
+    int biased_e = (int)((bits >> 23) & 0xFF);
+    bool negative = bits >> 31;
+    char* start = buf;
+    size_t n = format_special(negative, biased_e == 0 && sig == 0,
+            biased_e == 0xFF && sig == 0, biased_e == 0xFF && sig != 0, buf);
+    if(biased_e == 0xFF || (biased_e == 0 && sig == 0)) return n;
+
+    uint64_t f = biased_e ? sig + HIDDEN : sig;
+    int e = biased_e ? biased_e - 150 : -149;
+    int len, K;
+    grisu2(f, e, HIDDEN, biased_e > 1, buf, len, K);
+    return (buf - start) + prettify(buf, len, K);
+}
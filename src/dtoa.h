@@ -0,0 +1,22 @@
+//dtoa.h
+//Fast formatting of doubles and floats with as few digits as it takes to read
+//back the same number.
+#pragma once
+
+#include <cstddef>
+
+//Longest string either of these can write
+const size_t DTOA_BUFFER_SIZE = 32;
+
+/*
+ * Writes the shortest decimal string that reads back as value, and returns
+ * its length. The string is not null terminated. buf needs room for
+ * DTOA_BUFFER_SIZE characters.
+ */
+size_t format_double(double value, char* buf);
+
+/*
+ * Same as format_double(), but the string only has to read back as the same
+ * float, so it is usually shorter.
+ */
+size_t format_float(float value, char* buf);
@@ -3,6 +3,14 @@
 //2017-02-20
 #include "gstar.h"
 #include "debug.h"
+#include "rng.h"
+#include "nj.h"
+#include "counts_file.h"
+#include "schedule_log.h"
+#include "qmc.h"
+#include "partition.h"
+#include "dirichlet.h"
+#include "dtoa.h"
 #include <unordered_map>
 using std::unordered_map;
 #include <string>
@@ -10,31 +18,143 @@ using std::string;
 #include <vector>
 using std::vector;
 #include <utility>
-#include <random>
-#include <fstream>
-using std::ofstream;
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <stdexcept>
+#include <memory>
+#include <map>
+#include <cstring>
+#include <limits>
+
+//Number of schedules to make distance matrices for in one go
+const size_t SCHEDULE_BLOCK = 64;
+
+//The default schedule has a weight for each depth, and the schedules are
+//counted in a size_t, so there can be at most 63 of them
+const size_t MAX_DEFAULT_DEPTH = 64;
+
+//Share of the trials after the pilot that importance sampling spreads evenly
+//over the strata, whatever the pilot says. It keeps every stratum sampled, and
+//caps the importance weights at 1/IMPORTANCE_FLOOR.
+const double IMPORTANCE_FLOOR = 0.1;
+
+//How often, in trials, an adaptive run checks if it has converged
+const size_t CONVERGENCE_INTERVAL = 1024;
+
+//Two sided 95% normal quantile, for the confidence intervals
+const double CONVERGENCE_Z = 1.959963984540054;
+
+typedef unordered_map<topology_key_t, size_t> topology_counts_t;
+typedef unordered_map<topology_key_t, string> topology_names_t;
+
+/*
+ * The decision margins of the trials that gave a topology, see
+ * nj_with_hint(). Each trial counts as much as it does in the ratios.
+ */
+struct margin_stats_t{
+    double weight = 0.0;
+    double sum = 0.0;
+    double least = std::numeric_limits<double>::infinity();
+
+    void add(double margin, double w){
+        weight += w;
+        sum += w*margin;
+        least = std::min(least, margin);
+    }
+
+    void merge(const margin_stats_t& other, double scale){
+        weight += scale*other.weight;
+        sum += scale*other.sum;
+        least = std::min(least, other.least);
+    }
+};
+
+typedef unordered_map<topology_key_t, margin_stats_t> topology_margins_t;
 
 vector<std::pair<string, double>> make_return_vector(
-        const unordered_map<string, int>& counts, size_t trials){
+        const topology_counts_t& counts, const topology_names_t& names,
+        size_t trials){
     vector<std::pair<string, double>> ret;
     for(auto&& kv : counts){
         double ratio = ((double)kv.second)/(trials);
-        ret.push_back(std::make_pair(kv.first, ratio));
+        ret.push_back(std::make_pair(names.at(kv.first), ratio));
     }
     return ret;
 }
 
-void write_sequence_to_file(const vector<double>& s, string newick_string,
-        ofstream& outfile){
+/*
+ * Fills in result.margins for the trees already in it.
+ */
+void set_result_margins(gstar_result_t& result,
+        const topology_margins_t& margins, const topology_names_t& names){
+    unordered_map<string, const margin_stats_t*> by_name;
+    for(auto&& kv : margins){
+        by_name[names.at(kv.first)] = &kv.second;
+    }
+    result.margins.clear();
+    for(auto&& t : result.trees){
+        const auto& m = *by_name.at(t.first);
+        result.margins.push_back(std::make_pair(m.sum/m.weight, m.least));
+    }
+}
 
-    outfile<<"{\"tree\":\""<<newick_string<<"\",\"weights\": [";
-    for(size_t i = 0; i < s.size(); ++i){
-        outfile<<s[i];
-        if(i!=s.size()-1){
-            outfile<<',';
-        }
+double calc_perplexity(const vector<std::pair<string, double>>& trees){
+    double total = 0;
+    for(auto&& kv : trees){
+        total += -1*std::log2(kv.second) * kv.second;
+    }
+    return std::pow(2, total);
+}
+
+/*
+ * Decides if the counts from the first trials trials are stable enough to
+ * stop. Both of these have to hold, with 95% confidence:
+ *
+ *  - The ratio of each of the top_k most frequent topologies is within
+ *    tolerance of its true value. We use the Wilson score interval, since the
+ *    plain normal interval has no width when a topology has been seen every
+ *    time, or never.
+ *
+ *  - The perplexity is within a relative error of tolerance. Perplexity is
+ *    exp(H), so its relative error is about the error in H (in nats). The
+ *    variance of the plug in estimate of H is (sum p ln(p)^2 - H^2)/trials,
+ *    and it is biased low by about (K-1)/(2 trials), where K is the number of
+ *    topologies seen. The bias is added on top of the interval, so that a run
+ *    that is still finding new topologies all the time doesn't stop.
+ */
+bool check_convergence(const topology_counts_t& counts, size_t trials,
+        double tolerance, size_t top_k){
+    if(trials == 0) return false;
+    double n = (double)trials;
+    double z = CONVERGENCE_Z;
+
+    vector<double> ratios;
+    ratios.reserve(counts.size());
+    double entropy = 0.0;
+    double second_moment = 0.0;
+    for(auto&& kv : counts){
+        double p = kv.second/n;
+        ratios.push_back(p);
+        entropy -= p*std::log(p);
+        second_moment += p*std::log(p)*std::log(p);
     }
-    outfile<<"]}\n";
+
+    size_t k = std::min(top_k, ratios.size());
+    std::partial_sort(ratios.begin(), ratios.begin()+k, ratios.end(),
+            std::greater<double>());
+    for(size_t i = 0; i < k; ++i){
+        double p = ratios[i];
+        double half_width = z/(1+z*z/n) * std::sqrt(p*(1-p)/n + z*z/(4*n*n));
+        if(half_width > tolerance) return false;
+    }
+
+    double variance = std::max(0.0, second_moment - entropy*entropy)/n;
+    double bias = (counts.size()-1)/(2*n);
+    return z*std::sqrt(variance) + bias <= tolerance;
 }
 
 /*
@@ -51,23 +171,29 @@ void write_sequence_to_file(const vector<double>& s, string newick_string,
  *  edges of the simplex. If alpha is greater than len, the distribution is
  *  concentrated towards the center.
  *
+ *  gen:    The generator to draw from. The trial loop hands in the stream
+ *  for the current trial, so that trial i always gets the same schedule.
+ *
  *  beta:   Don't use this.
  */
-vector<double> dirichlet(size_t len, double alpha, double beta=1.0){
-#ifndef DEBUG
-    std::mt19937 gen((std::random_device())());
-    std::gamma_distribution<double> gd(alpha*(beta/(len*beta)), 1.0);
-#else
-    static std::mt19937 gen((std::random_device())());
-    static std::gamma_distribution<double> gd(alpha*(beta/(len*beta)), 1.0);
-#endif
-    vector<double> ret;
-    ret.reserve(len);
+vector<double> dirichlet(size_t len, double alpha, philox_t& gen,
+        double beta=1.0){
+    return draw_schedule(gen, len, alpha*(beta/(len*beta)));
+}
+
+/*
+ * Turns a point u of the unit cube into a schedule with the same distribution
+ * as dirichlet(len, len, gen), uniform on the simplex. Those gamma draws have
+ * shape 1, so they are just exponentials, and each coordinate only has to go
+ * through the inverse of the exponential CDF. Points that are spread evenly
+ * over the cube then end up spread evenly over the simplex.
+ */
+vector<double> uniform_simplex(const double* u, size_t len){
+    vector<double> ret(len);
     double total = 0.0;
     for(size_t i=0;i<len;++i){
-        double tmp = gd(gen);
-        total+=tmp;
-        ret.push_back(tmp);
+        ret[i] = -std::log1p(-u[i]);
+        total += ret[i];
     }
     for(auto&& v: ret){
         v /= total;
@@ -75,6 +201,44 @@ vector<double> dirichlet(size_t len, double alpha, double beta=1.0){
     return ret;
 }
 
+/*
+ * The strata that importance sampling splits the schedules into. Stratum h is
+ * the schedules whose smallest (or largest) weight is weight h.
+ */
+enum class strata_t{
+    smallest,
+    largest,
+};
+
+size_t get_stratum(const vector<double>& schedule, strata_t strata){
+    auto it = strata == strata_t::smallest ?
+        std::min_element(schedule.begin(), schedule.end()) :
+        std::max_element(schedule.begin(), schedule.end());
+    return it - schedule.begin();
+}
+
+/*
+ * Turns a plain draw into a draw given that it is in stratum h. The weights
+ * are exchangeable, so that is just swapping its smallest (or largest) weight
+ * into place h.
+ */
+void put_in_stratum(vector<double>& schedule, size_t h, strata_t strata){
+    std::iter_swap(schedule.begin() + get_stratum(schedule, strata),
+            schedule.begin() + h);
+}
+
+/*
+ * Same as above, but without a generator. Every call gets the next stream of
+ * a generator seeded once per process, so there is only ever one trip to
+ * std::random_device.
+ */
+vector<double> dirichlet(size_t len, double alpha){
+    static const uint64_t seed = random_seed();
+    static std::atomic<uint64_t> stream(0);
+    philox_t gen(seed, stream++);
+    return dirichlet(len, alpha, gen);
+}
+
 /*
  * Helper function when I just want a uniform vector.
  */
@@ -82,6 +246,251 @@ auto dirichlet(size_t len){
     return dirichlet(len, (double)len);
 }
 
+/*
+ * a*b and a+b, or an error if the answer doesn't fit in a size_t. For
+ * counting the default schedules.
+ */
+size_t checked_mul(size_t a, size_t b){
+    size_t r;
+    if(__builtin_mul_overflow(a, b, &r)){
+        throw std::runtime_error("Too many default schedules to count");
+    }
+    return r;
+}
+
+size_t checked_add(size_t a, size_t b){
+    size_t r;
+    if(__builtin_add_overflow(a, b, &r)){
+        throw std::runtime_error("Too many default schedules to count");
+    }
+    return r;
+}
+
+/*
+ * Runs f(0), f(1), ..., f(threads-1), each on its own thread, and waits for
+ * all of them to finish. With only one thread we just call f directly, so a
+ * serial run doesn't pay for a thread at all.
+ */
+void run_workers(size_t threads, const std::function<void(size_t)>& f){
+    if(threads <= 1){
+        f(0);
+        return;
+    }
+    vector<std::thread> pool;
+    pool.reserve(threads);
+    for(size_t t = 0; t < threads; ++t){
+        pool.emplace_back(f, t);
+    }
+    for(auto&& th : pool){
+        th.join();
+    }
+}
+
+/*
+ * The schedules and topologies for a batch of trials, indexed from the first
+ * trial in the batch. Workers fill in their own part of it, and the log is
+ * written from it in trial order once the batch is done.
+ */
+struct trial_batch_t{
+    size_t begin;
+    vector<vector<double>> schedules;
+    vector<topology_key_t> keys;
+    //the decision margin of each trial's tree
+    vector<double> margins;
+    //how many schedules each trial stands for, if it isn't just itself. Zero
+    //means an ordinary trial.
+    vector<size_t> weights;
+};
+
+/*
+ * The state each worker thread keeps for itself. The newick string for a
+ * topology is only made the first time it turns up. names holds the ones from
+ * earlier batches, and is only read while a batch is running. Anything new
+ * goes in new_names, which gets merged into names between batches.
+ */
+struct trial_thread_t{
+    topology_names_t new_names;
+    const topology_names_t* names;
+    //the join sequence of the last tree this worker made, see nj_with_hint()
+    vector<std::pair<size_t, size_t>> joins;
+};
+
+/*
+ * Records the topology of a trial's tree in the batch, given the distance
+ * table d and the join sequence NJ made from it. The branch lengths are never
+ * used, so the key comes straight from the join sequence, and the tree is
+ * only made, with nj_with_joins(), for its newick string, the first time a
+ * topology turns up. The tree gets rerooted, so the newick string for a
+ * topology is always the same.
+ */
+void record_topology(const vector<double>& d,
+        const vector<std::pair<size_t, size_t>>& joins, const star_t& star,
+        const string& outgroup, size_t i, trial_batch_t& batch,
+        trial_thread_t& ctx){
+    const auto& labels = star.get_labels();
+    auto key = nj_topology_key(joins, labels.size());
+    batch.keys[i-batch.begin] = key;
+    if(ctx.names->count(key) == 0 && ctx.new_names.count(key) == 0){
+        ctx.new_names[key] = nj_with_joins(d, labels, joins)
+            .set_outgroup(outgroup).sort().clear_weights().to_string();
+    }
+}
+
+/*
+ * Finds the topologies for a block of schedules, for the trials first,
+ * first+1, and so on. The matrices for the whole block are made in one go,
+ * and NJ is warm started from the last tree the worker made, which doesn't
+ * change the tree. The margins are those of the schedules as they were
+ * drawn, which add up to one.
+ */
+void record_block(const star_t& star, const string& outgroup,
+        const vector<vector<double>>& block, size_t first,
+        trial_batch_t& batch, trial_thread_t& ctx){
+    auto dists = star.calc_average_distances(block);
+    size_t row_size = star.get_labels().size();
+    vector<std::pair<size_t, size_t>> made;
+    for(size_t i = 0; i < block.size(); ++i){
+        double margin;
+        nj_sequence_with_hint(dists[i], row_size, ctx.joins, made, &margin,
+                star.get_nj_search(), star.get_nj_threads());
+        ctx.joins.swap(made);
+        record_topology(dists[i], ctx.joins, star, outgroup, first+i, batch,
+                ctx);
+        batch.margins[first+i-batch.begin] = margin;
+    }
+}
+
+/*
+ * A worker runs the trials [lo, hi) and puts the results in the batch.
+ */
+typedef std::function<void(size_t, size_t, trial_batch_t&, trial_thread_t&)>
+    trial_worker_t;
+
+/*
+ * A stop rule looks at the counts after the first n trials, and says if we
+ * can stop there.
+ */
+typedef std::function<bool(size_t, const topology_counts_t&)> stop_rule_t;
+
+/*
+ * A batch hook gets called after each batch is counted and logged, with the
+ * number of trials done so far.
+ */
+typedef std::function<void(size_t, const topology_counts_t&,
+        const topology_names_t&)> batch_hook_t;
+
+/*
+ * How long a run has to do its trials in, from when it started. With no
+ * seconds, there is no limit.
+ */
+struct time_budget_t{
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    double seconds = 0.0;
+
+    double elapsed() const{
+        std::chrono::duration<double> d = std::chrono::steady_clock::now()
+            - start;
+        return d.count();
+    }
+
+    bool spent() const{ return seconds > 0.0 && elapsed() >= seconds; }
+};
+
+/*
+ * Runs trials [first, trials) in batches, adding them to counts. Each batch is cut into one contiguous
+ * chunk of chunk_size trials per worker thread. A trial that a worker gave a
+ * weight counts that many times, and is logged with it. The results of a batch are
+ * counted and logged in trial order once the batch is done. Fills in names
+ * with the newick string of every topology that was found, and margins with
+ * the decision margins of the trials that gave each one.
+ *
+ * If there is a stop rule, it gets asked every CONVERGENCE_INTERVAL trials,
+ * and when it says yes, the rest of the trials are dropped and trials is set
+ * to the number that were kept. Since it is asked at the same trials no
+ * matter how the batches fall, the number of threads doesn't change where a
+ * run stops.
+ *
+ * If there is a time budget, it gets checked after each batch, and once it is
+ * spent trials is set to the end of that batch, and the rest are dropped. A
+ * batch is never cut short. The progress bar then shows the seconds used out
+ * of the budget instead of the trials.
+ */
+void run_trials(size_t first, size_t& trials, size_t threads,
+        size_t chunk_size, const trial_worker_t& worker, schedule_log_t& log,
+        topology_counts_t& counts, topology_names_t& names,
+        topology_margins_t& margins, const stop_rule_t& stop = stop_rule_t(),
+        const batch_hook_t& after_batch = batch_hook_t(),
+        const time_budget_t* budget = nullptr){
+    if(threads == 0){ threads = 1; }
+    vector<trial_thread_t> thread_state(threads);
+    for(auto& ts : thread_state){
+        ts.names = &names;
+    }
+
+    const size_t batch_size = chunk_size * threads;
+    trial_batch_t batch;
+    batch.schedules.resize(batch_size);
+    batch.keys.resize(batch_size);
+    batch.margins.resize(batch_size);
+    batch.weights.resize(batch_size);
+
+    bool timed = budget && budget->seconds > 0.0;
+    auto show_progress = [&](size_t done){
+        if(timed){
+            size_t total = (size_t)std::ceil(budget->seconds);
+            print_progress(std::min((size_t)budget->elapsed(), total), total);
+        }
+        else{
+            print_progress(done, trials);
+        }
+    };
+    show_progress(first);
+    for(size_t begin = first; begin < trials; begin += batch_size){
+        size_t end = std::min(begin + batch_size, trials);
+        batch.begin = begin;
+        std::fill(batch.weights.begin(), batch.weights.end(), 0);
+        run_workers(threads, [&](size_t t){
+            size_t lo = std::min(begin + t*chunk_size, end);
+            size_t hi = std::min(lo + chunk_size, end);
+            if(lo == hi) return;
+            worker(lo, hi, batch, thread_state[t]);
+        });
+        for(auto& ts : thread_state){
+            names.insert(ts.new_names.begin(), ts.new_names.end());
+            ts.new_names.clear();
+        }
+        for(size_t i = begin; i < end; ++i){
+            auto& key = batch.keys[i-begin];
+            size_t weight = batch.weights[i-begin];
+            double margin = batch.margins[i-begin];
+            if(weight == 0){
+                counts[key] += 1;
+                margins[key].add(margin, 1.0);
+            }
+            else{
+                counts[key] += weight;
+                margins[key].add(margin, (double)weight);
+                log.set_importance((double)weight);
+            }
+            log.write(i, key, names.at(key), batch.schedules[i-begin],
+                    margin);
+            if(stop && (i+1) % CONVERGENCE_INTERVAL == 0 && stop(i+1, counts)){
+                trials = i+1;
+                break;
+            }
+        }
+        if(after_batch && end <= trials){
+            after_batch(end, counts, names);
+        }
+        show_progress(std::min(end, trials));
+        if(timed && end < trials && budget->spent()){
+            trials = end;
+        }
+    }
+    finish_progress();
+}
+
 /*
  * Since we can set the weights on the tree to various weights, as long as we
  * follow a schedule, we can try and find an some error if we play with the
@@ -94,40 +503,267 @@ auto dirichlet(size_t len){
  * string associated with the tree. The second in the pair is the "support" for
  * the tree as a ratio. The ratio is the number of times the tree was produce
  * over the total trials.
+ *
+ * The default schedules are every non-zero vector of zeros and ones. Some of
+ * the depths never count, and some can be traded for each other (see
+ * star_t::calc_schedule_classes()), so most of them are the same as some
+ * other one. A schedule of zeros and ones only counts through the number of
+ * ones k(c) it has in each class c, and through those only up to scale, so
+ * (1,2) and (2,4) are the same. So we go through every k with no common
+ * factor, and each of those is a kind of schedule, which stands for
+ *      2^r * (sum over t of product over c of choose(g(c), t*k(c)))
+ * schedules, where g(c) is the size of class c, and r the number of depths
+ * that don't count. The schedules with ones only on depths that don't count
+ * are one more kind, with 2^r - 1 schedules. That adds up to every non zero
+ * schedule.
+ *
+ * The schedules of a kind only have the same tables up to rounding, though,
+ * so if NJ has to break a tie on them, they can still go different ways. So
+ * first each kind gets checked with nj_is_clear(), on its representative, the
+ * schedule with ones on the first k(c) depths of each class. A kind without a
+ * tie is run once, from that schedule, and counted for every schedule it
+ * stands for. The schedules of a kind with a tie are all run one by one, like
+ * they would be without the classes, so the result is always the same as
+ * running every schedule. The ones only on depths that don't count always
+ * have a tie, since every pair has the same Q value.
+ *
+ * The schedules of a kind with a tie go in an order where one mostly changes
+ * just a depth or two from the one before. So instead of making each matrix
+ * from the count table, a worker keeps the sums of
+ * star_t::calc_ancestor_sums() for the last one it ran, and brings them up to
+ * date one changed depth at a time. The sums are exact for 0/1 schedules, so
+ * the matrices are the same to the last bit either way.
+ *
+ * There are 2^depth - 1 schedules, so the gene trees have to be less than
+ * MAX_DEFAULT_DEPTH deep for them to be counted at all.
+ *
+ * The log gets one line per kind without a tie, with the number of schedules
+ * it stands for as the importance weight, and one line, with weight one, for
+ * each schedule of a kind with a tie. The margins are divided by the number of
+ * ones in the schedule, so they are for the schedule scaled to add up to one,
+ * like the other runs' margins.
  */
-vector<std::pair<string, double>> gstar_with_default_schedule(
-        star_t& star, const string& logfile, const string& outgroup){
-
+gstar_result_t gstar_with_default_schedule(const star_t& star,
+        const gstar_options_t& opts, const string& outgroup){
     size_t max_depth = star.get_size();
-    vector<double> schedule(max_depth, 0.0);
-    unordered_map<string, int> counts;
-
-    ofstream outfile(logfile.c_str());
-    outfile<<"using root: '"<<outgroup<<"'"<<std::endl;
-
-    size_t trials = (1<<max_depth) - 1;
-    print_progress(0ul, trials);
-
-    for(size_t i=0;i<trials;++i){
-        if(i % 100 == 0) {print_progress(i,trials);}
-        schedule[0]+=1.0;
-        for(size_t k = 0;k<schedule.size()-1;++k){
-            if(schedule[k]>1.0){
-                schedule[k]=0.0;
-                schedule[k+1]+=1.0;
+    if(max_depth >= MAX_DEFAULT_DEPTH){
+        throw std::runtime_error("The default schedule has 2^"
+                + std::to_string(max_depth) + " - 1 schedules, which is too "
+                "many to count, use random schedules instead");
+    }
+    size_t row_size = star.get_labels().size();
+    const auto& classes = star.get_schedule_classes();
+    size_t class_count = star.get_class_count();
+    vector<vector<size_t>> class_depths(class_count);
+    vector<size_t> unused;
+    for(size_t d = 0; d < max_depth; ++d){
+        if(classes[d] == NO_SCHEDULE_CLASS){
+            unused.push_back(d);
+            continue;
+        }
+        class_depths[classes[d]].push_back(d);
+    }
+
+    vector<vector<size_t>> choose(max_depth+1);
+    for(size_t n = 0; n <= max_depth; ++n){
+        choose[n].assign(n+1, 1);
+        for(size_t k = 1; k < n; ++k){
+            choose[n][k] = choose[n-1][k-1] + choose[n-1][k];
+        }
+    }
+    auto binomial = [&](size_t n, size_t k){
+        return k > n ? 0 : choose[n][k];
+    };
+
+    //the kinds, as the counts k(c) in mixed radix, with how many schedules
+    //each stands for
+    vector<uint64_t> codes;
+    vector<size_t> multiplicity;
+    size_t unused_schedules = (size_t)1 << unused.size();
+    if(!unused.empty()){
+        codes.push_back(0);
+        multiplicity.push_back(unused_schedules - 1);
+    }
+    uint64_t code_count = 1;
+    for(auto& g : class_depths){
+        code_count = checked_mul(code_count, g.size()+1);
+    }
+    auto decode = [&](uint64_t code){
+        vector<size_t> k(class_count);
+        for(size_t c = 0; c < class_count; ++c){
+            k[c] = code % (class_depths[c].size()+1);
+            code /= class_depths[c].size()+1;
+        }
+        return k;
+    };
+    //how many ways there are to put t*k(c) ones in each class c
+    auto class_ways = [&](const vector<size_t>& k, size_t t){
+        size_t ways = 1;
+        for(size_t c = 0; c < class_count && ways; ++c){
+            ways = checked_mul(ways,
+                    binomial(class_depths[c].size(), t*k[c]));
+        }
+        return ways;
+    };
+    for(uint64_t code = 1; code < code_count; ++code){
+        auto k = decode(code);
+        size_t common = 0;
+        for(size_t c = 0; c < class_count; ++c){
+            size_t a = common, b = k[c];
+            while(b){
+                size_t tmp = a % b;
+                a = b;
+                b = tmp;
+            }
+            common = a;
+        }
+        if(common != 1) continue;
+        size_t total = 0;
+        for(size_t t = 1; ; ++t){
+            size_t ways = class_ways(k, t);
+            if(ways == 0) break;
+            total = checked_add(total, ways);
+        }
+        codes.push_back(code);
+        multiplicity.push_back(checked_mul(total, unused_schedules));
+    }
+    size_t kinds = codes.size();
+    debug_print("%lu kinds of default schedule", kinds);
+
+    auto representative = [&](size_t kind){
+        vector<double> schedule(max_depth, 0.0);
+        if(codes[kind] == 0){
+            for(auto d : unused) schedule[d] = 1.0;
+        }
+        auto k = decode(codes[kind]);
+        for(size_t c = 0; c < class_count; ++c){
+            for(size_t j = 0; j < k[c]; ++j){
+                schedule[class_depths[c][j]] = 1.0;
             }
         }
-        if(schedule.back()> 1.0){ schedule.back()=0.0;}
+        return schedule;
+    };
+
+    //schedule m of a kind: t, then the depths that are ones in each class,
+    //then the ones on the depths that don't count, which go in Gray code
+    //order so that one schedule to the next usually changes just one depth
+    auto member = [&](size_t kind, size_t m){
+        vector<double> schedule(max_depth, 0.0);
+        size_t u;
+        if(codes[kind] == 0){
+            u = m + 1;
+            m = 0;
+        }
+        else{
+            u = m % unused_schedules;
+            m /= unused_schedules;
+            auto k = decode(codes[kind]);
+            size_t t = 1;
+            for(; m >= class_ways(k, t); ++t){
+                m -= class_ways(k, t);
+            }
+            for(size_t c = 0; c < class_count; ++c){
+                size_t g = class_depths[c].size();
+                size_t ones = t*k[c];
+                size_t ways = binomial(g, ones);
+                size_t rank = m % ways;
+                m /= ways;
+                //the subset with this rank, in the combinatorial number system
+                for(size_t x = g; ones > 0; ){
+                    --x;
+                    if(binomial(x, ones) <= rank){
+                        rank -= binomial(x, ones);
+                        schedule[class_depths[c][x]] = 1.0;
+                        ones--;
+                    }
+                }
+            }
+        }
+        u ^= u >> 1;
+        for(size_t b = 0; b < unused.size(); ++b){
+            if(u & ((size_t)1 << b)) schedule[unused[b]] = 1.0;
+        }
+        return schedule;
+    };
+
+    //which kinds have a tie, and have to be run schedule by schedule
+    vector<char> tied(kinds, 0);
+    size_t threads = std::max(opts.threads, (size_t)1);
+    run_workers(threads, [&](size_t t){
+        for(size_t i = t; i < kinds; i += threads){
+            tied[i] = !nj_is_clear(
+                    star.calc_average_distances(representative(i)), row_size);
+        }
+    });
 
-        string s = star.get_tree(schedule).set_outgroup(outgroup).
-            sort().clear_weights().to_string();
-        write_sequence_to_file(schedule, s, outfile);
-        counts[s] +=1;
+    //the runs: one for each kind without a tie, and one for each schedule of
+    //a kind with one. Kind i starts at run first[i].
+    vector<size_t> first(kinds+1, 0);
+    for(size_t i = 0; i < kinds; ++i){
+        first[i+1] = checked_add(first[i], tied[i] ? multiplicity[i] : 1);
     }
+    debug_print("%lu runs for the default schedule", first[kinds]);
 
-    print_progress(trials, trials);
-    finish_progress();
-    return make_return_vector(counts, trials);
+    schedule_log_t log;
+    log.create(opts.logfile, opts.log_format, outgroup, max_depth, true,
+            opts.margins);
+
+    //the schedules of a kind with a tie are made from the last one the
+    //worker ran, see star_t::update_ancestor_sums()
+    auto worker = [&](size_t lo, size_t hi, trial_batch_t& batch,
+            trial_thread_t& ctx){
+        vector<std::pair<size_t, size_t>> made;
+        vector<double> last, sums;
+        for(size_t i = lo; i < hi; ++i){
+            size_t kind = std::upper_bound(first.begin(), first.end(), i)
+                - first.begin() - 1;
+            auto& schedule = batch.schedules[i-batch.begin];
+            double ones = 0.0;
+            vector<double> d;
+            if(tied[kind]){
+                schedule = member(kind, i - first[kind]);
+                if(sums.empty()){
+                    sums = star.calc_ancestor_sums(schedule);
+                }
+                else{
+                    for(size_t k = 0; k < max_depth; ++k){
+                        if(schedule[k] != last[k]){
+                            star.update_ancestor_sums(sums, k,
+                                    schedule[k] - last[k]);
+                        }
+                    }
+                }
+                last = schedule;
+                for(auto w : schedule) ones += w;
+                d = star.calc_distances_from_sums(sums, ones);
+                batch.weights[i-batch.begin] = 1;
+            }
+            else{
+                schedule = representative(kind);
+                for(auto w : schedule) ones += w;
+                d = star.calc_average_distances(schedule);
+                batch.weights[i-batch.begin] = multiplicity[kind];
+            }
+            double margin;
+            nj_sequence_with_hint(d, row_size, ctx.joins, made, &margin,
+                    star.get_nj_search(), star.get_nj_threads());
+            ctx.joins.swap(made);
+            record_topology(d, ctx.joins, star, outgroup, i, batch, ctx);
+            batch.margins[i-batch.begin] = margin/ones;
+        }
+    };
+    topology_counts_t counts;
+    topology_names_t names;
+    topology_margins_t margins;
+    size_t runs = first[kinds];
+    run_trials(0, runs, opts.threads, 4*SCHEDULE_BLOCK, worker, log, counts,
+            names, margins);
+    size_t trials = ((size_t)1<<max_depth) - 1;
+    gstar_result_t result;
+    result.trees = make_return_vector(counts, names, trials);
+    result.trials = trials;
+    if(opts.margins) set_result_margins(result, margins, names);
+    return result;
 }
 
 /*
@@ -138,43 +774,563 @@ vector<std::pair<string, double>> gstar_with_default_schedule(
  *
  * Currently, this is by far the preferred method of using GSTAR. There isn't a
  * lot of reason to use the default schedule
+ *
+ * get_tree() doesn't change the star_t, so the workers can all share it. Each
+ * worker draws its schedules SCHEDULE_BLOCK at a time, so that the matrices for
+ * a whole block get made in one pass over the gene tree data.
+ *
+ * With a tolerance, opts.trials is only the most we will run, and we stop as
+ * soon as check_convergence() is happy.
+ *
+ * With a checkpoint file, a snapshot of the counts is written out every so
+ * often by a counts_writer_t, and one more at the end. Taking the snapshot
+ * is just a copy of the counts between batches and a mark() in the log. The
+ * counts writer waits for the log to get to the mark, and saves where that
+ * is in the file with the counts, while the trials carry on. If resume is given, we start from it instead of from scratch.
+ * Since trial i always gets stream i, and the log is cut back to where it was
+ * at the snapshot, the end result is the same as a run that never stopped.
+ *
+ * A shard only runs its slice of the trials, get_shard_range(), and the ratios
+ * it returns are out of the trials in that slice.
+ *
+ * With a quasi random sampler, trial i gets point i of the scrambled sequence
+ * instead of stream i of the generator, so all of the above still holds.
+ *
+ * With a time budget, we stop after the first batch that ends past it, and
+ * the results are the same as a run of that many trials. Which batch that is
+ * depends on how fast the machine is, so this is the one way of running that
+ * can't be repeated exactly, but the trials that did get run are the same as
+ * ever, and the log and the checkpoint say where it stopped.
  */
-vector<std::pair<string, double>> gstar_with_random_schedule(
-        star_t& star, const string& logfile, size_t trials, 
-        const string& outgroup){
+gstar_result_t gstar_with_random_schedule(const star_t& star,
+        const gstar_options_t& opts, const string& outgroup, uint64_t seed,
+        uint64_t input_hash, const counts_file_t* resume,
+        const time_budget_t& budget){
     size_t max_depth = star.get_size();
-    unordered_map<string, int> counts;
+    auto range = get_shard_range(opts.trials, opts.shard, opts.shards);
+    size_t trials = range.second;
+    size_t first = range.first;
+    bool finished = false;
 
-    ofstream outfile(logfile.c_str());
-    outfile<<"using root: '"<<outgroup<<"'"<<std::endl;
+    topology_counts_t counts;
+    topology_names_t names;
+    topology_margins_t margins;
+    schedule_log_t log;
+    if(resume){
+        for(auto& e : resume->entries){
+            counts[e.key] = e.count;
+            names[e.key] = e.newick;
+        }
+        first = range.first + resume->completed;
+        finished = resume->finished;
+        if(finished){
+            trials = first;
+        }
+        log.resume(opts.logfile, opts.log_format, max_depth,
+                resume->log_offset);
+    }
+    else{
+        log.create(opts.logfile, opts.log_format, outgroup, max_depth, false,
+                opts.margins);
+    }
 
-    print_progress(0ul, trials);
-    for(size_t i = 0; i < trials; i++){
-        if(i % 100 == 0) {print_progress(i,trials);}
-        auto schedule = dirichlet(max_depth);
-        string s = star.get_tree(schedule).set_outgroup(outgroup).
-            sort().clear_weights().to_string();
-        write_sequence_to_file(schedule, s, outfile);
-        counts[s]+=1;
+    auto snapshot = [&](size_t done, bool done_all, uint64_t log_offset){
+        counts_file_t cf;
+        cf.seed = seed;
+        cf.input_hash = input_hash;
+        cf.begin = range.first;
+        cf.end = range.second;
+        cf.completed = done - range.first;
+        cf.log_offset = log_offset;
+        cf.finished = done_all;
+        cf.entries.reserve(counts.size());
+        for(auto&& kv : counts){
+            cf.entries.push_back({kv.first, kv.second, names.at(kv.first)});
+        }
+        return cf;
+    };
+    counts_writer_t writer(opts.checkpoint);
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    batch_hook_t after_batch;
+    if(!opts.checkpoint.empty()){
+        after_batch = [&](size_t done, const topology_counts_t&,
+                const topology_names_t&){
+            auto now = std::chrono::steady_clock::now();
+            std::chrono::duration<double> since = now - last_checkpoint;
+            if(writer.busy() || since.count() < opts.checkpoint_interval){
+                return;
+            }
+            uint64_t mark = log.mark();
+            writer.write(snapshot(done, false, 0),
+                    [&log, mark]{ return log.offset_at(mark); });
+            last_checkpoint = now;
+        };
     }
-    print_progress(trials, trials);
-    finish_progress();
-    return make_return_vector(counts, trials);
+
+    std::unique_ptr<qmc_t> qmc;
+    if(opts.sampler != sampler_t::random){
+        qmc.reset(new qmc_t(opts.sampler, max_depth, seed));
+    }
+
+    auto worker = [&](size_t lo, size_t hi, trial_batch_t& batch,
+            trial_thread_t& ctx){
+        vector<double> u(max_depth);
+        vector<double> drawn(SCHEDULE_BLOCK*max_depth);
+        for(size_t b = lo; b < hi; b += SCHEDULE_BLOCK){
+            size_t e = std::min(b + SCHEDULE_BLOCK, hi);
+            vector<vector<double>> block;
+            block.reserve(e-b);
+            if(!qmc){
+                dirichlet_block(seed, b, e-b, max_depth, opts.alpha,
+                        drawn.data());
+            }
+            for(size_t i = b; i < e; ++i){
+                if(qmc){
+                    qmc->point(i, u.data());
+                    block.push_back(uniform_simplex(u.data(), max_depth));
+                    continue;
+                }
+                auto s = drawn.begin() + (i-b)*max_depth;
+                block.emplace_back(s, s + max_depth);
+            }
+            record_block(star, outgroup, block, b, batch, ctx);
+            for(size_t i = b; i < e; ++i){
+                batch.schedules[i-batch.begin].swap(block[i-b]);
+            }
+        }
+    };
+    stop_rule_t stop;
+    if(opts.tolerance > 0.0){
+        stop = [&](size_t n, const topology_counts_t& counts){
+            return check_convergence(counts, n, opts.tolerance, opts.top_k);
+        };
+    }
+    size_t started = first;
+    auto run_start = std::chrono::steady_clock::now();
+    if(!finished){
+        run_trials(first, trials, opts.threads, 4*SCHEDULE_BLOCK, worker,
+                log, counts, names, margins, stop, after_batch, &budget);
+    }
+    std::chrono::duration<double> run_time = std::chrono::steady_clock::now()
+        - run_start;
+    if(!opts.checkpoint.empty()){
+        writer.finish();
+        write_counts_file(opts.checkpoint,
+                snapshot(trials, true, log.flush()));
+    }
+    gstar_result_t result;
+    result.seed = seed;
+    result.trees = make_return_vector(counts, names, trials - range.first);
+    result.trials = trials - range.first;
+    result.converged = opts.tolerance <= 0.0
+        || check_convergence(counts, trials, opts.tolerance, opts.top_k);
+    if(run_time.count() > 0.0){
+        result.trials_per_second = (trials - started)/run_time.count();
+    }
+    if(opts.margins) set_result_margins(result, margins, names);
+    return result;
 }
 
-vector<std::pair<string, double>> gstar(const vector<string>& newick_strings,
-        size_t trials, string filename, string outgroup){
+/*
+ * Splits trials over the strata. IMPORTANCE_FLOOR of them are split evenly,
+ * and the rest in proportion to spread, the standard deviation of the topology
+ * in each stratum. That is Neyman allocation, which gives the smallest
+ * variance for the ratios when the strata are equally likely. Rounding is done
+ * by largest remainder, so the shares add up to trials exactly. Every stratum
+ * gets at least one trial, as long as trials is at least
+ * strata/IMPORTANCE_FLOOR.
+ */
+vector<size_t> allocate_strata(const vector<double>& spread, size_t trials){
+    size_t strata = spread.size();
+    double total_spread = 0.0;
+    for(auto s : spread) total_spread += s;
+
+    vector<double> share(strata);
+    for(size_t h = 0; h < strata; ++h){
+        double neyman = total_spread > 0.0 ? spread[h]/total_spread
+            : 1.0/strata;
+        share[h] = trials*(IMPORTANCE_FLOOR/strata
+                + (1.0-IMPORTANCE_FLOOR)*neyman);
+    }
+
+    vector<size_t> ret(strata);
+    vector<size_t> order(strata);
+    size_t given = 0;
+    for(size_t h = 0; h < strata; ++h){
+        ret[h] = std::max((size_t)1, (size_t)share[h]);
+        given += ret[h];
+        order[h] = h;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b){
+        return share[a] - ret[a] > share[b] - ret[b];
+    });
+    for(size_t i = 0; given < trials; ++i, ++given){
+        ret[order[i]]++;
+    }
+    return ret;
+}
+
+/*
+ * How much the topology varies within each stratum of the pilot trials, as
+ * the standard deviation of its indicator, summed over topologies. A stratum
+ * with too few trials to tell is taken to vary as much as it can.
+ */
+vector<double> calc_strata_spread(const vector<topology_key_t>& keys,
+        const vector<uint32_t>& strata, size_t count){
+    vector<unordered_map<topology_key_t, size_t>> counts(count);
+    vector<size_t> trials(count, 0);
+    for(size_t i = 0; i < keys.size(); ++i){
+        counts[strata[i]][keys[i]]++;
+        trials[strata[i]]++;
+    }
+    vector<double> spread(count, 1.0);
+    for(size_t h = 0; h < count; ++h){
+        double n = trials[h];
+        if(n < 2) continue;
+        double sum_sq = 0.0;
+        for(auto&& kv : counts[h]){
+            sum_sq += (kv.second/n)*(kv.second/n);
+        }
+        spread[h] = std::sqrt(std::max(0.0, (1.0 - sum_sq)*n/(n-1)));
+    }
+    return spread;
+}
+
+/*
+ * Random schedules, but with more of the trials spent where the topology is
+ * still in doubt. Most schedules give the same topology, so with plain random
+ * schedules the rare ones take a very long time to show up, and longer still
+ * to pin down.
+ *
+ * The schedules are split into strata by which of the weights is the
+ * smallest, or by which is the largest. Either way each stratum is equally
+ * likely, and put_in_stratum() can make a draw from just one. First, a pilot of
+ * plain random schedules is run, and we work out how much the topology varies
+ * within each stratum, both ways. Whichever way of splitting promises the
+ * smaller variance (the square of the mean spread, for Neyman allocation) is
+ * used for the rest of the trials, which allocate_strata() shares out between
+ * the strata.
+ *
+ * The ratios are corrected so that they stay unbiased. A pilot trial counts
+ * once, and a later trial from stratum h counts rest/(strata*n_h) times, where
+ * rest is the trials after the pilot and n_h of them went to stratum h. The
+ * counts add up to the number of trials, so the ratios still add up to one.
+ * That weight is logged with each trial.
+ *
+ * Trial i still draws from stream i of the seed. After the pilot the strata
+ * are run one after the other. Since the split depends on the whole pilot,
+ * this can't stop early, be resumed or be sharded.
+ */
+gstar_result_t gstar_with_importance_schedule(const star_t& star,
+        const gstar_options_t& opts, const string& outgroup, uint64_t seed){
+    size_t len = star.get_size();
+    size_t pilot = std::max(opts.pilot == 0 ? opts.trials/10 : opts.pilot,
+            2*len);
+    size_t least = pilot + (size_t)std::ceil(len/IMPORTANCE_FLOOR);
+    if(opts.trials < least){
+        throw std::runtime_error("Importance sampling needs at least "
+                + std::to_string(least) + " trials");
+    }
+    size_t rest = opts.trials - pilot;
+
+    schedule_log_t log;
+    log.create(opts.logfile, opts.log_format, outgroup, len, true,
+            opts.margins);
+    topology_counts_t counts;
+    topology_names_t names;
+    topology_margins_t margins;
+
+    //the pilot keeps the topology and both strata of each trial
+    vector<topology_key_t> pilot_keys(pilot);
+    vector<uint32_t> smallest(pilot), largest(pilot);
+    bool in_pilot = true;
+    size_t stratum = 0;
+    strata_t strata = strata_t::smallest;
+    auto worker = [&](size_t lo, size_t hi, trial_batch_t& batch,
+            trial_thread_t& ctx){
+        vector<double> drawn(SCHEDULE_BLOCK*len);
+        for(size_t b = lo; b < hi; b += SCHEDULE_BLOCK){
+            size_t e = std::min(b + SCHEDULE_BLOCK, hi);
+            vector<vector<double>> block;
+            block.reserve(e-b);
+            dirichlet_block(seed, b, e-b, len, opts.alpha, drawn.data());
+            for(size_t i = b; i < e; ++i){
+                auto s = drawn.begin() + (i-b)*len;
+                block.emplace_back(s, s + len);
+                if(!in_pilot){
+                    put_in_stratum(block.back(), stratum, strata);
+                }
+            }
+            record_block(star, outgroup, block, b, batch, ctx);
+            for(size_t i = b; i < e; ++i){
+                if(in_pilot){
+                    pilot_keys[i] = batch.keys[i-batch.begin];
+                    smallest[i] = get_stratum(block[i-b], strata_t::smallest);
+                    largest[i] = get_stratum(block[i-b], strata_t::largest);
+                }
+                batch.schedules[i-batch.begin].swap(block[i-b]);
+            }
+        }
+    };
+    run_trials(0, pilot, opts.threads, 4*SCHEDULE_BLOCK, worker, log, counts,
+            names, margins);
+    unordered_map<topology_key_t, double> weighted(counts.begin(),
+            counts.end());
+
+    auto spread = calc_strata_spread(pilot_keys, smallest, len);
+    auto by_largest = calc_strata_spread(pilot_keys, largest, len);
+    double mean = 0.0, mean_by_largest = 0.0;
+    for(size_t h = 0; h < len; ++h){
+        mean += spread[h]/len;
+        mean_by_largest += by_largest[h]/len;
+    }
+    if(mean_by_largest < mean){
+        strata = strata_t::largest;
+        spread.swap(by_largest);
+    }
+    debug_print("importance strata by %s weight, mean spread %f",
+            strata == strata_t::smallest ? "smallest" : "largest",
+            std::min(mean, mean_by_largest));
+
+    auto allocation = allocate_strata(spread, rest);
+    in_pilot = false;
+    size_t first = pilot;
+    for(stratum = 0; stratum < len; ++stratum){
+        double w = (double)rest/(len*allocation[stratum]);
+        size_t end = first + allocation[stratum];
+        counts.clear();
+        topology_margins_t stratum_margins;
+        log.set_importance(w);
+        run_trials(first, end, opts.threads, 4*SCHEDULE_BLOCK, worker, log,
+                counts, names, stratum_margins);
+        for(auto&& kv : counts){
+            weighted[kv.first] += w*kv.second;
+        }
+        for(auto&& kv : stratum_margins){
+            margins[kv.first].merge(kv.second, w);
+        }
+        first = end;
+    }
+
+    gstar_result_t result;
+    result.seed = seed;
+    result.trials = opts.trials;
+    for(auto&& kv : weighted){
+        result.trees.push_back(std::make_pair(names.at(kv.first),
+                    kv.second/opts.trials));
+    }
+    if(opts.margins) set_result_margins(result, margins, names);
+    return result;
+}
+
+/*
+ * Instead of sampling schedules, this works out how much of the simplex of
+ * schedules gives each topology, using partition_simplex(). The regions are
+ * the join sequences of NJ, since each of those is a convex region (see
+ * partition.h), and a topology is the union of the regions of all the join
+ * sequences that make it.
+ *
+ * The simplex is cut into up to opts.exact pieces, and each costs one NJ run
+ * for its centre, and one pass through nj_allows() for each of its corners,
+ * so this gets expensive quickly as the gene trees get deeper. Whatever is
+ * left unsettled shows up in the bounds. Uniform random schedules are spread
+ * evenly over the simplex, so these shares are what a random run with
+ * infinitely many trials would give, give or take rounding at the boundaries.
+ * The exception is when two Q values are the same for every schedule, which
+ * happens with only a few gene trees. A random run then picks between them
+ * on rounding error, while here the tie always goes the same way, see
+ * nj_joins().
+ *
+ * Nothing gets logged, since there are no trials.
+ */
+gstar_result_t gstar_with_exact_partition(const star_t& star,
+        const gstar_options_t& opts, const string& outgroup){
+    const auto& labels = star.get_labels();
+    std::map<vector<std::pair<size_t, size_t>>, size_t> region_ids;
+    vector<vector<std::pair<size_t, size_t>>> regions;
+    vector<topology_key_t> region_keys;
+    topology_names_t names;
+
+    auto locate = [&](const vector<double>& schedule){
+        auto d = star.calc_average_distances(schedule);
+        auto joins = nj_joins(d, labels.size());
+        auto it = region_ids.find(joins);
+        if(it != region_ids.end()) return it->second;
+        auto key = nj_topology_key(joins, labels.size());
+        if(names.count(key) == 0){
+            names[key] = nj_with_joins(d, labels, joins).set_outgroup(outgroup)
+                .sort().clear_weights().to_string();
+        }
+        size_t id = regions.size();
+        region_ids[joins] = id;
+        regions.push_back(std::move(joins));
+        region_keys.push_back(key);
+        return id;
+    };
+    auto allows = [&](size_t region, const vector<double>& schedule){
+        return nj_allows(star.calc_average_distances(schedule), labels.size(),
+                regions[region]);
+    };
+    auto part = partition_simplex(star.get_size(), opts.exact, locate, allows);
+
+    //certain and guessed share of each topology
+    unordered_map<topology_key_t, std::pair<double, double>> shares;
+    gstar_result_t result;
+    for(size_t r = 0; r < regions.size(); ++r){
+        shares[region_keys[r]].first += part.certain[r];
+        shares[region_keys[r]].second += part.unresolved[r];
+        result.unresolved += part.unresolved[r];
+    }
+    for(auto&& kv : shares){
+        double certain = kv.second.first;
+        if(certain == 0.0 && kv.second.second == 0.0) continue;
+        result.trees.push_back(std::make_pair(names.at(kv.first),
+                    certain + kv.second.second));
+        result.bounds.push_back(std::make_pair(certain,
+                    certain + result.unresolved));
+    }
+    result.trials = part.pieces;
+    return result;
+}
+
+gstar_result_t gstar_run(const vector<string>& newick_strings,
+        const gstar_options_t& opts){
+    time_budget_t budget;
+    budget.seconds = opts.time_budget;
     star_t star(newick_strings);
+    star.set_nj_search(opts.nj_search);
+    star.set_nj_threads(opts.nj_threads);
+    string outgroup = opts.outgroup;
     if(!outgroup.empty()){
         star.set_outgroup(outgroup);
     }
     else{
         outgroup = star.get_first_label();
     }
-    if(trials==0){
-        return gstar_with_default_schedule(star, filename, outgroup);
+    if(!(opts.alpha > 0.0) || !std::isfinite(opts.alpha)){
+        throw std::runtime_error("The Dirichlet alpha has to be more than 0");
     }
-    else{
-        return gstar_with_random_schedule(star, filename, trials, outgroup);
+    if(opts.alpha != 1.0 && (opts.trials == 0 || opts.exact > 0
+                || opts.sampler != sampler_t::random)){
+        throw std::runtime_error("Only the plain random schedules can have "
+                "an alpha other than 1");
+    }
+    if(opts.margins && (opts.exact > 0 || opts.resume)){
+        throw std::runtime_error("Margins need every trial to be run, so they "
+                "can't be used with an exact run or a resumed one");
+    }
+    if(opts.time_budget > 0.0 && (opts.trials == 0 || opts.importance
+                || opts.exact > 0 || opts.shards > 1)){
+        throw std::runtime_error("A time budget only works with random "
+                "schedules, and not with importance sampling or shards");
+    }
+    if(opts.exact > 0){
+        if(opts.trials > 0 || opts.importance || opts.tolerance > 0.0
+                || opts.shards > 1 || !opts.checkpoint.empty()
+                || opts.resume){
+            throw std::runtime_error("An exact run doesn't draw schedules, so "
+                    "it can't be used with trials, a tolerance, importance "
+                    "sampling, checkpoints or shards");
+        }
+        return gstar_with_exact_partition(star, opts, outgroup);
+    }
+    if(opts.trials==0){
+        if(opts.importance || !opts.checkpoint.empty() || opts.resume
+                || opts.shards > 1){
+            throw std::runtime_error("Importance sampling, checkpoints and "
+                    "shards only work with random schedules");
+        }
+        return gstar_with_default_schedule(star, opts, outgroup);
+    }
+    if(opts.importance){
+        if(opts.tolerance > 0.0 || opts.shards > 1 || !opts.checkpoint.empty()
+                || opts.resume || opts.sampler != sampler_t::random){
+            throw std::runtime_error("Importance sampling can't be used with "
+                    "a tolerance, checkpoints, shards or another sampler");
+        }
+        uint64_t seed = opts.seed == 0 ? random_seed() : opts.seed;
+        return gstar_with_importance_schedule(star, opts, outgroup, seed);
+    }
+    if(opts.shards == 0 || opts.shard >= opts.shards){
+        throw std::runtime_error("Shard " + std::to_string(opts.shard)
+                + "/" + std::to_string(opts.shards) + " doesn't exist");
+    }
+    if(opts.shards > 1 && opts.tolerance > 0.0){
+        throw std::runtime_error("A sharded run can't stop early, since no "
+                "shard sees all of the counts");
+    }
+    if(opts.sampler == sampler_t::sobol && opts.trials > SOBOL_MAX_POINTS){
+        throw std::runtime_error("The sobol sampler only has "
+                + std::to_string(SOBOL_MAX_POINTS) + " points");
+    }
+    uint64_t input_hash = hash_inputs(newick_strings, opts.outgroup);
+    //so that a checkpoint isn't carried on with different schedules
+    if(opts.sampler != sampler_t::random){
+        input_hash ^= hash_inputs({sampler_name(opts.sampler)}, "");
+    }
+    if(opts.alpha != 1.0){
+        char buf[DTOA_BUFFER_SIZE];
+        string alpha(buf, format_double(opts.alpha, buf));
+        input_hash ^= hash_inputs({"alpha " + alpha}, "");
+    }
+    uint64_t seed = opts.seed == 0 ? random_seed() : opts.seed;
+    if(opts.resume && opts.checkpoint.empty()){
+        throw std::runtime_error("There is no checkpoint file to resume "
+                "from");
     }
+    if(!opts.resume){
+        return gstar_with_random_schedule(star, opts, outgroup, seed,
+                input_hash, nullptr, budget);
+    }
+    auto cf = read_counts_file(opts.checkpoint);
+    if(cf.input_hash != input_hash){
+        throw std::runtime_error("Checkpoint '" + opts.checkpoint
+                + "' was made with different gene trees, outgroup or "
+                "sampler");
+    }
+    auto range = get_shard_range(opts.trials, opts.shard, opts.shards);
+    if(cf.begin != range.first || cf.end != range.second){
+        throw std::runtime_error("Checkpoint '" + opts.checkpoint
+                + "' was made for trials " + std::to_string(cf.begin) + " to "
+                + std::to_string(cf.end));
+    }
+    if(opts.seed != 0 && opts.seed != cf.seed){
+        throw std::runtime_error("Checkpoint '" + opts.checkpoint
+                + "' was made with seed " + std::to_string(cf.seed));
+    }
+    return gstar_with_random_schedule(star, opts, outgroup, cf.seed,
+            input_hash, &cf, budget);
+}
+
+std::pair<size_t, size_t> get_shard_range(size_t trials, size_t shard,
+        size_t shards){
+    return std::make_pair(trials*shard/shards, trials*(shard+1)/shards);
+}
+
+gstar_result_t gstar_from_counts(const counts_file_t& cf){
+    topology_counts_t counts;
+    topology_names_t names;
+    for(auto& e : cf.entries){
+        counts[e.key] += e.count;
+        names[e.key] = e.newick;
+    }
+    gstar_result_t result;
+    result.seed = cf.seed;
+    result.trials = cf.completed;
+    result.trees = make_return_vector(counts, names, cf.completed);
+    return result;
+}
+
+vector<std::pair<string, double>> gstar(const vector<string>& newick_strings,
+        const gstar_options_t& opts){
+    return gstar_run(newick_strings, opts).trees;
+}
+
+vector<std::pair<string, double>> gstar(const vector<string>& newick_strings,
+        size_t trials, string filename, string outgroup){
+    gstar_options_t opts;
+    opts.trials = trials;
+    opts.logfile = filename;
+    opts.outgroup = outgroup;
+    return gstar(newick_strings, opts);
 }
@@ -1,8 +1,170 @@
+#pragma once
 #include "star.h"
+#include "counts_file.h"
+#include "schedule_log.h"
+#include "qmc.h"
 #include <string>
 #include <vector>
 #include <utility>
+#include <cstdint>
+
+/*
+ * Options for a gstar run.
+ *
+ *  trials:     Number of random schedules to try. Zero means use the default
+ *              schedule instead.
+ *
+ *  threads:    Number of worker threads to spread the trials over.
+ *
+ *  seed:       Seed for the random schedules. Zero means pick one at random.
+ *
+ *  logfile:    File to log the schedules and resulting trees to.
+ *
+ *  log_format: How to write the log, see schedule_log.h.
+ *
+ *  outgroup:   Label of the outgroup taxa. If empty, one is picked.
+ *
+ *  tolerance:  If not zero, stop drawing random schedules once the results
+ *              are stable to within this much, and treat trials as the most
+ *              we are willing to run. See check_convergence().
+ *
+ *  top_k:      How many of the most frequent topologies need to be stable
+ *              before we stop early.
+ *
+ *  checkpoint: File to save the counts of a random schedule run to every
+ *              checkpoint_interval seconds, so that it can be resumed.
+ *
+ *  resume:     Carry on from the checkpoint file instead of starting over.
+ *
+ *  shard:      Which slice of the trials to run, out of shards equal slices.
+ *  shards:     See get_shard_range(). The counts of the slices can be added
+ *              up with merge_counts_files().
+ *
+ *  sampler:    Where the random schedules come from, pseudo random points or
+ *              a scrambled Sobol or Halton sequence. See qmc.h.
+ *
+ *  importance: Spend more of the trials on the schedules where the topology
+ *              is still in doubt, see gstar_with_importance_schedule().
+ *
+ *  pilot:      How many trials to spend finding those schedules. Zero means
+ *              a tenth of the trials.
+ *
+ *  alpha:      The Dirichlet parameter of each weight of the random
+ *              schedules. 1 is uniform over all the schedules, less than 1
+ *              favours schedules with a few big weights, and more than 1
+ *              schedules with the weights all about the same. Only for the
+ *              plain random sampler, see dirichlet.h.
+ *
+ *  exact:      If not zero, don't sample at all. Cut the simplex of schedules
+ *              up into the regions that give each topology instead, looking
+ *              at up to this many pieces of it. See
+ *              gstar_with_exact_partition().
+ *
+ *  margins:    Log the decision margin of each trial's tree, and sum them up
+ *              for each topology in the result. See nj_with_hint().
+ *
+ *  time_budget: If not zero, the seconds of wall clock time the run has,
+ *              counted from when gstar_run() is called. Random schedules are
+ *              run until it is spent, with trials as the most to run, and the
+ *              results are out of the trials that got done.
+ *
+ *  nj_search:  How NJ finds the pair to join at each step. The bounded search
+ *              is quicker for hundreds of taxa, and the trees are the same,
+ *              see nj_search_t.
+ *
+ *  nj_threads: How many threads NJ splits each step of a big table over, on
+ *              top of the threads the trials are run on. Only worth it for
+ *              thousands of taxa and few trials, see nj().
+ */
+struct gstar_options_t{
+    size_t trials = 0;
+    size_t threads = 1;
+    uint64_t seed = 0;
+    std::string logfile;
+    log_format_t log_format = log_format_t::binary32;
+    std::string outgroup;
+    double tolerance = 0.0;
+    size_t top_k = 5;
+    std::string checkpoint;
+    double checkpoint_interval = 60.0;
+    bool resume = false;
+    size_t shard = 0;
+    size_t shards = 1;
+    sampler_t sampler = sampler_t::random;
+    bool importance = false;
+    size_t pilot = 0;
+    double alpha = 1.0;
+    size_t exact = 0;
+    bool margins = false;
+    double time_budget = 0.0;
+    nj_search_t nj_search = nj_search_t::exhaustive;
+    size_t nj_threads = 1;
+};
+
+/*
+ * What a gstar run found.
+ *
+ *  trees:      Pairs of newick strings and the ratio of trials that produced
+ *              them.
+ *
+ *  trials:     Number of trials the ratios are out of. With a tolerance this
+ *              is how many it took to converge.
+ *
+ *  converged:  False if a tolerance was given, but the results were still not
+ *              stable when we ran out of trials.
+ *
+ *  seed:       The seed the random schedules were drawn with.
+ *
+ *  bounds:     Only for an exact run, where trials is the number of pieces
+ *              looked at. For each of the trees, the least and the most its
+ *              ratio can be. The ratio in trees is a guess in between.
+ *
+ *  unresolved: Only for an exact run, the share of the schedules that
+ *              couldn't be pinned down to a topology.
+ *
+ *  margins:    Only if the options asked for them. For each of the trees, the
+ *              mean and the least decision margin of the trials that gave it,
+ *              weighted the same way as the ratios. The margins are for the
+ *              schedules scaled to add up to one. A topology whose trials
+ *              mostly have small margins is only just winning over some
+ *              other one, so its support is fragile.
+ *
+ *  trials_per_second: For random schedules, how many trials this run got
+ *              through a second, not counting any it was resumed from.
+ */
+struct gstar_result_t{
+    std::vector<std::pair<std::string, double>> trees;
+    size_t trials = 0;
+    bool converged = true;
+    uint64_t seed = 0;
+    std::vector<std::pair<double, double>> bounds;
+    double unresolved = 0.0;
+    std::vector<std::pair<double, double>> margins;
+    double trials_per_second = 0.0;
+};
+
+gstar_result_t gstar_run(const std::vector<std::string>&,
+        const gstar_options_t&);
+
+/*
+ * The trials [first, second) that shard of shards runs, out of trials in
+ * total. Trial i draws its schedule from stream i of the seed no matter which
+ * shard runs it, so the slices of any sharding add up to the same counts.
+ */
+std::pair<size_t, size_t> get_shard_range(size_t trials, size_t shard,
+        size_t shards);
+
+/*
+ * Turns the counts saved by a run, or merged from the shards of one, back
+ * into ratios.
+ */
+gstar_result_t gstar_from_counts(const counts_file_t&);
+
+std::vector<std::pair<std::string, double>> gstar
+    (const std::vector<std::string>&, const gstar_options_t&);
 
 std::vector<std::pair<std::string, double>> gstar
     (const std::vector<std::string>&, size_t=0, std::string="",
      std::string="");
+
+double calc_perplexity(const std::vector<std::pair<std::string, double>>&);
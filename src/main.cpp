@@ -3,6 +3,8 @@
 #include "debug.h"
 #include "nj.h"
 #include "gstar.h"
+#include "rng.h"
+#include "counts_file.h"
 #include <iostream>
 using std::cout;
 using std::endl;
@@ -15,6 +17,7 @@ using std::ifstream;
 #include <algorithm>
 //for std::sort
 #include <exception>
+#include <stdexcept>
 #include <cmath>
 #include <getopt.h>
 
@@ -27,17 +30,18 @@ using std::ifstream;
 //dumb hack to get the progress bar crap to work
 bool __PROGRESS_BAR_FLAG__=true;
 
-double calc_perplexity(std::vector<std::pair<std::string, double>> trees){
-    double total = 0;
-    for(auto&& kv : trees){
-        total += -1*std::log2(kv.second) * kv.second;
-    }
-    return std::pow(2, total);
-}
+//Most trials an adaptive run will do if -t isn't given
+const size_t DEFAULT_MAX_TRIALS = 1000000;
+
+//Most trials a run with a time budget will do if -t isn't given, which is as
+//many as the sobol sampler has
+const size_t DEFAULT_BUDGET_TRIALS = (size_t)1 << 32;
 
 void print_usage(){
     std::cout<<
 "Usage: sunstar [options]\n"<<
+"       sunstar merge [-r RATIO] [FILE]...\n"<<
+"       sunstar log-dump [FILE]\n"<<
 "Version: "<<GIT_REV_STRING<<"\n"<<
 "Application Options:\n"<<
 "    -f, --filename [FILE]\n"<<
@@ -51,10 +55,202 @@ void print_usage(){
 "           0 and 1\n"<<
 "    -l, --logfile [FILE]\n"<<
 "           File to log the sequences to (defaults to schedule.log)\n"<<
+"    --log-format [FORMAT]\n"<<
+"           Format of the log: binary (the default, with 32 bit weights),\n"<<
+"           binary64 or json. 'sunstar log-dump' turns a binary log into json\n"<<
 "    -o, --outgroup [STRING]\n"<<
 "           Taxa label of the outgroup of the gene trees\n"<<
 "    -s, --silent\n"<<
-"           Silence the progress bar, only output results\n";
+"           Silence the progress bar, only output results\n"<<
+"    -j, --threads [NUMBER]\n"<<
+"           Number of threads to run trials on (defaults to 1)\n"<<
+"    -S, --seed [NUMBER]\n"<<
+"           Seed for the random schedules. Runs with the same seed produce the\n"<<
+"           same results, regardless of the number of threads\n"<<
+"    -T, --tolerance [NUMBER]\n"<<
+"           Keep drawing random schedules until the ratios of the top trees\n"<<
+"           and the perplexity are stable to within this tolerance. -t then\n"<<
+"           sets the most trials to run (defaults to 1000000)\n"<<
+"    --sampler [SAMPLER]\n"<<
+"           How to draw the random schedules: random (the default), or a\n"<<
+"           scrambled sobol or halton sequence, which cover the schedules more\n"<<
+"           evenly, so the ratios settle down in fewer trials\n"<<
+"    --importance\n"<<
+"           Spend more of the random schedules on the ones where the tree is\n"<<
+"           still in doubt, and weight the ratios so they stay unbiased. The\n"<<
+"           weight of each trial is written to the log\n"<<
+"    --pilot [NUMBER]\n"<<
+"           Number of trials --importance spends looking for those schedules\n"<<
+"           (defaults to a tenth of the trials)\n"<<
+"    --alpha [NUMBER]\n"<<
+"           Dirichlet parameter of each weight of the random schedules. 1, the\n"<<
+"           default, is uniform. Less than 1 favours schedules with a few big\n"<<
+"           weights, more than 1 schedules with the weights all about the same\n"<<
+"    --exact [NUMBER]\n"<<
+"           Instead of sampling, cut the schedules up into the regions that\n"<<
+"           give each tree, looking at up to this many pieces. Prints the\n"<<
+"           least and most each ratio can be next to it, and how much was\n"<<
+"           left unresolved. Only practical for shallow gene trees\n"<<
+"    --margins\n"<<
+"           Log how close each trial came to joining a different pair in NJ,\n"<<
+"           and print the mean and least of those margins next to each tree.\n"<<
+"           A tree with small margins only just beat some other tree\n"<<
+"    --time-budget [SECONDS]\n"<<
+"           Keep drawing random schedules until this much time has gone by,\n"<<
+"           and give the results out of the trials that got done, along with\n"<<
+"           how many trials a second that was. -t then sets the most trials\n"<<
+"           to run (defaults to as many as it takes)\n"<<
+"    --nj-search [SEARCH]\n"<<
+"           How NJ finds the pair to join: exhaustive (the default) looks at\n"<<
+"           every pair, bounded keeps the rows sorted and skips the pairs that\n"<<
+"           can't be the best, which is quicker for hundreds of taxa. The\n"<<
+"           trees are the same\n"<<
+"    --nj-threads [NUMBER]\n"<<
+"           Number of threads to split each step of NJ over, on top of -j,\n"<<
+"           for thousands of taxa and few trials (defaults to 1). The trees\n"<<
+"           are the same\n"<<
+"    -k, --top-k [NUMBER]\n"<<
+"           Number of the top trees that need to be stable for -T\n"<<
+"           (defaults to 5)\n"<<
+"    -c, --checkpoint [FILE]\n"<<
+"           Save the counts of a random schedule run to this file every so\n"<<
+"           often, so that it can be resumed if it gets killed\n"<<
+"    --checkpoint-interval [SECONDS]\n"<<
+"           How often to save a checkpoint (defaults to 60)\n"<<
+"    --resume\n"<<
+"           Carry on the run saved in the checkpoint file. Give the same\n"<<
+"           options as the first run\n"<<
+"    --shard [I/N]\n"<<
+"           Only run the I-th of N equal slices of the trials (counting\n"<<
+"           from 0), and save the counts to the -c file (defaults to\n"<<
+"           shard_I_of_N.counts). The files from all the shards can be added\n"<<
+"           up with 'sunstar merge'\n"<<
+"Merge Options:\n"<<
+"    FILE...\n"<<
+"           Counts files from every shard of one run. Prints the results as\n"<<
+"           if it had been run all at once\n"<<
+"Log Dump Options:\n"<<
+"    FILE\n"<<
+"           A schedule log to write out as json\n";
+}
+
+/*
+ * Prints the trees, most frequent first, followed by the perplexity. Ties are
+ * broken on the newick string, so that the output doesn't depend on the order
+ * the topologies were found in. If the result has bounds, from an exact run,
+ * each ratio is followed by its bounds, and the share left unresolved is
+ * printed at the end. If it has margins, each ratio is followed by the mean
+ * and least decision margin of the tree.
+ */
+void print_trees(const gstar_result_t& result, double threshold){
+    vector<size_t> order(result.trees.size());
+    for(size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b){
+        const auto& lhs = result.trees[a];
+        const auto& rhs = result.trees[b];
+        if(lhs.second != rhs.second){
+            return lhs.second>rhs.second;
+        }
+        return lhs.first<rhs.first;
+    });
+
+    vector<std::pair<string, double>> trees;
+    trees.reserve(order.size());
+    double supressed_total = 0.0;
+    for(auto i : order){
+        const auto& kv = result.trees[i];
+        trees.push_back(kv);
+        if(kv.second<threshold){
+            supressed_total+=kv.second;
+            continue;
+        }
+        std::cout<<"'"<<kv.first<<"' : "<<kv.second;
+        if(!result.bounds.empty()){
+            std::cout<<" ["<<result.bounds[i].first<<", "
+                <<result.bounds[i].second<<"]";
+        }
+        if(!result.margins.empty()){
+            std::cout<<" mean margin "<<result.margins[i].first<<", least "
+                <<result.margins[i].second;
+        }
+        std::cout<<std::endl;
+    }
+    if(supressed_total!=0.0){
+        std::cout<<"Total probability of suppressed trees: "
+            <<supressed_total<<std::endl;
+    }
+    if(!result.bounds.empty()){
+        std::cout<<"Unresolved: "<<result.unresolved<<std::endl;
+    }
+    std::cout<<"Perplexity: "<<calc_perplexity(trees)<<std::endl;
+}
+
+/*
+ * sunstar merge [-r RATIO] FILE...
+ */
+int merge_main(int argc, char** argv){
+    double threshold=0;
+    vector<counts_file_t> files;
+    for(int i = 1; i < argc; ++i){
+        string arg = argv[i];
+        if(arg == "-r" || arg == "--rratio"){
+            if(i+1 == argc){
+                std::cout<<"-r needs an argument"<<std::endl;
+                return 1;
+            }
+            try{
+                threshold = std::stod(argv[++i]);
+            }
+            catch(const std::exception& e){
+                std::cout<<"Could not parse the argument to -r"<<std::endl;
+                return 1;
+            }
+            continue;
+        }
+        try{
+            files.push_back(read_counts_file(arg));
+        }
+        catch(const std::runtime_error& e){
+            std::cerr<<"Error: "<<e.what()<<std::endl;
+            return 1;
+        }
+    }
+    if(files.empty()){
+        print_usage();
+        return 1;
+    }
+
+    gstar_result_t result;
+    try{
+        result = gstar_from_counts(merge_counts_files(files));
+    }
+    catch(const std::runtime_error& e){
+        std::cerr<<"Error: "<<e.what()<<std::endl;
+        return 1;
+    }
+    std::cout<<"threshold:"<<threshold<< std::endl;
+    std::cout<<"seed:"<<result.seed<< std::endl;
+    std::cout<<"trials:"<<result.trials<< std::endl;
+    print_trees(result, threshold);
+    return 0;
+}
+
+/*
+ * sunstar log-dump FILE
+ */
+int log_dump_main(int argc, char** argv){
+    if(argc != 2){
+        print_usage();
+        return 1;
+    }
+    try{
+        dump_schedule_log(argv[1], std::cout);
+    }
+    catch(const std::runtime_error& e){
+        std::cerr<<"Error: "<<e.what()<<std::endl;
+        return 1;
+    }
+    return 0;
 }
 
 bool check_rooted(const vector<string>& nstrings){
@@ -66,13 +262,38 @@ bool check_rooted(const vector<string>& nstrings){
 }
 
 int main(int argc, char** argv){
+    if(argc > 1 && string(argv[1]) == "merge"){
+        return merge_main(argc-1, argv+1);
+    }
+    if(argc > 1 && string(argv[1]) == "log-dump"){
+        return log_dump_main(argc-1, argv+1);
+    }
     int c;
     //argument buffers
     std::string filename;
     std::string outgroup;
     std::string logfile="schedule.log";
+    log_format_t log_format=log_format_t::binary32;
+    sampler_t sampler=sampler_t::random;
+    bool importance=false;
+    size_t pilot=0;
+    double alpha=1.0;
+    size_t exact=0;
+    bool margins=false;
+    double time_budget=0;
+    nj_search_t nj_search=nj_search_t::exhaustive;
+    size_t nj_threads=1;
     size_t trials=0;
+    size_t threads=1;
+    uint64_t seed=0;
     double threshold=0;
+    double tolerance=0;
+    size_t top_k=5;
+    std::string checkpoint;
+    double checkpoint_interval=60;
+    bool resume=false;
+    size_t shard=0;
+    size_t shards=1;
 
     while(true){
         static struct option long_options[] =
@@ -84,10 +305,28 @@ int main(int argc, char** argv){
             {"outgroup",    required_argument,  0,   'o'},
             {"logfile",     required_argument,  0,   'l'},
             {"trials",      required_argument,  0,   't'},
+            {"threads",     required_argument,  0,   'j'},
+            {"seed",        required_argument,  0,   'S'},
+            {"tolerance",   required_argument,  0,   'T'},
+            {"top-k",       required_argument,  0,   'k'},
+            {"checkpoint",  required_argument,  0,   'c'},
+            {"checkpoint-interval", required_argument, 0, 'I'},
+            {"resume",      no_argument,        0,   'R'},
+            {"shard",       required_argument,  0,   'P'},
+            {"log-format",  required_argument,  0,   'L'},
+            {"sampler",     required_argument,  0,   'Q'},
+            {"importance",  no_argument,        0,   'M'},
+            {"pilot",       required_argument,  0,   'W'},
+            {"alpha",       required_argument,  0,   'A'},
+            {"exact",       required_argument,  0,   'X'},
+            {"margins",     no_argument,        0,   'G'},
+            {"time-budget", required_argument,  0,   'B'},
+            {"nj-search",   required_argument,  0,   'N'},
+            {"nj-threads",  required_argument,  0,   'J'},
             {0,0,0,0}
         };
         int option_index = 0;
-        c = getopt_long(argc, argv, "shf:o:t:l:r:", long_options, &option_index);
+        c = getopt_long(argc, argv, "shf:o:t:l:r:j:S:T:k:c:", long_options, &option_index);
         if(c==-1){
             break;
         }
@@ -113,6 +352,179 @@ int main(int argc, char** argv){
                     return 1;
                 } 
                 break;
+            case 'j':
+                try{
+                    threads = std::stoi(optarg);
+                }
+                catch(const std::exception& e){
+                    std::cout<<"Could not parse the argument to -j"<<std::endl;
+                    return 1;
+                } 
+                if(threads == 0){
+                    std::cout<<"The argument to -j must be at least 1"<<std::endl;
+                    return 1;
+                }
+                break;
+            case 'S':
+                try{
+                    seed = std::stoull(optarg);
+                }
+                catch(const std::exception& e){
+                    std::cout<<"Could not parse the argument to -S"<<std::endl;
+                    return 1;
+                } 
+                break;
+            case 'T':
+                try{
+                    tolerance = std::stod(optarg);
+                }
+                catch(const std::exception& e){
+                    std::cout<<"Could not parse the argument to -T"<<std::endl;
+                    return 1;
+                } 
+                if(!(tolerance > 0.0)){
+                    std::cout<<"The argument to -T must be positive"<<std::endl;
+                    return 1;
+                }
+                break;
+            case 'k':
+                try{
+                    top_k = std::stoi(optarg);
+                }
+                catch(const std::exception& e){
+                    std::cout<<"Could not parse the argument to -k"<<std::endl;
+                    return 1;
+                } 
+                break;
+            case 'c':
+                checkpoint = string(optarg);
+                break;
+            case 'I':
+                try{
+                    checkpoint_interval = std::stod(optarg);
+                }
+                catch(const std::exception& e){
+                    std::cout<<"Could not parse the argument to --checkpoint-interval"<<std::endl;
+                    return 1;
+                } 
+                break;
+            case 'R':
+                resume = true;
+                break;
+            case 'L':
+                try{
+                    log_format = parse_log_format(optarg);
+                }
+                catch(const std::exception& e){
+                    std::cout<<"The log format must be binary, binary64 or json"<<std::endl;
+                    return 1;
+                } 
+                break;
+            case 'Q':
+                try{
+                    sampler = parse_sampler(optarg);
+                }
+                catch(const std::exception& e){
+                    std::cout<<"The sampler must be random, sobol or halton"<<std::endl;
+                    return 1;
+                } 
+                break;
+            case 'M':
+                importance = true;
+                break;
+            case 'W':
+                try{
+                    pilot = std::stoul(optarg);
+                }
+                catch(const std::exception& e){
+                    std::cout<<"Could not parse the argument to --pilot"<<std::endl;
+                    return 1;
+                } 
+                break;
+            case 'A':
+                try{
+                    alpha = std::stod(optarg);
+                }
+                catch(const std::exception& e){
+                    std::cout<<"Could not parse the argument to --alpha"<<std::endl;
+                    return 1;
+                } 
+                if(!(alpha > 0.0) || !std::isfinite(alpha)){
+                    std::cout<<"The argument to --alpha must be more than 0"<<std::endl;
+                    return 1;
+                }
+                break;
+            case 'X':
+                try{
+                    exact = std::stoul(optarg);
+                }
+                catch(const std::exception& e){
+                    std::cout<<"Could not parse the argument to --exact"<<std::endl;
+                    return 1;
+                } 
+                if(exact == 0){
+                    std::cout<<"The argument to --exact must be at least 1"<<std::endl;
+                    return 1;
+                }
+                break;
+            case 'G':
+                margins = true;
+                break;
+            case 'B':
+                try{
+                    time_budget = std::stod(optarg);
+                }
+                catch(const std::exception& e){
+                    std::cout<<"Could not parse the argument to --time-budget"<<std::endl;
+                    return 1;
+                } 
+                if(!(time_budget > 0.0) || !std::isfinite(time_budget)){
+                    std::cout<<"The argument to --time-budget must be positive"<<std::endl;
+                    return 1;
+                }
+                break;
+            case 'N':
+                try{
+                    nj_search = parse_nj_search(optarg);
+                }
+                catch(const std::exception& e){
+                    std::cout<<"The NJ search must be exhaustive or bounded"<<std::endl;
+                    return 1;
+                } 
+                break;
+            case 'J':
+                try{
+                    nj_threads = std::stoi(optarg);
+                }
+                catch(const std::exception& e){
+                    std::cout<<"Could not parse the argument to --nj-threads"<<std::endl;
+                    return 1;
+                } 
+                if(nj_threads == 0){
+                    std::cout<<"The argument to --nj-threads must be at least 1"<<std::endl;
+                    return 1;
+                }
+                break;
+            case 'P':
+                try{
+                    string arg(optarg);
+                    size_t slash = arg.find('/');
+                    if(slash == string::npos){
+                        throw std::invalid_argument(arg);
+                    }
+                    shard = std::stoul(arg.substr(0, slash));
+                    shards = std::stoul(arg.substr(slash+1));
+                }
+                catch(const std::exception& e){
+                    std::cout<<"Could not parse the argument to --shard, it should look like 3/8"<<std::endl;
+                    return 1;
+                } 
+                if(shards == 0 || shard >= shards){
+                    std::cout<<"The shard must be between 0 and "<<
+                        (shards == 0 ? 0 : shards-1)<<std::endl;
+                    return 1;
+                }
+                break;
             case 'r':
                 try{
                     threshold = std::stod(optarg);
@@ -156,28 +568,81 @@ int main(int argc, char** argv){
         return 1;
     }
 
-    auto trees = gstar(newick_strings, trials, logfile, outgroup);
-    //sort the trees
+    if(shards > 1 && seed == 0 && !resume){
+        std::cout<<"Every shard needs the same seed, give it with -S"<<std::endl;
+        return 1;
+    }
+    if(seed == 0 && !resume){
+        seed = random_seed();
+    }
 
-    auto pc_lambda = [](auto lhs, auto rhs){
-        return lhs.second>rhs.second;
-    };
+    if(time_budget > 0.0 && trials == 0){
+        trials = DEFAULT_BUDGET_TRIALS;
+    }
+    if(tolerance > 0.0 && trials == 0){
+        trials = DEFAULT_MAX_TRIALS;
+    }
+    if(shards > 1 && checkpoint.empty()){
+        checkpoint = "shard_" + std::to_string(shard) + "_of_"
+            + std::to_string(shards) + ".counts";
+    }
 
-    std::sort(trees.begin(), trees.end(), pc_lambda);
+    gstar_options_t opts;
+    opts.trials = trials;
+    opts.threads = threads;
+    opts.seed = seed;
+    opts.logfile = logfile;
+    opts.log_format = log_format;
+    opts.outgroup = outgroup;
+    opts.tolerance = tolerance;
+    opts.top_k = top_k;
+    opts.checkpoint = checkpoint;
+    opts.checkpoint_interval = checkpoint_interval;
+    opts.resume = resume;
+    opts.shard = shard;
+    opts.shards = shards;
+    opts.sampler = sampler;
+    opts.importance = importance;
+    opts.pilot = pilot;
+    opts.alpha = alpha;
+    opts.exact = exact;
+    opts.margins = margins;
+    opts.time_budget = time_budget;
+    opts.nj_search = nj_search;
+    opts.nj_threads = nj_threads;
+    gstar_result_t result;
+    try{
+        result = gstar_run(newick_strings, opts);
+    }
+    catch(const std::runtime_error& e){
+        std::cerr<<"Error: "<<e.what()<<std::endl;
+        return 1;
+    }
 
     std::cout<<"threshold:"<<threshold<< std::endl;
-    double supressed_total = 0.0;
-    for(const auto& kv:trees){
-        if(!(kv.second<threshold))
-            std::cout<<"'"<<kv.first<<"' : "<<kv.second<<std::endl;
-        else
-            supressed_total+=kv.second;
+    if(exact > 0){
+        std::cout<<"pieces:"<<result.trials<< std::endl;
+        print_trees(result, threshold);
+        return 0;
     }
-    if(supressed_total!=0.0){
-        std::cout<<"Total probability of suppressed trees: "
-            <<supressed_total<<std::endl;
+    if(trials != 0){
+        std::cout<<"seed:"<<result.seed<< std::endl;
     }
-    std::cout<<"Perplexity: "<<calc_perplexity(trees)<<std::endl;
+    if(tolerance > 0.0 || time_budget > 0.0){
+        std::cout<<"trials:"<<result.trials<< std::endl;
+        if(!result.converged){
+            std::cout<<"Warning: did not converge to within "<<tolerance
+                <<" in "<<result.trials<<" trials"<<std::endl;
+        }
+    }
+    if(time_budget > 0.0){
+        std::cout<<"trials per second:"<<result.trials_per_second<<std::endl;
+    }
+    if(shards > 1){
+        std::cout<<"shard:"<<shard<<"/"<<shards<<", counts saved to "
+            <<checkpoint<<std::endl;
+    }
+    print_trees(result, threshold);
 
     return 0;
 }
@@ -18,6 +18,7 @@ using std::string;
 using std::shared_ptr;
 #include <set>
 #include <exception>
+#include <stdexcept>
 
 
 std::set<string> label_set;
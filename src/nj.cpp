@@ -24,31 +24,375 @@ using std::unordered_map;
 #include <utility>
 //for std::swap
 #include <cmath>
+#include <algorithm>
 #include <iostream>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
-typedef std::vector<std::vector<double>> d2vector_t;
-
-void delete_rowcol(d2vector_t& m, size_t r){
-    d2vector_t tmp_m(m.size()-1, vector<double>(m.size()-1,0.0));
-    for(size_t i=0;i<m.size();++i){
-        if(i==r) continue;
-        size_t _i = i;
-        if(i>r) _i--;
-        for(size_t j=0;j<m.size();++j){
-            if(j==r) continue;
-            size_t _j = j;
-            if(j>r) _j--;
-            tmp_m[_i][_j] = m[i][j];
+//Difference in Q values, relative to the largest of the step, that
+//nj_joins() and nj_allows() treat as a tie
+const double NJ_TIE_TOLERANCE = 1e-9;
+
+//the fewest rows a table has to have for a step to be split over threads,
+//below that handing the work out costs more than it saves
+const size_t NJ_PARALLEL_ROWS = 512;
+
+/*
+ * The threads one NJ call splits its steps over. They are started once, and
+ * then wait for each piece of work, since a step of a big table only takes a
+ * millisecond or so, and starting threads for every one would take about as
+ * long. run(f) calls f(0), ..., f(size()-1), f(0) on the calling thread and
+ * the rest on the workers, and waits for all of them.
+ */
+class nj_workers_t{
+    public:
+        nj_workers_t(size_t threads): _f(nullptr), _generation(0),
+            _left(0), _stop(false){
+            for(size_t t = 1; t < threads; ++t){
+                _threads.emplace_back([this, t]{ work(t); });
+            }
+        }
+
+        ~nj_workers_t(){
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            _start.notify_all();
+            for(auto& t : _threads) t.join();
+        }
+
+        size_t size() const{ return _threads.size() + 1; }
+
+        void run(const std::function<void(size_t)>& f){
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _f = &f;
+                _left = _threads.size();
+                ++_generation;
+            }
+            _start.notify_all();
+            f(0);
+            std::unique_lock<std::mutex> lock(_mutex);
+            _done.wait(lock, [this]{ return _left == 0; });
+        }
+
+    private:
+        void work(size_t t){
+            size_t seen = 0;
+            while(true){
+                const std::function<void(size_t)>* f;
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _start.wait(lock, [&]{
+                        return _stop || _generation != seen; });
+                    if(_stop) return;
+                    seen = _generation;
+                    f = _f;
+                }
+                (*f)(t);
+                std::lock_guard<std::mutex> lock(_mutex);
+                if(--_left == 0) _done.notify_one();
+            }
+        }
+
+        std::mutex _mutex;
+        std::condition_variable _start;
+        std::condition_variable _done;
+        const std::function<void(size_t)>* _f;
+        size_t _generation;
+        size_t _left;
+        bool _stop;
+        vector<std::thread> _threads;
+};
+
+//the row of a slot that has been joined away
+const size_t NJ_NOT_IN_TABLE = (size_t)-1;
+
+/*
+ * The distance table NJ works on. It is one buffer, allocated once, with a
+ * row and a column for each of the taxa. Joining a pair writes the distances
+ * to the new node over the row and column of the first of the pair, so after
+ * the start nothing gets copied or allocated. The rows are still numbered the
+ * way they always were, with the ones that are left in the same order and the
+ * new node on the end (see nj.h). _rows has the slot in the buffer of each
+ * one, and taking two out of it and putting one on the end is O(n). _index
+ * goes the other way, from a slot to its row.
+ *
+ * The row sums R are kept up to date as well, instead of being added up again
+ * for every step. Joining a and b into u takes d(a,k) and d(b,k) out of the
+ * sum of each row k, and puts d(u,k) in, which is O(n) for all of them.
+ *
+ * Adding and taking away like that leaves a different rounding error in each
+ * sum than adding the row up would. That matters more than it sounds, since
+ * the gene trees often make two Q values exactly the same, and then which one
+ * is lower is down to the rounding. So each sum is kept as a double and the
+ * rounding error of it, _R_lo, the way Kahan summation does, which keeps R
+ * within about an ulp of the exact sum, about as close as adding the row up
+ * each step gets. That doesn't make the two the same, though, see nj.h for
+ * what it means for ties.
+ *
+ * The sum of a slot that has been joined away is -infinity, so every Q value
+ * with it is infinite. That lets find_pair() go straight along the buffer,
+ * slots that are gone and all. So that it doesn't spend most of its time on
+ * those, once half the slots are gone the rows that are left are copied to
+ * the front of the buffer, in order. That is O(n^2), but it happens at most
+ * log n times.
+ */
+class nj_table_t{
+    public:
+        nj_table_t(const vector<double>& d, size_t row_size):
+            _stride(row_size), _d(d), _R(row_size, 0.0),
+            _R_lo(row_size, 0.0), _index(row_size), _compactions(0){
+            _rows.reserve(row_size);
+            for(size_t i = 0;i<row_size;++i){
+                _rows.push_back(i);
+                _index[i] = i;
+                for(size_t j=0;j<row_size;++j){
+                    add_to_sum(i, _d[i*row_size+j]);
+                }
+            }
+        }
+
+        size_t size() const{ return _rows.size(); }
+
+        double dist(size_t i, size_t j) const{
+            return _d[_rows[i]*_stride + _rows[j]];
         }
+
+        double row_sum(size_t i) const{ return _R[_rows[i]]; }
+
+        //the Q value of rows i < j
+        double q(size_t i, size_t j) const{
+            return (size()-2)*dist(i, j) - row_sum(i) - row_sum(j);
+        }
+
+        //row i of the buffer, the slots of the rows and the sums by slot, for
+        //going along a row without looking up its slot every time
+        const double* row(size_t i) const{ return &_d[_rows[i]*_stride]; }
+        const size_t* slots() const{ return _rows.data(); }
+        const double* sums() const{ return _R.data(); }
+
+        //the buffer itself, the row of each slot, or NJ_NOT_IN_TABLE, and
+        //how many times the rows have been moved to the front
+        size_t stride() const{ return _stride; }
+        const double* buffer() const{ return _d.data(); }
+        const size_t* indices() const{ return _index.data(); }
+        size_t compactions() const{ return _compactions; }
+
+        //workers, if given, split the rows that get updated between them
+        void join(size_t a, size_t b, nj_workers_t* workers = nullptr);
+
+    private:
+        //adds x to the sum of a slot, keeping the error of _R in _R_lo
+        void add_to_sum(size_t slot, double x){
+            double s = _R[slot] + x;
+            double x_part = s - _R[slot];
+            _R_lo[slot] += (_R[slot] - (s - x_part)) + (x - x_part);
+            _R[slot] = s + _R_lo[slot];
+            _R_lo[slot] -= _R[slot] - s;
+        }
+
+        void compact();
+
+        size_t _stride;
+        vector<double> _d;
+        vector<double> _R;
+        vector<double> _R_lo;
+        vector<size_t> _rows;
+        vector<size_t> _index;
+        size_t _compactions;
+        //where compact() copies the rows to, kept for the next time
+        vector<double> _spare;
+};
+
+/*
+ * Joins rows a and b. The distance from the new node u to each row k that is
+ * left is
+ *      d(u,k) = (d(a,k) + d(b,k) - d(a,b))/2
+ * which is the three point formula, see join_pair().
+ */
+void nj_table_t::join(size_t a, size_t b, nj_workers_t* workers){
+    if(a > b) std::swap(a, b);
+    size_t slot_a = _rows[a], slot_b = _rows[b];
+    double* row_a = &_d[slot_a*_stride];
+    const double* row_b = &_d[slot_b*_stride];
+    double d_ab = row_a[slot_b];
+    //each row k only touches its own sum and its own places in row and
+    //column a, so the rows can be done in any order, on any thread
+    auto update = [&](size_t begin, size_t end){
+        for(size_t k = begin;k<end;++k){
+            if(k == a || k == b) continue;
+            size_t slot = _rows[k];
+            double v = (row_a[slot] + row_b[slot] - d_ab)/2.0;
+            add_to_sum(slot, v);
+            add_to_sum(slot, -row_a[slot]);
+            add_to_sum(slot, -row_b[slot]);
+            row_a[slot] = v;
+            _d[slot*_stride + slot_a] = v;
+        }
+    };
+    size_t n = _rows.size();
+    if(workers && n >= NJ_PARALLEL_ROWS){
+        size_t parts = workers->size();
+        workers->run([&](size_t t){
+            update(t*n/parts, (t+1)*n/parts);
+        });
+    }
+    else{
+        update(0, n);
+    }
+    //the sum of the new node is added up in the order of the rows, so it is
+    //the same however the rows were split up
+    _R[slot_a] = _R_lo[slot_a] = 0.0;
+    for(size_t k = 0;k<n;++k){
+        if(k == a || k == b) continue;
+        add_to_sum(slot_a, row_a[_rows[k]]);
+    }
+    row_a[slot_a] = 0.0;
+    _R[slot_b] = -std::numeric_limits<double>::infinity();
+    _index[slot_b] = NJ_NOT_IN_TABLE;
+    _rows.erase(_rows.begin()+b);
+    _rows.erase(_rows.begin()+a);
+    _rows.push_back(slot_a);
+    for(size_t k = a;k<_rows.size();++k){
+        _index[_rows[k]] = k;
     }
-    m.swap(tmp_m);
+    if(2*_rows.size() <= _stride) compact();
 }
 
-void add_rowcol(d2vector_t& m){
-    for(size_t i = 0;i<m.size();++i){
-        m[i].push_back(0.0);
+void nj_table_t::compact(){
+    size_t n = _rows.size();
+    _spare.resize(n*n);
+    vector<double> R(n), R_lo(n);
+    for(size_t i = 0;i<n;++i){
+        for(size_t j = 0;j<n;++j){
+            _spare[i*n+j] = _d[_rows[i]*_stride + _rows[j]];
+        }
+        R[i] = _R[_rows[i]];
+        R_lo[i] = _R_lo[_rows[i]];
+    }
+    _d.swap(_spare);
+    _R.swap(R);
+    _R_lo.swap(R_lo);
+    _stride = n;
+    _index.resize(n);
+    for(size_t i = 0;i<n;++i){
+        _rows[i] = i;
+        _index[i] = i;
+    }
+    ++_compactions;
+}
+
+/*
+ * How much bigger the smallest Q value of the pairs that share a taxon with p
+ * is than the Q value of p. Those are the pairs NJ could
+ * have joined instead of p, so a small margin means a small change to the
+ * table would have given a different tree. Pairs that don't share a taxon
+ * with p are left out. Those often tie with p exactly, like two cherries of
+ * the same gene trees, but then they just get joined in the next step
+ * instead, and the tree is the same.
+ */
+double calc_margin(const nj_table_t& dists, std::pair<size_t, size_t> p){
+    size_t row_size = dists.size();
+    //worked out the same way as in find_pair(), so a tie is exactly zero
+    auto q = [&](size_t i, size_t j){
+        if(i > j) std::swap(i, j);
+        return dists.q(i, j);
+    };
+    size_t a = p.first, b = p.second;
+    double runner_up = std::numeric_limits<double>::infinity();
+    for(size_t k = 0;k<row_size;++k){
+        if(k == a || k == b) continue;
+        runner_up = std::min(runner_up, std::min(q(a, k), q(b, k)));
+    }
+    return runner_up - q(a, b);
+}
+
+//how many Q values lowest_q_in_row() works out side by side
+const size_t NJ_LANES = 8;
+typedef double nj_lanes_t
+    __attribute__((vector_size(NJ_LANES*sizeof(double))));
+typedef size_t nj_index_lanes_t
+    __attribute__((vector_size(NJ_LANES*sizeof(size_t))));
+//all ones in the lanes where a comparison is true, and zeros elsewhere
+typedef int64_t nj_mask_lanes_t
+    __attribute__((vector_size(NJ_LANES*sizeof(int64_t))));
+
+/*
+ * The Q values have to come out the same to the bit as nj_table_t::q(),
+ * which takes away the sum of the row that comes first before the other one,
+ * so which sum goes first is picked with a select on the rows of the slots.
+ */
+inline double slot_q(double scale, double d, double R_s, double R_t,
+        size_t index_s, size_t index_t){
+    bool s_first = index_s < index_t;
+    double first = s_first ? R_s : R_t;
+    double second = s_first ? R_t : R_s;
+    return scale*d - first - second;
+}
+
+/*
+ * The lowest of the Q values of slot s and the slots [begin, end), given the
+ * row of s in the buffer. It works out NJ_LANES of them at a time, with the
+ * same select as slot_q(), and keeps a running minimum for each lane.
+ *
+ * This is written with the vector types of the compiler rather than as a
+ * loop over the lanes, like dirichlet.cpp is. The compiler won't turn a
+ * running minimum of doubles into vector instructions unless it is allowed
+ * to ignore infinities and the sign of zero, and the slots that are gone
+ * need the infinities. With -march=native these are whatever vector
+ * instructions the machine has, and without it the compiler splits them up.
+ *
+ * g++ and clang++ don't agree on what ?: does with vectors, or on mixing
+ * vectors and scalars, so the scalars are copied into every lane up front,
+ * and the selects are done on the bits, with the masks the comparisons give.
+ */
+inline double lowest_q_in_row(const double* row, const double* R,
+        const size_t* index, size_t s, double scale, size_t begin,
+        size_t end){
+    nj_lanes_t lanes, scales, R_s;
+    nj_index_lanes_t index_s;
+    for(size_t l = 0; l < NJ_LANES; ++l){
+        lanes[l] = std::numeric_limits<double>::infinity();
+        scales[l] = scale;
+        R_s[l] = R[s];
+        index_s[l] = index[s];
+    }
+    nj_mask_lanes_t R_s_bits = (nj_mask_lanes_t)R_s;
+    size_t t = begin;
+    for(; t + NJ_LANES <= end; t += NJ_LANES){
+        nj_lanes_t d, R_t;
+        nj_index_lanes_t index_t;
+        std::memcpy(&d, row + t, sizeof(d));
+        std::memcpy(&R_t, R + t, sizeof(R_t));
+        std::memcpy(&index_t, index + t, sizeof(index_t));
+        nj_mask_lanes_t s_first = (nj_mask_lanes_t)(index_s < index_t);
+        nj_mask_lanes_t R_t_bits = (nj_mask_lanes_t)R_t;
+        nj_lanes_t first = (nj_lanes_t)((s_first & R_s_bits)
+                | (~s_first & R_t_bits));
+        nj_lanes_t second = (nj_lanes_t)((s_first & R_t_bits)
+                | (~s_first & R_s_bits));
+        nj_lanes_t q = scales*d - first - second;
+        nj_mask_lanes_t lower = (nj_mask_lanes_t)(q < lanes);
+        lanes = (nj_lanes_t)((lower & (nj_mask_lanes_t)q)
+                | (~lower & (nj_mask_lanes_t)lanes));
+    }
+    double lowest = lanes[0];
+    for(size_t l = 1; l < NJ_LANES; ++l){
+        lowest = std::min(lowest, (double)lanes[l]);
+    }
+    for(; t < end; ++t){
+        double q = slot_q(scale, row[t], R[s], R[t], index[s], index[t]);
+        lowest = q < lowest ? q : lowest;
     }
-    m.push_back(vector<double>(m.size()+1, 0.0));
+    return lowest;
 }
 
 /*
@@ -58,44 +402,289 @@ void add_rowcol(d2vector_t& m){
  *      R[i] = Sum of dists over row i
  *  and then pick the smallest value of M. Since M will simply be destroyed
  *  after this function, we
+ *
+ *  R is kept by the table, so this is just the one pass over the pairs. The
+ *  smallest Q value is never more than zero for a table that adds up to
+ *  more than zero, but the rounding can leave every Q value of a table of
+ *  near zeros a hair over, so lowest starts out at the largest double
+ *  rather than at zero.
+ *
+ *  The pass goes along the buffer of the table in the order of the slots, a
+ *  row at a time, with lowest_q_in_row(). The slots that are gone give
+ *  infinite Q values, so they never get picked. The order of the slots isn't
+ *  the order of the rows, though, and a tie has to go to the pair that comes
+ *  last in the order of the rows, i.e. with the biggest i, and then the
+ *  biggest j. So when a row has a Q value as low as the lowest so far, which
+ *  isn't often, it is gone along again to see which pairs have it.
+ *
+ *  If workers are given and the table is big enough, the slots are dealt
+ *  out to them in turn, so they each get about as many pairs, and the best
+ *  pair of each is put together the same way at the end. The pair is the
+ *  same however many there are.
+ *
+ *  If margin is given, it gets the margin of the pair picked, see
+ *  calc_margin(). That only looks at two rows, so it is cheap next to
+ *  finding the pair.
  */
-std::pair<size_t, size_t> find_pair(const d2vector_t& dists){
-    //calculate R
+struct nj_best_pair_t{
+    double q = std::numeric_limits<double>::max();
+    size_t i = 0;
+    size_t j = 0;
+
+    //keeps (q, i, j) if it is lower, or as low and later in row order
+    void consider(double q_ij, size_t i_, size_t j_){
+        if(q_ij < q || (q_ij == q && (i_ > i || (i_ == i && j_ > j)))){
+            q = q_ij; i = i_; j = j_;
+        }
+    }
+};
+
+//the best pair of the slots first, first+step, first+2*step, ...
+void find_pair_in_slots(const nj_table_t& dists, size_t first, size_t step,
+        nj_best_pair_t& best){
+    size_t stride = dists.stride();
+    const double* buffer = dists.buffer();
+    const double* R = dists.sums();
+    const size_t* index = dists.indices();
+    double scale = dists.size()-2;
+    for(size_t s = first;s<stride;s+=step){
+        if(index[s] == NJ_NOT_IN_TABLE) continue;
+        const double* row = buffer + s*stride;
+        double row_lowest = lowest_q_in_row(row, R, index, s, scale, s+1,
+                stride);
+        if(row_lowest > best.q) continue;
+        for(size_t t = s+1;t<stride;++t){
+            if(slot_q(scale, row[t], R[s], R[t], index[s], index[t])
+                    != row_lowest){
+                continue;
+            }
+            best.consider(row_lowest, std::min(index[s], index[t]),
+                    std::max(index[s], index[t]));
+        }
+    }
+}
+
+std::pair<size_t, size_t> find_pair(const nj_table_t& dists,
+        double* margin = nullptr, nj_workers_t* workers = nullptr){
+    nj_best_pair_t best;
+    if(workers && dists.size() >= NJ_PARALLEL_ROWS){
+        size_t parts = workers->size();
+        vector<nj_best_pair_t> bests(parts);
+        workers->run([&](size_t t){
+            find_pair_in_slots(dists, t, parts, bests[t]);
+        });
+        for(auto&& b : bests){
+            best.consider(b.q, b.i, b.j);
+        }
+    }
+    else{
+        find_pair_in_slots(dists, 0, 1, best);
+    }
+    debug_print("lowest: %f, _i:%lu, _j:%lu", best.q, best.i, best.j);
+    auto p = std::make_pair(best.i, best.j);
+    if(margin) *margin = calc_margin(dists, p);
+    return p;
+}
+
+/*
+ * Says if find_pair() would pick p, without having to keep track of where the
+ * lowest Q value is. find_pair() keeps the last of the lowest Q values, so
+ * the Q value of p has to be no more than that of any pair, and less than
+ * that of every pair after it. It goes along the slots with
+ * lowest_q_in_row() like find_pair() does, so the Q values are the same to
+ * the bit and the answer is exact, and a row only gets gone along again if
+ * it has a pair that ties with p. As soon as a row has a lower Q value than
+ * p, we know the hint is wrong, and stop there. If margin is given, it gets
+ * the margin of p when p is the pair, the same as find_pair() would give.
+ */
+bool check_pair(const nj_table_t& dists, std::pair<size_t, size_t> p,
+        double* margin = nullptr){
     size_t row_size = dists.size();
-    vector<double> R(row_size, 0);
-    for(size_t i = 0;i<row_size;++i){
-        for(size_t j=0;j<row_size;++j){
-            R[i] += dists[i][j];
+    size_t a = p.first, b = p.second;
+    if(a >= b || b >= row_size) return false;
+    double chosen = dists.q(a, b);
+    size_t stride = dists.stride();
+    const double* buffer = dists.buffer();
+    const double* R = dists.sums();
+    const size_t* index = dists.indices();
+    double scale = dists.size()-2;
+    for(size_t s = 0;s<stride;++s){
+        if(index[s] == NJ_NOT_IN_TABLE) continue;
+        const double* row = buffer + s*stride;
+        double row_lowest = lowest_q_in_row(row, R, index, s, scale, s+1,
+                stride);
+        if(row_lowest > chosen) continue;
+        if(row_lowest < chosen) return false;
+        for(size_t t = s+1;t<stride;++t){
+            if(slot_q(scale, row[t], R[s], R[t], index[s], index[t])
+                    != chosen){
+                continue;
+            }
+            size_t i = std::min(index[s], index[t]);
+            size_t j = std::max(index[s], index[t]);
+            if(i > a || (i == a && j > b)) return false;
         }
     }
-    size_t _i=0, _j=0;
-    //double lowest=std::numeric_limits<double>::max();
-    double lowest = 0.0;
-    for(size_t i = 0;i<row_size;++i){
-        for(size_t j=i+1;j<row_size;++j){
-            double tmp = (row_size-2)*dists[i][j] -R[i] - R[j];
-            debug_print("current M[%lu][%lu] = %f, lowest = %f", i, j, tmp,
-                    lowest);
-            if(tmp <= lowest){
-                _i = i; _j = j;
-                lowest = tmp;
-                debug_print("new lowest: %f, _i:%lu, _j:%lu", lowest, _i, _j);
+    if(margin) *margin = calc_margin(dists, p);
+    return true;
+}
+
+/*
+ * The pair search of RapidNJ, from Simonsen, Mailund and Pedersen, "Rapid
+ * Neighbour-Joining" (2008). Each row keeps its distances sorted, and since
+ *      Q(i,j) = (n-2)*d(i,j) - R[i] - R[j] >= (n-2)*d(i,j) - R[i] - max R
+ * going along row i in order of distance, once that bound is over the best Q
+ * value found so far, nothing else in the row can beat it. Most of each row
+ * never gets looked at, so a step is usually well under O(n^2).
+ *
+ * The Q values that do get looked at are worked out just like in
+ * find_pair(), and a tie goes to the same pair it would go to, the last one
+ * in find_pair()'s order, so the tree is always the same as the one
+ * find_pair() makes. The bound gives a little room for the rounding, so it
+ * never cuts off a pair that find_pair() would pick.
+ *
+ * The sorted rows are by slot in the table, and each pair is only in the row
+ * of the one of the two that was made last, so only half the table is
+ * sorted. Each slot gets a new serial number when a join writes a new node
+ * over it, and the row of the new node is sorted from scratch. The entries
+ * for the old node in the other rows are then out of date, and get skipped,
+ * since their serial number is the old one. Once most of what a row has had
+ * to skip is out of date, they are cleared out of it. When the table moves
+ * its rows to the front of its buffer, all of the rows are sorted again,
+ * which happens at most log n times.
+ */
+class nj_bounded_search_t{
+    public:
+        nj_bounded_search_t(const nj_table_t& dists){
+            rebuild(dists);
+        }
+
+        //call after each join, to sort the row of the new node
+        void joined(const nj_table_t& dists){
+            if(dists.compactions() != _compactions){
+                rebuild(dists);
+                return;
+            }
+            size_t u = dists.size()-1;
+            _serial[dists.slots()[u]] = _next_serial++;
+            sort_row(dists, u);
+        }
+
+        std::pair<size_t, size_t> find(const nj_table_t& dists,
+                double* margin = nullptr);
+
+    private:
+        struct entry_t{
+            double d;
+            uint32_t slot;
+            uint32_t serial;
+        };
+
+        //sorts every row, for a new table or one that has been compacted
+        void rebuild(const nj_table_t& dists){
+            _sorted.assign(dists.stride(), vector<entry_t>());
+            _serial.assign(dists.stride(), 0);
+            for(size_t i = 0; i < dists.size(); ++i){
+                _serial[dists.slots()[i]] = i;
+            }
+            _next_serial = dists.size();
+            _compactions = dists.compactions();
+            for(size_t i = 0; i < dists.size(); ++i){
+                sort_row(dists, i);
             }
         }
+
+        void sort_row(const nj_table_t& dists, size_t i){
+            size_t slot = dists.slots()[i];
+            auto& row = _sorted[slot];
+            row.clear();
+            for(size_t k = 0; k < dists.size(); ++k){
+                size_t other = dists.slots()[k];
+                if(_serial[other] >= _serial[slot]) continue;
+                row.push_back({dists.dist(i, k), (uint32_t)other,
+                        (uint32_t)_serial[other]});
+            }
+            std::sort(row.begin(), row.end(),
+                    [](const entry_t& a, const entry_t& b){
+                        return a.d < b.d;
+                    });
+        }
+
+        bool current(const entry_t& e, const size_t* index) const{
+            return index[e.slot] != NJ_NOT_IN_TABLE
+                && _serial[e.slot] == e.serial;
+        }
+
+        vector<vector<entry_t>> _sorted;
+        vector<size_t> _serial;
+        size_t _next_serial;
+        size_t _compactions;
+};
+
+std::pair<size_t, size_t> nj_bounded_search_t::find(const nj_table_t& dists,
+        double* margin){
+    size_t row_size = dists.size();
+    const size_t* slots = dists.slots();
+    const size_t* index = dists.indices();
+    const double* R = dists.sums();
+    double R_max = -std::numeric_limits<double>::max();
+    for(size_t i = 0; i < row_size; ++i){
+        R_max = std::max(R_max, R[slots[i]]);
     }
+
+    size_t _i = 0, _j = 0;
+    double lowest = std::numeric_limits<double>::max();
+    //the same sums as dists.q(), with d(i,j) from the sorted row
+    auto consider = [&](size_t i, size_t j, double d){
+        if(i > j) std::swap(i, j);
+        double tmp = (row_size-2)*d - R[slots[i]] - R[slots[j]];
+        if(tmp < lowest || (tmp == lowest && (i > _i || (i == _i && j > _j)))){
+            _i = i; _j = j;
+            lowest = tmp;
+        }
+    };
+    //the closest pair in each row is a good place to start the bound from
+    for(size_t i = 0; i < row_size; ++i){
+        for(auto&& e : _sorted[slots[i]]){
+            if(!current(e, index)) continue;
+            consider(i, index[e.slot], e.d);
+            break;
+        }
+    }
+    for(size_t i = 0; i < row_size; ++i){
+        double R_i = R[slots[i]];
+        auto& row = _sorted[slots[i]];
+        size_t stale = 0, k = 0;
+        for(; k < row.size(); ++k){
+            const auto& e = row[k];
+            if(!current(e, index)){
+                ++stale;
+                continue;
+            }
+            double scaled = (row_size-2)*e.d;
+            double bound = scaled - R_i - R_max;
+            double slack = 4.0*std::numeric_limits<double>::epsilon()
+                *(std::fabs(scaled) + std::fabs(R_i) + std::fabs(R_max));
+            if(scaled >= 0.0 && bound - slack > lowest) break;
+            consider(i, index[e.slot], e.d);
+        }
+        if(2*stale > k){
+            row.erase(std::remove_if(row.begin(), row.end(),
+                        [&](const entry_t& e){ return !current(e, index); }),
+                    row.end());
+        }
+    }
+    if(margin) *margin = calc_margin(dists, std::make_pair(_i, _j));
     return std::make_pair(_i, _j);
 }
 
 /*
- * A slave function of nj. Role is to calculate which pair to join, and to join
- * them. The role of calculating which pair to join is left to find_pair, and
- * then this one will will actually join the pair. Finally, the dists will need
- * to be updated.
+ * A slave function of nj. Role is to join the pair p. The role of calculating
+ * which pair to join is left to find_pair, and then this one will will
+ * actually join the pair. Finally, the dists will need to be updated.
  */
-void join_pair(d2vector_t& dists, vector<node_t*>& unroot,
-        vector<node_t*>& tree){
-
-    auto p = find_pair(dists);
+void join_pair(const nj_table_t& dists, vector<node_t*>& unroot,
+        vector<node_t*>& tree, std::pair<size_t, size_t> p){
 
     debug_print("pair found: (%lu, %lu)", p.first, p.second);
     /*
@@ -121,35 +710,21 @@ void join_pair(d2vector_t& dists, vector<node_t*>& unroot,
     double die = 0.0, dje = 0.0;
     for(size_t k = 0;k<dists.size();++k){
         if(k==p.first || k==p.second) continue;
-        die += dists[p.first][k];
+        die += dists.dist(p.first, k);
     }
     for(size_t k = 0;k<dists.size();++k){
         if(k==p.first || k==p.second) continue;
-        dje += dists[p.second][k];
+        dje += dists.dist(p.second, k);
     }
     die/=dists.size();
     dje/=dists.size();
-    lchild->_weight = (dists[p.first][p.second] + die - dje)/2.0;
-    rchild->_weight = (dists[p.second][p.first] + dje - die)/2.0;
+    lchild->_weight = (dists.dist(p.first, p.second) + die - dje)/2.0;
+    rchild->_weight = (dists.dist(p.second, p.first) + dje - die)/2.0;
 
     //remove the two nodes from the unroot, add the new v to the root.
-
-    vector<node_t*> tmp_unroot;
-    tmp_unroot.reserve(unroot.size()-2);
-    for(size_t i=0;i<unroot.size();++i){
-        if(i==p.first ||i == p.second) continue;
-        tmp_unroot.push_back(unroot[i]);
-    }
-    tmp_unroot.push_back(v);
-    unroot.swap(tmp_unroot);
-    //done with the tree update, need to make a new distance table.
-    //Doing this with the three point distance table.
-    auto tmp_dists = dists;
-    delete_rowcol(tmp_dists,p.first);
-    auto second_del = p.second;
-    if(p.first< p.second) second_del--;
-    delete_rowcol(tmp_dists,second_del);
-    add_rowcol(tmp_dists);
+    unroot.erase(unroot.begin() + std::max(p.first, p.second));
+    unroot.erase(unroot.begin() + std::min(p.first, p.second));
+    unroot.push_back(v);
     /*
      * Here we are goin to use the three point formulas again but a bit
      * differently. Its still the case that for the tree.
@@ -170,25 +745,58 @@ void join_pair(d2vector_t& dists, vector<node_t*>& unroot,
      *
      * But in this case its dispite the possibly longer path from r to x. Since
      * the only nodes left in the table are "working" nodes, ie they are yet to
-     * be joined, we can think of them all begina directly adjacent to r.
+     * be joined, we can think of them all begina directly adjacent to r. The
+     * table does that in place after this, see nj_table_t::join().
      */
+}
 
-    for(size_t i = 0;i<tmp_dists.size()-1;++i){
-        size_t cur_i = i;
-        if(p.first <= cur_i){cur_i++;}
-        if(p.second <= cur_i){cur_i++;}
-        tmp_dists[i].back() = (dists[p.first][cur_i] + dists[p.second][cur_i] - dists[p.first][p.second])/2.0;
+/*
+ * The steps of NJ, from the full table down to 3 rows. Before each pair p is
+ * joined in the table, joining(p) is called, so it can still see the
+ * distances of the pair. The rest of the params are as in make_nj_tree().
+ */
+void run_nj_steps(nj_table_t& dists,
+        const vector<std::pair<size_t, size_t>>* joins,
+        const vector<std::pair<size_t, size_t>>* hint,
+        vector<std::pair<size_t, size_t>>* made, double* margin,
+        nj_search_t search, size_t threads,
+        const std::function<void(std::pair<size_t, size_t>)>& joining){
+    size_t row_size = dists.size();
+    if(made) made->clear();
+    if(margin) *margin = std::numeric_limits<double>::infinity();
+    std::unique_ptr<nj_workers_t> workers;
+    if(threads > 1 && row_size >= NJ_PARALLEL_ROWS){
+        workers.reset(new nj_workers_t(threads));
     }
-
-    for(size_t i = 0;i<tmp_dists.size()-1;++i){
-        size_t cur_i = i;
-        if(p.first <= cur_i){cur_i++;}
-        if(p.second <= cur_i){cur_i++;}
-        tmp_dists.back()[i] = (dists[p.first][cur_i] + dists[p.second][cur_i] - dists[p.first][p.second])/2.0;
+    bool follow_hint = hint != nullptr && search == nj_search_t::exhaustive
+        && !workers;
+    std::unique_ptr<nj_bounded_search_t> bounded;
+    if(!joins && search == nj_search_t::bounded && row_size > 3){
+        bounded.reset(new nj_bounded_search_t(dists));
+    }
+    for(size_t step = 0; dists.size() > 3; ++step){
+        std::pair<size_t, size_t> p;
+        double step_margin = std::numeric_limits<double>::infinity();
+        if(joins){
+            p = joins->at(step);
+        }
+        else if(follow_hint && step < hint->size()
+                && check_pair(dists, (*hint)[step], &step_margin)){
+            p = (*hint)[step];
+        }
+        else if(bounded){
+            p = bounded->find(dists, &step_margin);
+        }
+        else{
+            follow_hint = false;
+            p = find_pair(dists, &step_margin, workers.get());
+        }
+        if(margin) *margin = std::min(*margin, step_margin);
+        if(made) made->push_back(p);
+        joining(p);
+        dists.join(p.first, p.second, workers.get());
+        if(bounded) bounded->joined(dists);
     }
-
-    dists.swap(tmp_dists);
-    debug_d2vector_t("dists, after swap", dists);
 }
 
 /*
@@ -215,29 +823,47 @@ void join_pair(d2vector_t& dists, vector<node_t*>& unroot,
  *          unrooted trees, we can't actually designate a root. But we can make
  *          a special interior node that is the "start". I call that node the
  *          unroot, because its cute.
+ *  joins:  If given, the pairs to join, instead of the ones find_pair picks.
+ *  hint:   If given, the pairs find_pair is likely to pick. As long as
+ *          check_pair() says the hinted pair is the right one, we skip
+ *          find_pair. From the first step where it isn't, we stop looking
+ *          at the hint. Either way the tree is the same.
+ *  made:   If given, gets the pairs that were joined.
+ *  margin: If given, gets the smallest margin of any of the steps, see
+ *          calc_margin(). It is infinite if there were no pairs to pick from.
+ *          A step that was given its pair in joins doesn't count.
+ *  search: How to find the pair when it isn't given. The bounded search
+ *          doesn't use the hint, since checking a hinted pair takes a pass
+ *          over the whole table, which is what it is there to save.
+ *  threads: How many threads to split each step over, once the table has
+ *          NJ_PARALLEL_ROWS rows. The hint isn't used with more than one
+ *          either, since checking it is a pass on one thread, and finding
+ *          the pair is a pass split over all of them.
  */
-tree_t nj(const vector<double>& d, const vector<string>& labels){
+tree_t make_nj_tree(const vector<double>& d, const vector<string>& labels,
+        const vector<std::pair<size_t, size_t>>* joins,
+        const vector<std::pair<size_t, size_t>>* hint = nullptr,
+        vector<std::pair<size_t, size_t>>* made = nullptr,
+        double* margin = nullptr,
+        nj_search_t search = nj_search_t::exhaustive, size_t threads = 1){
     size_t row_size = labels.size();
-    d2vector_t dists(row_size, vector<double>(row_size));
-    //convert the dists to a 2d vector
-    for(size_t i = 0; i<row_size;++i){
-        for(size_t j = 0; j<row_size;++j){
-            dists[i][j] = d[i*row_size+j];
-        }
-    }
-    debug_d2vector_t("dists, after conversion", dists);
+    nj_table_t dists(d, row_size);
+    debug_matrix("dists", d, row_size);
 
     vector<node_t*> unroot;
     vector<node_t*> tree;
+    unroot.reserve(row_size);
+    tree.reserve(2*row_size);
     for(auto && l: labels){
         debug_print("making a new node with label: %s", l.c_str());
         auto tn = new node_t(l);
         unroot.push_back(tn);
         tree.push_back(tn);
     }
-    while(unroot.size() > 3){
-        join_pair(dists, unroot, tree);
-    }
+    run_nj_steps(dists, joins, hint, made, margin, search, threads,
+            [&](std::pair<size_t, size_t> p){
+                join_pair(dists, unroot, tree, p);
+            });
     /*
      * Time for the FINAL JOIN (DU DU DU DUUU)!
      * to do this, we have to take the final three taxa in the unroot and set
@@ -249,13 +875,16 @@ tree_t nj(const vector<double>& d, const vector<string>& labels){
      *            1   2
      */
     if(unroot.size() == 3){
-        unroot[0]->_weight = (dists[0][1] + dists[0][2] - dists[1][2])/2.0;
-        unroot[1]->_weight = (dists[1][0] + dists[1][2] - dists[0][2])/2.0;
-        unroot[2]->_weight = (dists[2][0] + dists[2][1] - dists[0][1])/2.0;
+        unroot[0]->_weight = (dists.dist(0, 1) + dists.dist(0, 2)
+                - dists.dist(1, 2))/2.0;
+        unroot[1]->_weight = (dists.dist(1, 0) + dists.dist(1, 2)
+                - dists.dist(0, 2))/2.0;
+        unroot[2]->_weight = (dists.dist(2, 0) + dists.dist(2, 1)
+                - dists.dist(0, 1))/2.0;
     }
     if(unroot.size() == 2){
-        unroot[0]->_weight = dists[0][1]/2.0;
-        unroot[1]->_weight = dists[0][1]/2.0;
+        unroot[0]->_weight = dists.dist(0, 1)/2.0;
+        unroot[1]->_weight = dists.dist(0, 1)/2.0;
     }
     tree_t ret(unroot);
     for(auto&& n: tree){
@@ -263,3 +892,153 @@ tree_t nj(const vector<double>& d, const vector<string>& labels){
     }
     return ret;
 }
+
+tree_t nj(const vector<double>& d, const vector<string>& labels,
+        nj_search_t search, size_t threads){
+    return make_nj_tree(d, labels, nullptr, nullptr, nullptr, nullptr,
+            search, threads);
+}
+
+tree_t nj_with_joins(const vector<double>& d, const vector<string>& labels,
+        const vector<std::pair<size_t, size_t>>& joins){
+    return make_nj_tree(d, labels, &joins);
+}
+
+tree_t nj_with_hint(const vector<double>& d, const vector<string>& labels,
+        const vector<std::pair<size_t, size_t>>& hint,
+        vector<std::pair<size_t, size_t>>& joins, double* margin,
+        nj_search_t search, size_t threads){
+    return make_nj_tree(d, labels, nullptr, &hint, &joins, margin, search,
+            threads);
+}
+
+void nj_sequence_with_hint(const vector<double>& d, size_t row_size,
+        const vector<std::pair<size_t, size_t>>& hint,
+        vector<std::pair<size_t, size_t>>& joins, double* margin,
+        nj_search_t search, size_t threads){
+    nj_table_t dists(d, row_size);
+    run_nj_steps(dists, nullptr, &hint, &joins, margin, search, threads,
+            [](std::pair<size_t, size_t>){});
+}
+
+/*
+ * Row i starts out as taxa i, and each join makes the cluster of the new
+ * node, which goes on the end like in nj(). Those are the clusters below the
+ * internal nodes of the tree, rooted where the last three rows meet.
+ */
+topology_key_t nj_topology_key(const vector<std::pair<size_t, size_t>>& joins,
+        size_t row_size){
+    size_t words = taxa_set_words(row_size);
+    vector<taxa_set_t> rows(row_size, taxa_set_t(words, 0));
+    for(size_t i = 0;i<row_size;++i){
+        rows[i][i/64] |= 1ull << (i%64);
+    }
+    vector<taxa_set_t> clusters;
+    clusters.reserve(joins.size());
+    for(auto&& p : joins){
+        size_t a = std::min(p.first, p.second);
+        size_t b = std::max(p.first, p.second);
+        taxa_set_t u = rows[a];
+        for(size_t w = 0;w<words;++w){
+            u[w] |= rows[b][w];
+        }
+        clusters.push_back(u);
+        rows.erase(rows.begin() + b);
+        rows.erase(rows.begin() + a);
+        rows.push_back(std::move(u));
+    }
+    return make_topology_key(clusters, row_size);
+}
+
+nj_search_t parse_nj_search(const string& s){
+    if(s == "exhaustive") return nj_search_t::exhaustive;
+    if(s == "bounded") return nj_search_t::bounded;
+    throw std::invalid_argument("Unknown NJ search '" + s + "'");
+}
+
+/*
+ * The Q values of the table, for the pairs i < j, in the order find_pair()
+ * goes through them. Also returns the largest size of any of them, to measure
+ * ties against.
+ */
+double calc_q_values(const nj_table_t& dists, vector<double>& q){
+    size_t n = dists.size();
+    q.clear();
+    double scale = 0.0;
+    for(size_t i = 0; i < n; ++i){
+        for(size_t j = i+1; j < n; ++j){
+            q.push_back(dists.q(i, j));
+            scale = std::max(scale, std::fabs(q.back()));
+        }
+    }
+    return scale;
+}
+
+/*
+ * find_pair() keeps the last pair with the lowest Q value, so that is the one
+ * that wins a tie.
+ */
+vector<std::pair<size_t, size_t>> nj_joins(const vector<double>& d,
+        size_t row_size){
+    vector<std::pair<size_t, size_t>> joins;
+    nj_table_t dists(d, row_size);
+    vector<double> q;
+    while(dists.size() > 3){
+        size_t n = dists.size();
+        double tie = NJ_TIE_TOLERANCE*calc_q_values(dists, q);
+        double lowest = *std::min_element(q.begin(), q.end());
+        std::pair<size_t, size_t> p;
+        size_t k = 0;
+        for(size_t i = 0; i < n; ++i){
+            for(size_t j = i+1; j < n; ++j, ++k){
+                if(q[k] <= lowest + tie) p = std::make_pair(i, j);
+            }
+        }
+        joins.push_back(p);
+        dists.join(p.first, p.second);
+    }
+    return joins;
+}
+
+bool nj_allows(const vector<double>& d, size_t row_size,
+        const vector<std::pair<size_t, size_t>>& joins){
+    nj_table_t dists(d, row_size);
+    vector<double> q;
+    for(auto&& p : joins){
+        size_t n = dists.size();
+        size_t a = p.first, b = p.second;
+        if(n <= 3 || a >= b || b >= n) return false;
+        double tie = NJ_TIE_TOLERANCE*calc_q_values(dists, q);
+        double lowest = *std::min_element(q.begin(), q.end());
+        //index of (a, b) in the upper triangle
+        size_t k = a*n - a*(a+1)/2 + (b - a - 1);
+        if(q[k] > lowest + tie) return false;
+        dists.join(a, b);
+    }
+    return dists.size() <= 3;
+}
+
+bool nj_is_clear(const vector<double>& d, size_t row_size){
+    nj_table_t dists(d, row_size);
+    vector<double> q;
+    while(dists.size() > 3){
+        size_t n = dists.size();
+        double tie = NJ_TIE_TOLERANCE*calc_q_values(dists, q);
+        double lowest = *std::min_element(q.begin(), q.end());
+        std::pair<size_t, size_t> p;
+        size_t close = 0, k = 0;
+        for(size_t i = 0; i < n; ++i){
+            for(size_t j = i+1; j < n; ++j, ++k){
+                //with four rows, (i,j) is the same split as the other two
+                if(n == 4 && i > 0) continue;
+                if(q[k] <= lowest + tie){
+                    p = std::make_pair(i, j);
+                    close++;
+                }
+            }
+        }
+        if(close > 1) return false;
+        dists.join(p.first, p.second);
+    }
+    return true;
+}
@@ -3,8 +3,29 @@
 #pragma once
 
 #include "tree.h"
+#include "topology.h"
 #include <vector>
 #include <string>
+#include <utility>
+
+/*
+ * How nj() finds the pair to join at each step. exhaustive works out the Q
+ * value of every pair. bounded keeps the distances of each row sorted, and
+ * skips the pairs whose Q value can't be the smallest, the way RapidNJ does.
+ * That takes O(n^2) memory on top of the table, and sorting the row of each
+ * new node, but for hundreds of taxa it looks at only a small part of each
+ * table. The trees are the same either way, ties and all.
+ */
+enum class nj_search_t{
+    exhaustive,
+    bounded,
+};
+
+/*
+ * Parses "exhaustive" or "bounded". Throws a std::invalid_argument for
+ * anything else.
+ */
+nj_search_t parse_nj_search(const std::string&);
 
 /*
  * Makes a new tree given a distance table. The vector of strings are labels
@@ -13,5 +34,113 @@
  * dimensional, it will be treated as a 2 dimensional vector. Therefore, the
  * size of the vector needs to be a perfect square. If it really is a distance
  * table, then there should be no problem.
+ *
+ * threads is how many threads to split each step of a big table over. The
+ * pair search and the update of the table after each join are both split up,
+ * once the table has a few hundred rows, so it pays off for thousands of
+ * taxa, where a single tree takes a while. The tree is the same however many
+ * threads there are.
+ *
+ * Ties go to the last of the pairs with the lowest Q value, i.e. the one
+ * with the biggest i, and then the biggest j. The row sums R are kept up to
+ * date from one step to the next instead of being added up again, so they
+ * aren't always rounded the way they used to be. If every sum is exact, like
+ * for a table of small whole numbers or halves, R is exact both ways and the
+ * join sequence is the same as before, ties and all. Otherwise R can be an
+ * ulp or so off from adding the row up, and two Q values that are only the
+ * same in exact arithmetic can tie, or not, or come out the other way round,
+ * so those ties can go differently. nj_allows() still holds for the join
+ * sequence either way. The lowest Q value also used to start out at zero,
+ * and if every Q value was more than zero, which only happens when the
+ * distances add up to less than zero, rows 0 and 0 got joined. Now the lowest
+ * pair is.
+ */
+tree_t nj(const std::vector<double>&, const std::vector<std::string>&,
+        nj_search_t search = nj_search_t::exhaustive, size_t threads = 1);
+
+/*
+ * These four are for working out which schedules give which join sequence.
+ * A join sequence is the pair joined at each step, as indices into the rows
+ * of the distance table at that step. The rows that are left keep their
+ * order, and the new node goes on the end, the same as in nj().
+ *
+ * nj_joins() gives the join sequence for a table with row_size rows. Q values
+ * that only differ by rounding error count as ties, and ties go to the pair
+ * that nj() would pick if there was no rounding at all. That can be a
+ * different pair from the one nj() picks, but only when the table is right on
+ * the boundary between two join sequences, or when the gene trees make two Q
+ * values the same no matter what the schedule is.
+ *
+ * nj_with_joins() makes the tree for a join sequence.
+ *
+ * nj_allows() says if the join sequence could be the one for the table, i.e.
+ * if every pair in it has the smallest Q value of its step, give or take
+ * rounding error. A table on the boundary between two join sequences is
+ * allowed by both.
+ *
+ * nj_is_clear() says if NJ never has to break a tie on the table, i.e. at
+ * every step one pair has the smallest Q value by more than rounding error.
+ * Then any table that only differs from it by rounding gets the same tree
+ * from nj(). With four rows left, a pair always has the same Q value as the
+ * other two, but joining either makes the same tree, so that isn't a tie.
+ */
+std::vector<std::pair<size_t, size_t>> nj_joins(const std::vector<double>&,
+        size_t row_size);
+tree_t nj_with_joins(const std::vector<double>&,
+        const std::vector<std::string>&,
+        const std::vector<std::pair<size_t, size_t>>&);
+bool nj_allows(const std::vector<double>&, size_t row_size,
+        const std::vector<std::pair<size_t, size_t>>&);
+bool nj_is_clear(const std::vector<double>&, size_t row_size);
+
+/*
+ * The same as nj(), but warm started from the join sequence of a similar
+ * table, like the one from the trial before. Tables that are close together
+ * can start off with the same joins, and then each step only checks that the
+ * hinted pair is still the one to join. The check goes along the table the
+ * same way nj() looks for the pair, and stops at the first row with a lower
+ * Q value, so it never costs more than the search it saves. Once the hint is
+ * wrong, the rest is done like nj() does it. The tree is always the same as the one nj()
+ * makes, hint or no hint. joins gets the join sequence of this table, so it
+ * can be the hint for the next one.
+ *
+ * If margin is given, it gets the decision margin of the tree: at each step,
+ * how much bigger the smallest Q value of the pairs that share a taxon with
+ * the one joined was than the Q value of that pair, and then the smallest of
+ * those over all the steps. A small margin means a small change to the table
+ * would have joined something else to one of the pair, and made a different
+ * tree. It only takes a pass over two rows of the table at each step, so it
+ * costs next to nothing. With 3 taxa or fewer there is nothing to pick, and
+ * it is infinite.
+ *
+ * The bounded search doesn't look at the hint, since checking the hinted
+ * pair is a pass over the whole table. Nor does a run on more than one
+ * thread, once the table is big enough to split up. joins is still filled in.
+ */
+tree_t nj_with_hint(const std::vector<double>&,
+        const std::vector<std::string>&,
+        const std::vector<std::pair<size_t, size_t>>& hint,
+        std::vector<std::pair<size_t, size_t>>& joins,
+        double* margin = nullptr,
+        nj_search_t search = nj_search_t::exhaustive, size_t threads = 1);
+
+/*
+ * For when only the topology of the tree matters, like in gstar.
+ *
+ * nj_sequence_with_hint() is nj_with_hint() without the tree: it only works
+ * out the join sequence, into joins, and the margin. No nodes get made and no
+ * branch lengths get worked out, so a step is just finding the pair and
+ * joining it in the table.
+ *
+ * nj_topology_key() gives the key of the topology a join sequence makes, the
+ * same as tree_t::calc_topology_key() gives for the tree, when the taxa are
+ * numbered in the order of the rows of the table, like star_t numbers them.
+ * The tree itself can then be made with nj_with_joins() if it is needed.
  */
-tree_t nj(const std::vector<double>&, const std::vector<std::string>&);
+void nj_sequence_with_hint(const std::vector<double>&, size_t row_size,
+        const std::vector<std::pair<size_t, size_t>>& hint,
+        std::vector<std::pair<size_t, size_t>>& joins,
+        double* margin = nullptr,
+        nj_search_t search = nj_search_t::exhaustive, size_t threads = 1);
+topology_key_t nj_topology_key(
+        const std::vector<std::pair<size_t, size_t>>&, size_t row_size);
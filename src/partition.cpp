@@ -0,0 +1,159 @@
+//partition.cpp
+//Bisection of the simplex of schedules, see partition.h.
+#include "partition.h"
+#include <vector>
+using std::vector;
+#include <deque>
+using std::deque;
+#include <unordered_map>
+using std::unordered_map;
+#include <algorithm>
+#include <cstdint>
+
+/*
+ * A piece is its corners, as indices into the table of points, the volume it
+ * has, and the region the centre of the piece it was cut from is in.
+ */
+struct piece_t{
+    vector<uint32_t> corners;
+    double volume;
+    size_t parent_region;
+};
+
+/*
+ * The corners of the pieces. A new corner is always the middle of an edge of
+ * an older piece, and the pieces on either side of that edge need the same
+ * one, so they are kept by edge.
+ */
+class corner_table_t{
+    public:
+        corner_table_t(size_t dims): _dims(dims){}
+
+        uint32_t add(const vector<double>& p){
+            _points.insert(_points.end(), p.begin(), p.end());
+            return (uint32_t)(_points.size()/_dims - 1);
+        }
+
+        uint32_t midpoint(uint32_t a, uint32_t b){
+            if(a > b) std::swap(a, b);
+            uint64_t edge = (uint64_t)a << 32 | b;
+            auto it = _midpoints.find(edge);
+            if(it != _midpoints.end()) return it->second;
+            vector<double> m(_dims);
+            for(size_t k = 0; k < _dims; ++k){
+                m[k] = (_points[a*_dims+k] + _points[b*_dims+k])/2.0;
+            }
+            uint32_t id = add(m);
+            _midpoints[edge] = id;
+            return id;
+        }
+
+        vector<double> get(uint32_t c) const{
+            return vector<double>(_points.begin() + c*_dims,
+                    _points.begin() + (c+1)*_dims);
+        }
+
+        double distance2(uint32_t a, uint32_t b) const{
+            double ret = 0.0;
+            for(size_t k = 0; k < _dims; ++k){
+                double d = _points[a*_dims+k] - _points[b*_dims+k];
+                ret += d*d;
+            }
+            return ret;
+        }
+
+    private:
+        size_t _dims;
+        vector<double> _points;
+        unordered_map<uint64_t, uint32_t> _midpoints;
+};
+
+static void add_volume(vector<double>& v, size_t region, double volume){
+    if(v.size() <= region) v.resize(region+1, 0.0);
+    v[region] += volume;
+}
+
+/*
+ * The pieces wait in a queue. Since every cut halves the volume, going through
+ * the queue in order takes the biggest pieces first.
+ *
+ * The longest edge is the one that gets cut, so the pieces don't get long and
+ * thin. Ties go to the first edge found, so the result doesn't depend on
+ * anything but the points.
+ */
+partition_result_t partition_simplex(size_t dims, size_t max_pieces,
+        const locate_t& locate, const allows_t& allows){
+    partition_result_t result;
+    corner_table_t table(dims);
+    deque<piece_t> queue;
+
+    piece_t whole;
+    whole.volume = 1.0;
+    whole.parent_region = 0;
+    for(size_t k = 0; k < dims; ++k){
+        vector<double> corner(dims, 0.0);
+        corner[k] = 1.0;
+        whole.corners.push_back(table.add(corner));
+    }
+    queue.push_back(whole);
+
+    vector<double> centre(dims);
+    while(!queue.empty() && result.pieces < max_pieces){
+        piece_t piece = std::move(queue.front());
+        queue.pop_front();
+        result.pieces++;
+
+        std::fill(centre.begin(), centre.end(), 0.0);
+        for(auto c : piece.corners){
+            auto p = table.get(c);
+            for(size_t k = 0; k < dims; ++k){
+                centre[k] += p[k]/piece.corners.size();
+            }
+        }
+        size_t region = locate(centre);
+        bool settled = true;
+        for(auto c : piece.corners){
+            if(!allows(region, table.get(c))){
+                settled = false;
+                break;
+            }
+        }
+        if(settled){
+            add_volume(result.certain, region, piece.volume);
+            continue;
+        }
+
+        size_t cut_a = 0, cut_b = 1;
+        double longest = -1.0;
+        for(size_t i = 0; i < piece.corners.size(); ++i){
+            for(size_t j = i+1; j < piece.corners.size(); ++j){
+                double d = table.distance2(piece.corners[i],
+                        piece.corners[j]);
+                if(d > longest){
+                    longest = d;
+                    cut_a = i;
+                    cut_b = j;
+                }
+            }
+        }
+        uint32_t mid = table.midpoint(piece.corners[cut_a],
+                piece.corners[cut_b]);
+        piece_t half;
+        half.volume = piece.volume/2.0;
+        half.parent_region = region;
+        half.corners = piece.corners;
+        half.corners[cut_a] = mid;
+        queue.push_back(half);
+        half.corners = piece.corners;
+        half.corners[cut_b] = mid;
+        queue.push_back(std::move(half));
+    }
+
+    for(auto&& piece : queue){
+        add_volume(result.unresolved, piece.parent_region, piece.volume);
+    }
+    size_t regions = std::max(result.certain.size(), result.unresolved.size());
+    result.certain.resize(regions, 0.0);
+    result.unresolved.resize(regions, 0.0);
+    return result;
+}
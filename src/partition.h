@@ -0,0 +1,59 @@
+//partition.h
+//Cutting the simplex of schedules up into the regions where NJ does the same
+//thing.
+//
+//Each step of NJ joins the pair with the smallest Q value, and every Q value
+//is a linear function of the schedule, as long as the steps before it joined
+//the same pairs. So the schedules that give one particular join sequence are
+//the points that satisfy a list of linear inequalities, which makes them a
+//convex region of the simplex. A piece of the simplex whose corners are all
+//allowed by a join sequence is then in that region completely, and its volume
+//can be counted towards the topology exactly, instead of estimated.
+//
+//partition_simplex() does this by bisection. It starts with the whole simplex,
+//and each piece it can't settle is cut in half across its longest edge. Cutting
+//in half keeps the volumes exact: a piece made by k cuts is 2^-k of the whole.
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <functional>
+
+/*
+ * locate:  Returns the region that the point is in. The region ids are up to
+ *          the caller, but they should start from zero and count up.
+ *
+ * allows:  Says if the point could be in the region. It should allow points
+ *          on the boundary of the region.
+ */
+typedef std::function<size_t(const std::vector<double>&)> locate_t;
+typedef std::function<bool(size_t, const std::vector<double>&)> allows_t;
+
+/*
+ * What partition_simplex() found. The volumes are shares of the whole
+ * simplex, so they add up to one.
+ *
+ *  certain:    For each region, the volume of the pieces that are certainly
+ *              in it.
+ *
+ *  unresolved: For each region, the volume of the pieces that were left
+ *              unsettled, where the piece they were cut from had its centre
+ *              in that region. It is a guess at how the rest is split up, not
+ *              a bound.
+ *
+ *  pieces:     Number of pieces that were looked at.
+ */
+struct partition_result_t{
+    std::vector<double> certain;
+    std::vector<double> unresolved;
+    size_t pieces = 0;
+};
+
+/*
+ * Partitions the simplex of points with dims non negative coordinates that add
+ * up to one. Each piece gets its centre located, and is settled if allows()
+ * says yes for every one of its corners. The pieces are looked at biggest
+ * first, and at most max_pieces of them.
+ */
+partition_result_t partition_simplex(size_t dims, size_t max_pieces,
+        const locate_t& locate, const allows_t& allows);
@@ -0,0 +1,243 @@
+//qmc.cpp
+//Scrambled Sobol and Halton points.
+//
+//The Sobol direction numbers are made here instead of read from a table. Each
+//dimension after the first gets the next primitive polynomial over GF(2), in
+//order of degree, and its first few direction numbers are odd numbers picked
+//by a fixed generator. Any such choice gives a proper Sobol sequence. The
+//published tables (Joe and Kuo) pick them more carefully, which matters most
+//for the two dimensional projections of an unscrambled sequence.
+//
+//The scrambling is the hash based Owen scrambling of Burley 2020, "Practical
+//Hash-based Owen Scrambling". For Halton, each digit position of each
+//dimension gets a random affine map of the digits.
+#include "qmc.h"
+#include "rng.h"
+#include <string>
+using std::string;
+#include <vector>
+using std::vector;
+#include <stdexcept>
+#include <algorithm>
+
+//Streams of the run seed from here up are used for scrambling, trials only
+//use the ones below
+const uint64_t SCRAMBLE_STREAM = (uint64_t)1 << 63;
+
+const double TWO_TO_MINUS_32 = 1.0/4294967296.0;
+const double TWO_TO_MINUS_53 = 1.0/9007199254740992.0;
+
+sampler_t parse_sampler(const string& s){
+    if(s == "random") return sampler_t::random;
+    if(s == "sobol") return sampler_t::sobol;
+    if(s == "halton") return sampler_t::halton;
+    throw std::invalid_argument("Unknown sampler '" + s + "'");
+}
+
+string sampler_name(sampler_t sampler){
+    switch(sampler){
+        case sampler_t::sobol: return "sobol";
+        case sampler_t::halton: return "halton";
+        default: return "random";
+    }
+}
+
+qmc_t::qmc_t(sampler_t kind, size_t dims, uint64_t seed): _kind(kind),
+    _dims(dims), _seed(seed){
+    if(_kind == sampler_t::sobol){
+        init_sobol();
+    }
+    else if(_kind == sampler_t::halton){
+        init_halton();
+    }
+    else{
+        throw std::invalid_argument("qmc_t needs sobol or halton");
+    }
+}
+
+/*
+ * a*b mod poly, for polynomials over GF(2) stored as bits, where poly has
+ * degree deg.
+ */
+static uint64_t gf2_mulmod(uint64_t a, uint64_t b, uint64_t poly,
+        unsigned deg){
+    uint64_t ret = 0;
+    while(b){
+        if(b & 1) ret ^= a;
+        b >>= 1;
+        a <<= 1;
+        if(a >> deg & 1) a ^= poly;
+    }
+    return ret;
+}
+
+static uint64_t gf2_powmod(uint64_t e, uint64_t poly, unsigned deg){
+    uint64_t ret = 1, x = deg == 1 ? 1 : 2;
+    //x mod (x+1) is 1, every other degree leaves x as it is
+    while(e){
+        if(e & 1) ret = gf2_mulmod(ret, x, poly, deg);
+        x = gf2_mulmod(x, x, poly, deg);
+        e >>= 1;
+    }
+    return ret;
+}
+
+/*
+ * A polynomial of degree deg is primitive if x has order 2^deg-1 modulo it.
+ */
+static bool is_primitive(uint64_t poly, unsigned deg){
+    uint64_t order = ((uint64_t)1 << deg) - 1;
+    if(gf2_powmod(order, poly, deg) != 1) return false;
+    uint64_t rest = order;
+    for(uint64_t q = 2; q*q <= rest; ++q){
+        if(rest % q != 0) continue;
+        while(rest % q == 0) rest /= q;
+        if(gf2_powmod(order/q, poly, deg) == 1) return false;
+    }
+    if(rest > 1 && gf2_powmod(order/rest, poly, deg) == 1){
+        return false;
+    }
+    return true;
+}
+
+/*
+ * The 32 direction numbers of each dimension go in _directions, the k-th one
+ * being m_k/2^k as a 32 bit fraction. The first dimension is just the van der
+ * Corput sequence, m_k = 1.
+ */
+void qmc_t::init_sobol(){
+    _directions.assign(32*_dims, 0);
+    philox_t pick(0x50b01, 0);
+    uint64_t poly = 1;
+    unsigned deg = 0;
+    for(size_t d = 0; d < _dims; ++d){
+        uint32_t* v = &_directions[32*d];
+        if(d == 0){
+            for(unsigned k = 1; k <= 32; ++k){
+                v[k-1] = (uint32_t)1 << (32-k);
+            }
+            continue;
+        }
+        //the next primitive polynomial, x^deg + ... + 1
+        do{
+            poly += 2;
+            if(poly >> (deg+1)){
+                deg++;
+                poly = ((uint64_t)1 << deg) | 1;
+            }
+        } while(!is_primitive(poly, deg));
+
+        uint64_t m[33];
+        for(unsigned k = 1; k <= 32; ++k){
+            if(k <= deg){
+                m[k] = (pick() % ((uint64_t)1 << (k-1)))*2 + 1;
+                continue;
+            }
+            m[k] = m[k-deg] ^ (m[k-deg] << deg);
+            for(unsigned i = 1; i < deg; ++i){
+                if(poly >> (deg-i) & 1){
+                    m[k] ^= m[k-i] << i;
+                }
+            }
+        }
+        for(unsigned k = 1; k <= 32; ++k){
+            v[k-1] = (uint32_t)(m[k] << (32-k));
+        }
+    }
+
+    _scramble.assign(_dims, 0);
+    if(_seed != 0){
+        philox_t gen(_seed, SCRAMBLE_STREAM);
+        for(auto& s : _scramble) s = (uint32_t)gen();
+    }
+}
+
+void qmc_t::init_halton(){
+    for(uint32_t p = 2; _bases.size() < _dims; ++p){
+        bool prime = true;
+        for(auto q : _bases){
+            if(q*q > p) break;
+            if(p % q == 0){
+                prime = false;
+                break;
+            }
+        }
+        if(prime) _bases.push_back(p);
+    }
+
+    philox_t gen(_seed, SCRAMBLE_STREAM);
+    for(auto p : _bases){
+        //enough digits for a double's worth of precision
+        size_t digits = 0;
+        for(double scale = 1.0; scale > TWO_TO_MINUS_53; scale /= p) digits++;
+        _digits.push_back(digits);
+        _digit_start.push_back(_affine.size());
+        for(size_t k = 0; k < digits; ++k){
+            if(_seed == 0){
+                _affine.push_back(1);
+                _affine.push_back(0);
+            }
+            else{
+                _affine.push_back(1 + gen() % (p-1));
+                _affine.push_back(gen() % p);
+            }
+        }
+    }
+}
+
+static uint32_t reverse_bits(uint32_t x){
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+/*
+ * Each bit only gets mixed with the bits below it, so after reversing, each
+ * bit of the fraction is flipped depending only on the bits above it. That is
+ * what Owen scrambling does, so the points stay as evenly spread as they were.
+ */
+static uint32_t owen_scramble(uint32_t x, uint32_t seed){
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+void qmc_t::point(uint64_t index, double* u) const{
+    if(_kind == sampler_t::sobol){
+        uint32_t i = (uint32_t)index;
+        for(size_t d = 0; d < _dims; ++d){
+            const uint32_t* v = &_directions[32*d];
+            uint32_t x = 0;
+            for(uint32_t b = i, k = 0; b; b >>= 1, ++k){
+                if(b & 1) x ^= v[k];
+            }
+            if(_seed != 0){
+                x = owen_scramble(x, _scramble[d]);
+            }
+            //the middle of the cell, so that nothing is exactly zero
+            u[d] = (x + 0.5) * TWO_TO_MINUS_32;
+        }
+        return;
+    }
+
+    for(size_t d = 0; d < _dims; ++d){
+        uint64_t p = _bases[d];
+        const uint32_t* affine = &_affine[_digit_start[d]];
+        uint64_t rest = index;
+        double scale = 1.0/p;
+        double x = 0.0;
+        for(size_t k = 0; k < _digits[d]; ++k){
+            uint64_t digit = rest % p;
+            rest /= p;
+            x += ((affine[2*k]*digit + affine[2*k+1]) % p) * scale;
+            scale /= p;
+        }
+        u[d] = std::min(x, 1.0 - TWO_TO_MINUS_53);
+    }
+}
@@ -0,0 +1,77 @@
+//qmc.h
+//Quasi random points for the random schedules.
+//
+//Random points clump together and leave gaps, so it takes a lot of them before
+//every part of the simplex has been tried. A low discrepancy sequence spreads
+//its points out evenly on purpose, so the topology ratios settle down with
+//fewer trials. Two are here, Sobol and Halton. Both are scrambled with the run
+//seed (randomised QMC), so each point is still uniform on its own, the
+//results are still unbiased, and runs with different seeds are independent
+//estimates that can be compared to get an error bar.
+//
+//Like Philox, point i can be made directly from i, so trial i gets the same
+//point however the trials are split up over threads, checkpoints and shards.
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+enum class sampler_t{
+    random,
+    sobol,
+    halton,
+};
+
+/*
+ * Parses "random", "sobol" or "halton". Throws a std::invalid_argument for
+ * anything else.
+ */
+sampler_t parse_sampler(const std::string&);
+
+std::string sampler_name(sampler_t);
+
+//Sobol points are 32 bits, so there are only this many before they repeat
+const uint64_t SOBOL_MAX_POINTS = (uint64_t)1 << 32;
+
+class qmc_t{
+    public:
+        /*
+         * kind:    sobol or halton.
+         *
+         * dims:    Number of coordinates in a point.
+         *
+         * seed:    Seed for the scrambling. Zero leaves the points as they
+         *          are, which is only useful for testing.
+         */
+        qmc_t(sampler_t kind, size_t dims, uint64_t seed);
+
+        /*
+         * Writes the dims coordinates of point index to u. Every coordinate is
+         * in [0,1).
+         */
+        void point(uint64_t index, double* u) const;
+
+        size_t get_dims() const { return _dims; }
+
+    private:
+        void init_sobol();
+        void init_halton();
+
+        sampler_t _kind;
+        size_t _dims;
+        uint64_t _seed;
+
+        //sobol: 32 direction numbers and a scrambling seed for each dimension
+        std::vector<uint32_t> _directions;
+        std::vector<uint32_t> _scramble;
+
+        //halton: the prime base of each dimension, how many digits to make,
+        //and for each digit position a scrambling d -> (a*d + b) mod base,
+        //as a, b pairs laid end to end
+        std::vector<uint32_t> _bases;
+        std::vector<size_t> _digits;
+        std::vector<size_t> _digit_start;
+        std::vector<uint32_t> _affine;
+};
@@ -0,0 +1,73 @@
+//ring.h
+//A bounded, lock free ring buffer for one producer thread and one consumer
+//thread. The slots are made once up front and reused, so if T holds a vector,
+//its memory gets reused too, and pushing a record doesn't allocate once the
+//ring has gone round once.
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+template<typename T>
+class spsc_ring_t{
+    public:
+        //capacity is rounded up to a power of two
+        spsc_ring_t(size_t capacity): _head(0), _tail(0){
+            size_t size = 1;
+            while(size < capacity) size <<= 1;
+            _slots.resize(size);
+            _mask = size - 1;
+        }
+
+        /*
+         * The next free slot for the producer to fill in, or nullptr if the
+         * ring is full. The slot isn't seen by the consumer until push().
+         */
+        T* next_free(){
+            size_t head = _head.load(std::memory_order_relaxed);
+            if(head - _tail.load(std::memory_order_acquire) > _mask){
+                return nullptr;
+            }
+            return &_slots[head & _mask];
+        }
+
+        //hands the slot from next_free() to the consumer
+        void push(){
+            _head.store(_head.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+        }
+
+        /*
+         * The oldest slot the producer has pushed, or nullptr if there isn't
+         * one. It stays valid until pop().
+         */
+        T* front(){
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            if(tail == _head.load(std::memory_order_acquire)){
+                return nullptr;
+            }
+            return &_slots[tail & _mask];
+        }
+
+        //gives the slot from front() back to the producer
+        void pop(){
+            _tail.store(_tail.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+        }
+
+        bool empty() const{
+            return _tail.load(std::memory_order_acquire)
+                == _head.load(std::memory_order_acquire);
+        }
+
+        size_t capacity() const { return _mask + 1; }
+
+    private:
+        std::vector<T> _slots;
+        size_t _mask;
+        //head and tail get their own cache lines, since each one is written
+        //by a different thread
+        alignas(64) std::atomic<size_t> _head;
+        alignas(64) std::atomic<size_t> _tail;
+};
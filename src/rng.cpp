@@ -0,0 +1,83 @@
+//rng.cpp
+//Implementation of the Philox4x32-10 counter based generator.
+
+#include "rng.h"
+#include <random>
+
+const uint32_t PHILOX_M0 = 0xD2511F53;
+const uint32_t PHILOX_M1 = 0xCD9E8D57;
+const uint32_t PHILOX_W0 = 0x9E3779B9;
+const uint32_t PHILOX_W1 = 0xBB67AE85;
+
+inline void mulhilo(uint32_t a, uint32_t b, uint32_t& lo, uint32_t& hi){
+    uint64_t p = (uint64_t)a * b;
+    lo = (uint32_t)p;
+    hi = (uint32_t)(p >> 32);
+}
+
+void philox4x32(uint32_t ctr[4], const uint32_t key[2]){
+    uint32_t k0 = key[0], k1 = key[1];
+    for(int round = 0; round < 10; ++round){
+        uint32_t lo0, hi0, lo1, hi1;
+        mulhilo(PHILOX_M0, ctr[0], lo0, hi0);
+        mulhilo(PHILOX_M1, ctr[2], lo1, hi1);
+        uint32_t c1 = ctr[1], c3 = ctr[3];
+        ctr[0] = hi1^c1^k0;
+        ctr[1] = lo1;
+        ctr[2] = hi0^c3^k1;
+        ctr[3] = lo0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+}
+
+/*
+ * The same rounds as above, with the lanes as the outer loop, so that the
+ * compiler unrolls the rounds and runs the lanes through them side by side.
+ * The 64 bit products are what it needs to see to use the vector multiplies
+ * that give both halves.
+ */
+void philox4x32_lanes(uint32_t ctr[4][PHILOX_LANES], const uint32_t key[2]){
+    for(size_t l = 0; l < PHILOX_LANES; ++l){
+        uint32_t c0 = ctr[0][l], c1 = ctr[1][l], c2 = ctr[2][l],
+                 c3 = ctr[3][l];
+        uint32_t k0 = key[0], k1 = key[1];
+        for(int round = 0; round < 10; ++round){
+            uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+            uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+            c0 = (uint32_t)(p1 >> 32)^c1^k0;
+            c1 = (uint32_t)p1;
+            c2 = (uint32_t)(p0 >> 32)^c3^k1;
+            c3 = (uint32_t)p0;
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+        ctr[0][l] = c0;
+        ctr[1][l] = c1;
+        ctr[2][l] = c2;
+        ctr[3][l] = c3;
+    }
+}
+
+/*
+ * The counter is laid out as (block, stream), with the block count in the low
+ * two words. So each stream gets 2^64 blocks of 128 bits to itself.
+ */
+void philox_t::refill(){
+    _out[0] = (uint32_t)_block;
+    _out[1] = (uint32_t)(_block>>32);
+    _out[2] = (uint32_t)_stream;
+    _out[3] = (uint32_t)(_stream>>32);
+    philox4x32(_out, _key);
+    _block++;
+    _index = 0;
+}
+
+uint64_t random_seed(){
+    std::random_device rd;
+    uint64_t seed = 0;
+    while(seed == 0){
+        seed = ((uint64_t)rd() << 32) | rd();
+    }
+    return seed;
+}
@@ -0,0 +1,83 @@
+//rng.h
+//Counter based random number generation for gstar.
+//The generator here is Philox4x32-10, from Salmon et. al. 2011, "Parallel
+//Random Numbers: As Easy as 1, 2, 3". Instead of carrying state from one draw
+//to the next, it encrypts a counter with a key. That means we can jump
+//straight to any stream, which is what lets trial i get the same schedule no
+//matter how the trials are split up over threads or machines.
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <cstddef>
+
+class philox_t{
+    public:
+        typedef uint64_t result_type;
+
+        /*
+         * seed:    The key for the generator, normally the run seed.
+         * stream:  Which stream to produce, normally the trial index.
+         */
+        philox_t(uint64_t seed, uint64_t stream): _key{(uint32_t)seed,
+            (uint32_t)(seed>>32)}, _stream(stream), _block(0), _index(4) {};
+
+        static constexpr result_type min(){ return 0; }
+        static constexpr result_type max(){
+            return std::numeric_limits<result_type>::max();
+        }
+
+        result_type operator()(){
+            if(_index >= 4){
+                refill();
+            }
+            uint64_t ret = ((uint64_t)_out[_index+1] << 32) | _out[_index];
+            _index += 2;
+            return ret;
+        }
+
+        //a double in [0,1), using the top 53 bits of a draw
+        double uniform(){
+            return ((*this)() >> 11) * (1.0/9007199254740992.0);
+        }
+
+        //the next whole block of 4 words, skipping what is left of this one
+        void next_block(uint32_t out[4]){
+            refill();
+            for(int k = 0; k < 4; ++k) out[k] = _out[k];
+            _index = 4;
+        }
+
+        uint64_t get_stream() const { return _stream; }
+
+    private:
+        void refill();
+
+        uint32_t _key[2];
+        uint64_t _stream;
+        uint64_t _block;
+        uint32_t _out[4];
+        unsigned _index;
+};
+
+/*
+ * The bare Philox4x32-10 bijection. Encrypts the 4 word counter with the 2
+ * word key, and writes the result back into the counter.
+ */
+void philox4x32(uint32_t counter[4], const uint32_t key[2]);
+
+//Number of counters philox4x32_lanes() encrypts at once
+const size_t PHILOX_LANES = 8;
+
+/*
+ * Same as philox4x32(), but on PHILOX_LANES counters side by side, word k of
+ * counter l in ctr[k][l]. The rounds are plain loops over the lanes, so the
+ * compiler can do them with vector instructions.
+ */
+void philox4x32_lanes(uint32_t ctr[4][PHILOX_LANES], const uint32_t key[2]);
+
+/*
+ * Pulls a seed out of std::random_device, for when the user didn't give one.
+ * Never returns zero, since zero means "pick one for me" on the command line.
+ */
+uint64_t random_seed();
@@ -0,0 +1,713 @@
+//schedule_log.cpp
+//Writing and dumping schedule logs.
+//
+//A binary log is laid out as, with every integer little endian:
+//
+//  8 bytes     magic, "SUNSTARL"
+//  u32         version, 1 or 2
+//  u32         bytes per weight, 4 or 8
+//  u32         weights per schedule
+//  u32         flags, only in version 2, bit 0 is set if the trials have
+//              importance weights, bit 1 if they have decision margins
+//  u32         length of the root label, then the label
+//  blocks      u32 raw size, u32 compressed size, zlib compressed data
+//
+//and each block, once it is uncompressed, is
+//
+//  u32         number of new topologies
+//  topologies  u32 id, u64 key hi, u64 key lo, u32 length, newick string
+//  u32         number of trials
+//  columns     trial index deltas (u64), topology ids (u32), weights,
+//              importance weights (f64) if the flag is set, and margins (f64)
+//              if that flag is set
+//
+//The columns are stored one byte plane at a time: all the low bytes, then all
+//the second bytes, and so on. The high bytes of the weights are mostly the
+//exponent, and the trial indices go up by one, so those planes squash down to
+//nearly nothing. The index delta is the gap from the trial before it, less
+//one, so it is zero for a run that logs every trial in order.
+#include "schedule_log.h"
+#include "dtoa.h"
+#include <fstream>
+using std::ifstream;
+using std::ofstream;
+#include <string>
+using std::string;
+#include <vector>
+using std::vector;
+#include <stdexcept>
+#include <cstring>
+#include <iterator>
+#include <chrono>
+#include <cmath>
+#include <zlib.h>
+#include <unistd.h>
+//for truncate
+
+const char LOG_MAGIC[8] = {'S','U','N','S','T','A','R','L'};
+const uint32_t LOG_VERSION = 2;
+
+const uint32_t LOG_FLAG_IMPORTANCE = 1;
+const uint32_t LOG_FLAG_MARGIN = 2;
+
+//Number of trials to put in a block before compressing it
+const size_t LOG_BLOCK_TRIALS = 4096;
+
+//How much JSON to build up before writing it out
+const size_t LOG_WRITE_SIZE = 1 << 20;
+
+log_format_t parse_log_format(const string& s){
+    if(s == "json") return log_format_t::json;
+    if(s == "binary" || s == "binary32") return log_format_t::binary32;
+    if(s == "binary64") return log_format_t::binary64;
+    throw std::invalid_argument("Unknown log format '" + s + "'");
+}
+
+static size_t weight_width(log_format_t format){
+    return format == log_format_t::binary64 ? 8 : 4;
+}
+
+static void put_int(string& buf, uint64_t v, size_t bytes){
+    for(size_t i = 0; i < bytes; ++i){
+        buf.push_back((char)(v >> (8*i)));
+    }
+}
+
+/*
+ * Appends the values, each width bytes wide, one byte plane at a time.
+ */
+template<typename T>
+static void put_planes(string& buf, const vector<T>& values, size_t width){
+    size_t start = buf.size();
+    size_t n = values.size();
+    buf.resize(start + n*width);
+    for(size_t b = 0; b < width; ++b){
+        char* plane = &buf[start + b*n];
+        for(size_t i = 0; i < n; ++i){
+            plane[i] = (char)(values[i] >> (8*b));
+        }
+    }
+}
+
+/*
+ * Pulls little endian integers, strings and byte planes out of a buffer, and
+ * throws if we run off the end.
+ */
+class log_reader_t{
+    public:
+        log_reader_t(const string& buf): _buf(buf), _pos(0) {};
+
+        uint64_t get(size_t bytes){
+            check(bytes);
+            uint64_t v = 0;
+            for(size_t i = 0; i < bytes; ++i){
+                v |= (uint64_t)(unsigned char)_buf[_pos++] << (8*i);
+            }
+            return v;
+        }
+
+        string get_string(size_t len){
+            check(len);
+            string ret = _buf.substr(_pos, len);
+            _pos += len;
+            return ret;
+        }
+
+        vector<uint64_t> get_planes(size_t n, size_t width){
+            check(n*width);
+            vector<uint64_t> values(n, 0);
+            for(size_t b = 0; b < width; ++b){
+                for(size_t i = 0; i < n; ++i){
+                    values[i] |=
+                        (uint64_t)(unsigned char)_buf[_pos++] << (8*b);
+                }
+            }
+            return values;
+        }
+
+        bool done() const { return _pos == _buf.size(); }
+
+    private:
+        void check(size_t bytes){
+            if(_buf.size() - _pos < bytes){
+                throw std::runtime_error("Schedule log is damaged");
+            }
+        }
+
+        const string& _buf;
+        size_t _pos;
+};
+
+struct log_header_t{
+    size_t width;
+    size_t depth;
+    bool importance;
+    bool margins;
+    string root;
+};
+
+struct log_topology_t{
+    uint32_t id;
+    topology_key_t key;
+    string newick;
+};
+
+struct log_block_t{
+    vector<log_topology_t> topologies;
+    vector<uint64_t> trial_deltas;
+    vector<uint64_t> ids;
+    vector<double> weights;
+    vector<double> importances;
+    vector<double> margins;
+};
+
+static bool read_log_header(ifstream& in, log_header_t& header){
+    char magic[sizeof(LOG_MAGIC)];
+    if(!in.read(magic, sizeof(magic))
+            || std::memcmp(magic, LOG_MAGIC, sizeof(magic)) != 0){
+        return false;
+    }
+    string buf(4, '\0');
+    if(!in.read(&buf[0], buf.size())){
+        throw std::runtime_error("Schedule log is damaged");
+    }
+    uint64_t version = log_reader_t(buf).get(4);
+    if(version != 1 && version != LOG_VERSION){
+        throw std::runtime_error("Schedule log has an unknown version");
+    }
+    buf.assign(version == 1 ? 12 : 16, '\0');
+    if(!in.read(&buf[0], buf.size())){
+        throw std::runtime_error("Schedule log is damaged");
+    }
+    log_reader_t r(buf);
+    header.width = r.get(4);
+    header.depth = r.get(4);
+    uint64_t flags = version > 1 ? r.get(4) : 0;
+    header.importance = flags & LOG_FLAG_IMPORTANCE;
+    header.margins = flags & LOG_FLAG_MARGIN;
+    buf.assign(r.get(4), '\0');
+    if(!in.read(&buf[0], buf.size())){
+        throw std::runtime_error("Schedule log is damaged");
+    }
+    header.root = buf;
+    return true;
+}
+
+/*
+ * Reads the next block, if there is one.
+ */
+static bool read_log_block(ifstream& in, const log_header_t& header,
+        log_block_t& block){
+    string sizes(8, '\0');
+    if(!in.read(&sizes[0], sizes.size())){
+        if(in.gcount() == 0) return false;
+        throw std::runtime_error("Schedule log is damaged");
+    }
+    log_reader_t sr(sizes);
+    uLongf raw_size = sr.get(4);
+    string compressed(sr.get(4), '\0');
+    if(!in.read(&compressed[0], compressed.size())){
+        throw std::runtime_error("Schedule log is damaged");
+    }
+    string raw(raw_size, '\0');
+    if(uncompress((Bytef*)&raw[0], &raw_size, (const Bytef*)compressed.data(),
+                compressed.size()) != Z_OK || raw_size != raw.size()){
+        throw std::runtime_error("Schedule log is damaged");
+    }
+
+    log_reader_t r(raw);
+    block.topologies.clear();
+    size_t topologies = r.get(4);
+    for(size_t i = 0; i < topologies; ++i){
+        log_topology_t t;
+        t.id = r.get(4);
+        t.key.hi = r.get(8);
+        t.key.lo = r.get(8);
+        t.newick = r.get_string(r.get(4));
+        block.topologies.push_back(std::move(t));
+    }
+    size_t records = r.get(4);
+    block.trial_deltas = r.get_planes(records, 8);
+    block.ids = r.get_planes(records, 4);
+    auto bits = r.get_planes(records*header.depth, header.width);
+    block.weights.resize(bits.size());
+    for(size_t i = 0; i < bits.size(); ++i){
+        if(header.width == 4){
+            uint32_t b = bits[i];
+            float f;
+            std::memcpy(&f, &b, sizeof(f));
+            block.weights[i] = f;
+        }
+        else{
+            std::memcpy(&block.weights[i], &bits[i], sizeof(double));
+        }
+    }
+    block.importances.assign(header.importance ? records : 0, 0.0);
+    if(header.importance){
+        bits = r.get_planes(records, 8);
+        std::memcpy(block.importances.data(), bits.data(),
+                records*sizeof(double));
+    }
+    block.margins.assign(header.margins ? records : 0, 0.0);
+    if(header.margins){
+        bits = r.get_planes(records, 8);
+        std::memcpy(block.margins.data(), bits.data(),
+                records*sizeof(double));
+    }
+    if(!r.done()){
+        throw std::runtime_error("Schedule log is damaged");
+    }
+    return true;
+}
+
+schedule_log_t::schedule_log_t(size_t ring_size):
+    _format(log_format_t::binary32), _depth(0), _has_importance(false),
+    _has_margins(false), _stalls(0), _importance(1.0), _marks(0),
+    _ring(ring_size),
+    _writer_sleeping(false), _producer_waiting(false), _stop(false),
+    _flush_requested(0), _flush_done(0), _offset(0), _failed(false),
+    _records(0), _new_topology_count(0), _last_trial(~0ull) {}
+
+schedule_log_t::~schedule_log_t(){
+    try{
+        close();
+    }
+    catch(const std::exception&){
+        //nowhere to report it from a destructor
+    }
+}
+
+void schedule_log_t::create(const string& filename, log_format_t format,
+        const string& root, size_t depth, bool importance, bool margins){
+    close();
+    _format = format;
+    _depth = depth;
+    _has_importance = importance;
+    _has_margins = margins;
+    _importance = 1.0;
+    _topologies.clear();
+    _last_trial = ~0ull;
+    _file.open(filename.c_str(), std::ios::binary | std::ios::trunc);
+    if(_format == log_format_t::json){
+        _file<<"using root: '"<<root<<"'"<<std::endl;
+    }
+    else{
+        string buf(LOG_MAGIC, sizeof(LOG_MAGIC));
+        put_int(buf, LOG_VERSION, 4);
+        put_int(buf, weight_width(_format), 4);
+        put_int(buf, _depth, 4);
+        put_int(buf, (_has_importance ? LOG_FLAG_IMPORTANCE : 0)
+                | (_has_margins ? LOG_FLAG_MARGIN : 0), 4);
+        put_int(buf, root.size(), 4);
+        buf += root;
+        _file.write(buf.data(), buf.size());
+    }
+    start();
+}
+
+void schedule_log_t::resume(const string& filename, log_format_t format,
+        size_t depth, uint64_t offset){
+    close();
+    _format = format;
+    _depth = depth;
+    _has_importance = false;
+    _has_margins = false;
+    _importance = 1.0;
+    _topologies.clear();
+    _last_trial = ~0ull;
+    if(truncate(filename.c_str(), offset) != 0){
+        throw std::runtime_error("Could not cut the log '" + filename
+                + "' back to the checkpoint");
+    }
+
+    if(_format != log_format_t::json){
+        //read back the topology ids that are already in use
+        ifstream in(filename.c_str(), std::ios::binary);
+        log_header_t header;
+        if(!read_log_header(in, header)){
+            throw std::runtime_error("'" + filename
+                    + "' is not a binary schedule log");
+        }
+        if(header.width != weight_width(_format) || header.depth != _depth){
+            throw std::runtime_error("The log '" + filename
+                    + "' was written with different settings");
+        }
+        _has_importance = header.importance;
+        _has_margins = header.margins;
+        log_block_t block;
+        while(read_log_block(in, header, block)){
+            for(auto& t : block.topologies){
+                _topologies[t.key] = std::make_pair(t.id, t.newick);
+            }
+            for(auto d : block.trial_deltas){
+                _last_trial += d + 1;
+            }
+        }
+    }
+
+    _file.open(filename.c_str(), std::ios::binary | std::ios::in
+            | std::ios::out);
+    _file.seekp(0, std::ios::end);
+    if(!_file){
+        throw std::runtime_error("Could not open the log '" + filename + "'");
+    }
+    start();
+}
+
+void schedule_log_t::start(){
+    _stop = false;
+    _failed = false;
+    _flush_requested = _flush_done = 0;
+    _marks = 0;
+    _mark_offsets.clear();
+    _records = 0;
+    _new_topology_count = 0;
+    _new_topologies.clear();
+    _text.clear();
+    _writer = std::thread(&schedule_log_t::run_writer, this);
+}
+
+void schedule_log_t::close(){
+    if(!_writer.joinable()) return;
+    {
+        //the writer does one last flush before it stops
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++_flush_requested;
+        _stop = true;
+    }
+    _wake.notify_one();
+    _writer.join();
+    _file.close();
+    if(_failed){
+        throw std::runtime_error(_error);
+    }
+}
+
+/*
+ * A free slot in the ring, waiting for the writer to free one up if it has to.
+ */
+log_record_t* schedule_log_t::next_free(){
+    log_record_t* slot;
+    while(!(slot = _ring.next_free())){
+        //the writer is behind, so wait for it to free up a slot
+        if(_failed){
+            throw std::runtime_error(_error);
+        }
+        ++_stalls;
+        std::unique_lock<std::mutex> lock(_mutex);
+        _producer_waiting = true;
+        _wake.notify_one();
+        _space.wait_for(lock, std::chrono::milliseconds(1));
+        _producer_waiting = false;
+    }
+    return slot;
+}
+
+//hands the slot from next_free() to the writer
+void schedule_log_t::push(){
+    _ring.push();
+    if(_writer_sleeping){
+        std::lock_guard<std::mutex> lock(_mutex);
+        _wake.notify_one();
+    }
+}
+
+void schedule_log_t::write(uint64_t trial, const topology_key_t& key,
+        const string& newick, const vector<double>& weights, double margin){
+    log_record_t* slot = next_free();
+    auto it = _topologies.find(key);
+    slot->new_topology = it == _topologies.end();
+    if(slot->new_topology){
+        uint32_t id = _topologies.size();
+        it = _topologies.emplace(key, std::make_pair(id, newick)).first;
+    }
+    slot->mark = false;
+    slot->trial = trial;
+    slot->id = it->second.first;
+    slot->key = key;
+    slot->newick = &it->second.second;
+    slot->weights.assign(weights.begin(), weights.end());
+    slot->importance = _importance;
+    slot->margin = margin;
+    push();
+}
+
+uint64_t schedule_log_t::flush(){
+    if(!_writer.joinable()) return _offset;
+    std::unique_lock<std::mutex> lock(_mutex);
+    uint64_t ticket = ++_flush_requested;
+    _wake.notify_one();
+    _flushed.wait(lock, [&]{ return _flush_done >= ticket || _failed; });
+    if(_failed){
+        throw std::runtime_error(_error);
+    }
+    return _offset;
+}
+
+uint64_t schedule_log_t::mark(){
+    if(!_writer.joinable()) return 0;
+    log_record_t* slot = next_free();
+    slot->mark = true;
+    slot->trial = ++_marks;
+    push();
+    return _marks;
+}
+
+uint64_t schedule_log_t::offset_at(uint64_t mark){
+    std::unique_lock<std::mutex> lock(_mutex);
+    if(mark == 0) return _offset;
+    _flushed.wait(lock, [&]{ return _mark_offsets.count(mark) || _failed; });
+    if(_failed){
+        throw std::runtime_error(_error);
+    }
+    uint64_t offset = _mark_offsets[mark];
+    _mark_offsets.erase(mark);
+    return offset;
+}
+
+/*
+ * The writer thread. It empties the ring, and then either does a flush that
+ * was asked for, or goes to sleep until there is more to do. The sleep has a
+ * timeout, in case it misses a wake up.
+ */
+void schedule_log_t::run_writer(){
+    try{
+        for(;;){
+            while(auto record = _ring.front()){
+                consume(*record);
+                _ring.pop();
+                if(_producer_waiting){
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _space.notify_one();
+                }
+            }
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            if(!_ring.empty()) continue;
+            if(_flush_requested != _flush_done){
+                uint64_t ticket = _flush_requested;
+                lock.unlock();
+                uint64_t offset = write_pending();
+                lock.lock();
+                _offset = offset;
+                _flush_done = ticket;
+                _flushed.notify_all();
+                continue;
+            }
+            if(_stop) return;
+            _writer_sleeping = true;
+            if(_ring.empty()){
+                _wake.wait_for(lock, std::chrono::milliseconds(50));
+            }
+            _writer_sleeping = false;
+        }
+    }
+    catch(const std::exception& e){
+        std::lock_guard<std::mutex> lock(_mutex);
+        _error = e.what();
+        _failed = true;
+        _flushed.notify_all();
+    }
+}
+
+/*
+ * Writes out everything the writer thread has so far, and returns how long
+ * the file is. For a binary log this ends the current block.
+ */
+uint64_t schedule_log_t::write_pending(){
+    if(_format == log_format_t::json){
+        write_out();
+    }
+    else{
+        write_block();
+    }
+    _file.flush();
+    //a log that never opened is just not written, as before
+    if(_file.is_open() && !_file){
+        throw std::runtime_error("Could not write the log");
+    }
+    return _file.tellp();
+}
+
+/*
+ * Appends one trial as a line of JSON. Shared by the log writer and
+ * write_sequence_to_file(). An importance of zero isn't written, and nor is a
+ * negative margin.
+ */
+static void append_json(string& out, const string& newick, const double* w,
+        size_t n, bool as_float, double importance, double margin){
+    out += "{\"tree\":\"";
+    out += newick;
+    out += "\",\"weights\": [";
+    char buf[DTOA_BUFFER_SIZE];
+    for(size_t i = 0; i < n; ++i){
+        size_t len = as_float ? format_float(w[i], buf)
+            : format_double(w[i], buf);
+        out.append(buf, len);
+        if(i!=n-1){
+            out += ',';
+        }
+    }
+    out += ']';
+    if(importance != 0.0){
+        out += ",\"importance\": ";
+        out.append(buf, format_double(importance, buf));
+    }
+    if(margin >= 0.0){
+        out += ",\"margin\": ";
+        if(std::isinf(margin)){
+            out += "null";
+        }
+        else{
+            out.append(buf, format_double(margin, buf));
+        }
+    }
+    out += "}\n";
+}
+
+void schedule_log_t::consume(const log_record_t& r){
+    if(r.mark){
+        uint64_t offset = write_pending();
+        std::lock_guard<std::mutex> lock(_mutex);
+        _offset = offset;
+        _mark_offsets[r.trial] = offset;
+        _flushed.notify_all();
+        return;
+    }
+    if(_format == log_format_t::json){
+        append_json(_text, *r.newick, r.weights.data(), r.weights.size(),
+                false, _has_importance ? r.importance : 0.0,
+                _has_margins ? r.margin : -1.0);
+        if(_text.size() >= LOG_WRITE_SIZE){
+            write_out();
+        }
+        return;
+    }
+    if(r.new_topology){
+        put_int(_new_topologies, r.id, 4);
+        put_int(_new_topologies, r.key.hi, 8);
+        put_int(_new_topologies, r.key.lo, 8);
+        put_int(_new_topologies, r.newick->size(), 4);
+        _new_topologies += *r.newick;
+        _new_topology_count++;
+    }
+    _trials.push_back(r.trial - (_last_trial + 1));
+    _last_trial = r.trial;
+    _ids.push_back(r.id);
+    _weights.insert(_weights.end(), r.weights.begin(), r.weights.end());
+    if(_has_importance){
+        _importances.push_back(r.importance);
+    }
+    if(_has_margins){
+        _margins.push_back(r.margin);
+    }
+    if(++_records == LOG_BLOCK_TRIALS){
+        write_block();
+    }
+}
+
+void schedule_log_t::write_out(){
+    _file.write(_text.data(), _text.size());
+    _text.clear();
+}
+
+void schedule_log_t::write_block(){
+    if(_records == 0) return;
+    string raw;
+    put_int(raw, _new_topology_count, 4);
+    raw += _new_topologies;
+    put_int(raw, _records, 4);
+    put_planes(raw, _trials, 8);
+    put_planes(raw, _ids, 4);
+    if(_format == log_format_t::binary32){
+        vector<uint32_t> bits(_weights.size());
+        for(size_t i = 0; i < _weights.size(); ++i){
+            float f = _weights[i];
+            std::memcpy(&bits[i], &f, sizeof(f));
+        }
+        put_planes(raw, bits, 4);
+    }
+    else{
+        vector<uint64_t> bits(_weights.size());
+        std::memcpy(bits.data(), _weights.data(), bits.size()*sizeof(double));
+        put_planes(raw, bits, 8);
+    }
+    if(_has_importance){
+        vector<uint64_t> bits(_importances.size());
+        std::memcpy(bits.data(), _importances.data(),
+                bits.size()*sizeof(double));
+        put_planes(raw, bits, 8);
+    }
+    if(_has_margins){
+        vector<uint64_t> bits(_margins.size());
+        std::memcpy(bits.data(), _margins.data(), bits.size()*sizeof(double));
+        put_planes(raw, bits, 8);
+    }
+
+    uLongf compressed_size = compressBound(raw.size());
+    string compressed(compressed_size, '\0');
+    if(compress2((Bytef*)&compressed[0], &compressed_size,
+                (const Bytef*)raw.data(), raw.size(), Z_BEST_SPEED) != Z_OK){
+        throw std::runtime_error("Could not compress the schedule log");
+    }
+    string sizes;
+    put_int(sizes, raw.size(), 4);
+    put_int(sizes, compressed_size, 4);
+    _file.write(sizes.data(), sizes.size());
+    _file.write(compressed.data(), compressed_size);
+
+    _records = 0;
+    _new_topologies.clear();
+    _new_topology_count = 0;
+    _trials.clear();
+    _ids.clear();
+    _weights.clear();
+    _importances.clear();
+    _margins.clear();
+}
+
+void write_sequence_to_file(const vector<double>& s,
+        const string& newick_string, std::ostream& outfile, bool as_float,
+        double importance, double margin){
+    string line;
+    append_json(line, newick_string, s.data(), s.size(), as_float,
+            importance, margin);
+    outfile<<line;
+}
+
+void dump_schedule_log(const string& filename, std::ostream& out){
+    ifstream in(filename.c_str(), std::ios::binary);
+    if(!in){
+        throw std::runtime_error("Could not open the log '" + filename + "'");
+    }
+    log_header_t header;
+    if(!read_log_header(in, header)){
+        in.clear();
+        in.seekg(0);
+        out<<in.rdbuf();
+        return;
+    }
+
+    out<<"using root: '"<<header.root<<"'"<<std::endl;
+    std::unordered_map<uint64_t, string> names;
+    log_block_t block;
+    vector<double> weights(header.depth);
+    bool as_float = header.width == 4;
+    while(read_log_block(in, header, block)){
+        for(auto& t : block.topologies){
+            names[t.id] = t.newick;
+        }
+        for(size_t i = 0; i < block.ids.size(); ++i){
+            auto it = names.find(block.ids[i]);
+            if(it == names.end()){
+                throw std::runtime_error("Schedule log is damaged");
+            }
+            std::copy(block.weights.begin() + i*header.depth,
+                    block.weights.begin() + (i+1)*header.depth,
+                    weights.begin());
+            write_sequence_to_file(weights, it->second, out, as_float,
+                    header.importance ? block.importances[i] : 0.0,
+                    header.margins ? block.margins[i] : -1.0);
+        }
+    }
+}
@@ -0,0 +1,204 @@
+//schedule_log.h
+//The log of every schedule gstar tried, and the tree it got.
+//
+//The old format is one line of JSON per trial, with the whole newick string
+//and the weights as text. That is still available, but by default the log is
+//binary: each trial is its index, a small id for its topology, and the
+//weights as floats. The newick string for an id is written once, the first
+//time the id is used. Trials are gathered into blocks, which are compressed
+//with zlib. log-dump turns a binary log back into the JSON one. Either way,
+//the formatting and writing happen on a thread of their own.
+//
+//A run that samples some schedules more than others also logs the importance
+//weight of each trial, which is what the trial counts for in the ratios. A run
+//can also log the decision margin of each trial's tree, see nj_with_hint().
+#pragma once
+
+#include "topology.h"
+#include "ring.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <ostream>
+#include <unordered_map>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+enum class log_format_t{
+    json,
+    binary32,
+    binary64,
+};
+
+/*
+ * Parses "json", "binary" (32 bit weights) or "binary64". Throws a
+ * std::invalid_argument for anything else.
+ */
+log_format_t parse_log_format(const std::string&);
+
+/*
+ * One trial, on its way from the trial loop to the writer thread. A mark,
+ * from mark(), has no trial in it, and trial is the number of the mark.
+ */
+struct log_record_t{
+    bool mark;
+    uint64_t trial;
+    uint32_t id;
+    bool new_topology;
+    topology_key_t key;
+    const std::string* newick;
+    std::vector<double> weights;
+    double importance;
+    double margin;
+};
+
+//Number of trials that can be waiting for the writer thread
+const size_t LOG_RING_SIZE = 8192;
+
+/*
+ * The log is written by a thread of its own. write() just copies the trial
+ * into a slot of a lock free ring buffer and carries on. The writer thread
+ * takes trials out of the ring as they come, formats or compresses them into
+ * a big buffer, and writes that out in large pieces. If the writer falls
+ * behind and the ring fills up, write() waits for a slot to free up, so the
+ * ring never grows. get_stalls() says how many times that happened.
+ *
+ * Topology ids are handed out by write(), so the newick string for a topology
+ * is only copied once, and the writer thread only ever reads it.
+ */
+class schedule_log_t{
+    public:
+        schedule_log_t(size_t ring_size = LOG_RING_SIZE);
+        ~schedule_log_t();
+
+        /*
+         * Starts a new log, throwing away anything that was in the file.
+         *
+         *  root:   The outgroup the trees were rooted on.
+         *
+         *  depth:  Number of weights in a schedule.
+         *
+         *  importance: Log an importance weight with each trial, see
+         *          set_importance().
+         *
+         *  margins: Log the decision margin given to write() with each trial.
+         */
+        void create(const std::string& filename, log_format_t format,
+                const std::string& root, size_t depth,
+                bool importance = false, bool margins = false);
+
+        /*
+         * Opens a log that was already written, cuts it back to offset, which
+         * should be something flush() returned, and carries on after that.
+         * Throws a std::runtime_error if it can't.
+         */
+        void resume(const std::string& filename, log_format_t format,
+                size_t depth, uint64_t offset);
+
+        void write(uint64_t trial, const topology_key_t& key,
+                const std::string& newick, const std::vector<double>& weights,
+                double margin = 0.0);
+
+        //the importance weight to log with the trials written after this
+        void set_importance(double w){ _importance = w; }
+
+        /*
+         * Waits for the writer thread to write out everything so far, and
+         * returns how long the file is. For a binary log this ends the
+         * current block. Throws a std::runtime_error if a write failed.
+         */
+        uint64_t flush();
+
+        /*
+         * Marks the end of what has been written so far, without waiting for
+         * the writer thread, and returns the number of the mark. When the
+         * writer gets to it, it writes out everything before it like flush()
+         * does, and notes how long the file is then.
+         */
+        uint64_t mark();
+
+        /*
+         * Waits for the writer thread to get to the mark, and returns how
+         * long the file was there, which can be given to resume(). It can be
+         * called from another thread than the one calling write(), once for
+         * each mark. Throws a std::runtime_error if a write failed.
+         */
+        uint64_t offset_at(uint64_t mark);
+
+        //flushes and stops the writer thread
+        void close();
+
+        size_t get_stalls() const { return _stalls; }
+
+    private:
+        void start();
+        log_record_t* next_free();
+        void push();
+        void run_writer();
+        uint64_t write_pending();
+        void consume(const log_record_t&);
+        void write_block();
+        void write_out();
+
+        std::ofstream _file;
+        log_format_t _format;
+        size_t _depth;
+        bool _has_importance;
+        bool _has_margins;
+
+        //only touched by the thread calling write()
+        std::unordered_map<topology_key_t,
+            std::pair<uint32_t, std::string>> _topologies;
+        size_t _stalls;
+        double _importance;
+        uint64_t _marks;
+
+        spsc_ring_t<log_record_t> _ring;
+        std::thread _writer;
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        std::condition_variable _space;
+        std::condition_variable _flushed;
+        std::atomic<bool> _writer_sleeping;
+        std::atomic<bool> _producer_waiting;
+        bool _stop;
+        uint64_t _flush_requested;
+        uint64_t _flush_done;
+        uint64_t _offset;
+        std::map<uint64_t, uint64_t> _mark_offsets;
+        std::atomic<bool> _failed;
+        std::string _error;
+
+        //only touched by the writer thread
+        std::string _text;
+        size_t _records;
+        std::string _new_topologies;
+        uint32_t _new_topology_count;
+        std::vector<uint64_t> _trials;
+        std::vector<uint32_t> _ids;
+        std::vector<double> _weights;
+        std::vector<double> _importances;
+        std::vector<double> _margins;
+        uint64_t _last_trial;
+};
+
+/*
+ * Writes one trial as a line of JSON, the way the log has always looked. The
+ * weights are written with the fewest digits that read back as the same
+ * number, or the same float if as_float is set. If importance isn't zero, it
+ * is written after the weights, and then the margin if it isn't negative. An
+ * infinite margin is written as null, since JSON has no infinity.
+ */
+void write_sequence_to_file(const std::vector<double>& s,
+        const std::string& newick_string, std::ostream& outfile,
+        bool as_float = false, double importance = 0.0, double margin = -1.0);
+
+/*
+ * Writes the log in filename to out as JSON. A log that is already JSON is
+ * copied as it is. Throws a std::runtime_error if the log is damaged.
+ */
+void dump_schedule_log(const std::string& filename, std::ostream& out);
@@ -22,6 +22,11 @@ using std::unordered_map;
 #include <functional>
 using std::function;
 
+#include <algorithm>
+
+#include <map>
+using std::map;
+
 /*
  * Simple helper funciton to clean up the code in calc_average_distances()
  */
@@ -31,15 +36,165 @@ inline void init_array(double* v, size_t s){
     }
 }
 
+vector<string> invert_label_map(unordered_map<string, size_t> lm);
+
 /*
- * Constructor, takes a vector of newick strings.
+ * Constructor, takes a vector of newick strings. Gene tree files often have
+ * the same tree many times over, so we only keep one copy of each distinct
+ * tree, along with how many times it showed up. Identical strings are caught
+ * before they get parsed, and then merge_duplicate_trees() catches the rest.
  */
 star_t::star_t(const vector<string>& newick_trees){
-    _tree_collection.reserve(newick_trees.size());
+    unordered_map<string, size_t> seen;
     for(auto &&s : newick_trees){
+        auto it = seen.find(s);
+        if(it != seen.end()){
+            _tree_counts[it->second]++;
+            continue;
+        }
+        seen[s] = _tree_collection.size();
         _tree_collection.emplace_back(s);
+        _tree_counts.push_back(1);
     }
     _label_map = _tree_collection.front().make_label_map();
+    _labels = invert_label_map(_label_map);
+    merge_duplicate_trees();
+    calc_lca_counts();
+}
+
+/*
+ * Merges gene trees that are the same tree, including branch lengths, but
+ * were written differently. The key for a tree is its sorted newick string,
+ * with enough precision that different branch lengths give different keys.
+ */
+void star_t::merge_duplicate_trees(){
+    unordered_map<string, size_t> index;
+    vector<tree_t> trees;
+    vector<size_t> counts;
+    for(size_t i=0;i<_tree_collection.size();++i){
+        string key = _tree_collection[i].sort().to_string(17);
+        auto it = index.find(key);
+        if(it != index.end()){
+            counts[it->second] += _tree_counts[i];
+            continue;
+        }
+        index[key] = trees.size();
+        trees.push_back(_tree_collection[i]);
+        counts.push_back(_tree_counts[i]);
+    }
+    _tree_collection.swap(trees);
+    _tree_counts.swap(counts);
+    _tree_total = 0;
+    for(auto c : _tree_counts){
+        _tree_total += c;
+    }
+    debug_print("distinct gene trees: %lu", _tree_collection.size());
+}
+
+/*
+ * Builds the table of common ancestor levels for every pair of taxa, summed
+ * over all of the gene trees, with each distinct tree counted as many times as
+ * it was given. Pairs are stored as the upper triangle of the
+ * distance matrix, row by row. This only depends on the topologies of the gene
+ * trees, so it only needs to be redone if they get rerooted.
+ */
+void star_t::calc_lca_counts(){
+    size_t row_size = _label_map.size();
+    size_t pairs = row_size*(row_size-1)/2;
+    _depth = 0;
+    for(const auto& t:_tree_collection){
+        _depth = std::max(_depth, t.get_depth());
+    }
+    _levels = _depth+1;
+    _lca_counts.assign(pairs*_levels, 0.0);
+
+    vector<size_t> levels(row_size*row_size);
+    for(size_t t=0;t<_tree_collection.size();++t){
+        _tree_collection[t].calc_lca_levels(_label_map, levels.data());
+        double count = (double)_tree_counts[t];
+        size_t p = 0;
+        for(size_t i=0;i<row_size;++i){
+            for(size_t j=i+1;j<row_size;++j){
+                _lca_counts[p*_levels + levels[i*row_size+j]] += count;
+                p++;
+            }
+        }
+    }
+
+    _lca_suffix.assign(pairs*_depth, 0.0);
+    for(size_t p=0;p<pairs;++p){
+        double total = 0.0;
+        for(size_t j=_depth;j-->0;){
+            total += _lca_counts[p*_levels + j+1];
+            _lca_suffix[p*_depth+j] = total;
+        }
+    }
+    calc_schedule_classes();
+}
+
+/*
+ * Works out which depths of a schedule make a difference to the topology NJ
+ * makes. The matrix for a schedule v is
+ *      D(i,j) = 2*(sum of v) - (2/trees)*(sum over depths d of h(d)*v(d)*L(i,j,d))
+ * where L is _lca_suffix, and h(d) is 1/2 at depth zero and 1 everywhere else.
+ * NJ joins the same pairs if D gets multiplied by a positive number, or if
+ * x(i) + x(j) gets added to every D(i,j), for any x. The Q values of a step
+ * all just go down by the same amount, and the new distances after the join
+ * are still of the same form (with x = 0 for the new node). So the column of
+ * depth d, h(d)*L(i,j,d), only counts up to a term like x(i) + x(j), and we
+ * take that out by picking x to make the column zero at the pairs (0,k) and
+ * (1,2).
+ *
+ * A depth whose column is all zeros after that makes no difference at all,
+ * and depths with the same column can be traded for each other, since only
+ * the sum of their weights counts. Each set of depths with the same column is
+ * a class. Everything is a multiple of 1/4, so the comparisons are exact.
+ */
+void star_t::calc_schedule_classes(){
+    size_t row_size = _labels.size();
+    _schedule_classes.assign(_depth, NO_SCHEDULE_CLASS);
+    _class_depths.clear();
+    //with three taxa or less NJ has nothing to choose
+    if(row_size < 4) return;
+
+    //index of the pair (i,j), i < j, in the upper triangle
+    auto pair_index = [&](size_t i, size_t j){
+        return i*row_size - i*(i+1)/2 + (j - i - 1);
+    };
+    size_t pairs = row_size*(row_size-1)/2;
+    map<vector<double>, size_t> classes;
+    vector<double> column(pairs), x(row_size);
+    for(size_t d=0;d<_depth;++d){
+        double h = d==0 ? 0.5 : 1.0;
+        for(size_t p=0;p<pairs;++p){
+            column[p] = h*_lca_suffix[p*_depth+d];
+        }
+        x[0] = (column[pair_index(0,1)] + column[pair_index(0,2)]
+                - column[pair_index(1,2)])/2.0;
+        for(size_t k=1;k<row_size;++k){
+            x[k] = column[pair_index(0,k)] - x[0];
+        }
+        bool zero = true;
+        size_t p = 0;
+        for(size_t i=0;i<row_size;++i){
+            for(size_t j=i+1;j<row_size;++j){
+                column[p] -= x[i] + x[j];
+                zero = zero && column[p] == 0.0;
+                p++;
+            }
+        }
+        if(zero) continue;
+        auto it = classes.find(column);
+        if(it != classes.end()){
+            _schedule_classes[d] = it->second;
+            continue;
+        }
+        _schedule_classes[d] = _class_depths.size();
+        classes[column] = _class_depths.size();
+        _class_depths.push_back(d);
+    }
+    debug_print("schedule classes: %lu of %lu depths", _class_depths.size(),
+            _depth);
 }
 
 void star_t::calc_average_distances(){
@@ -60,15 +215,16 @@ void star_t::calc_average_distances(){
         _tree_collection[i].calc_distance_matrix(_label_map, dists);
         debug_matrix("dists after calc", dists, row_size);
         debug_print("current tree: %s", _tree_collection[i].print_labels().c_str());
+        double count = (double)_tree_counts[i];
         for(size_t j=0;j<row_size; ++j){
             for(size_t k = 0; k<row_size; ++k){
-                _avg_dists[j*row_size+k]+=dists[j*row_size+k];
+                _avg_dists[j*row_size+k]+=count*dists[j*row_size+k];
             }
         }
     }
     debug_matrix("dists before average", _avg_dists, row_size);
     for(size_t i=0; i<row_size*row_size;++i){
-        _avg_dists[i]/=(double)_tree_collection.size();
+        _avg_dists[i]/=(double)_tree_total;
     }
     debug_matrix("_avg_dists after average", _avg_dists, row_size);
     delete[] dists;
@@ -84,56 +240,295 @@ vector<string> invert_label_map(unordered_map<string, size_t> lm){
     return ret;
 }
 
-tree_t star_t::get_tree(){
-    calc_average_distances();
-    return nj(_avg_dists, invert_label_map(_label_map));
+/*
+ * Makes the averaged distance matrix for a set of weights, without touching
+ * the gene trees. The weights are w(i) for each depth, like what
+ * tree_t::set_weights() puts on the nodes, and max is the distance from the
+ * root to the leaves. A pair with its common ancestor at level k is at distance
+ *      2*(max - S(k)),     where S(k) = w(0) + ... + w(k-1)
+ * in that tree, so the average over all the trees is
+ *      2*(max*trees - (sum over k of count(k)*S(k)))/trees
+ * That makes each matrix one product of the count table with the prefix sums
+ * of the weights. The sum over the trees is finished before dividing, like
+ * averaging the reweighted matrices did, so for 0/1 schedules (where all of
+ * the sums are exact) the matrix is the same to the last bit, and NJ gets
+ * the same ties to break. For other schedules the sums get rounded in a
+ * different order, and the entries can differ in the last bits.
+ */
+vector<double> star_t::calc_average_distances(const vector<double>& w,
+        double max) const{
+    vector<double> prefix(_levels, 0.0);
+    for(size_t i=0;i<_depth;++i){
+        prefix[i+1] = prefix[i] + w[i];
+    }
+    size_t row_size = _labels.size();
+    double trees = (double)_tree_total;
+    vector<double> avg_dists(row_size*row_size, 0.0);
+    const double* counts = _lca_counts.data();
+    for(size_t i=0;i<row_size;++i){
+        for(size_t j=i+1;j<row_size;++j){
+            double acc = 0.0;
+            for(size_t k=0;k<_levels;++k){
+                acc += counts[k]*prefix[k];
+            }
+            counts += _levels;
+            double d = 2.0*(max*trees - acc)/trees;
+            avg_dists[i*row_size+j] = d;
+            avg_dists[j*row_size+i] = d;
+        }
+    }
+    debug_matrix("_avg_dists from lca counts", avg_dists, row_size);
+    return avg_dists;
 }
 
-tree_t star_t::get_tree(const function<double(size_t)>& f){
+/*
+ * The averaged distance matrix for a schedule. Like tree_t::set_weights(), the
+ * weight at depth zero is split between the two sides of the root.
+ */
+vector<double> star_t::calc_average_distances(const vector<double>& v) const{
     double max = 0.0;
-    size_t depth = get_size();
-    for(size_t i =0;i<depth;++i){
-        max+= f(i);
+    vector<double> w(_depth);
+    for(size_t i=0;i<_depth;++i){
+        max += v[i];
+        w[i] = i==0 ? v[i]/2.0 : v[i];
     }
-    for(auto& t:_tree_collection){
-        t.set_weights(f, max);
-        debug_string(t.to_string().c_str());
+    return calc_average_distances(w, max);
+}
+
+/*
+ * The same as above, but for a whole block of schedules at once. This is a
+ * matrix-matrix product of the count table (pairs x levels) with the prefix
+ * sums of the schedules (levels x schedules). The pairs are done a few at a
+ * time, so that their running sums for every schedule stay in cache, and the
+ * count table only gets read once per block instead of once per schedule.
+ * Gives exactly the same matrices as doing the schedules one by one.
+ */
+vector<vector<double>> star_t::calc_average_distances(
+        const vector<vector<double>>& schedules) const{
+    const size_t PAIR_BLOCK = 16;
+    size_t K = schedules.size();
+    size_t row_size = _labels.size();
+    double trees = (double)_tree_total;
+
+    //level major, so the inner loop below runs across the schedules
+    vector<double> prefix(_levels*K, 0.0);
+    vector<double> max(K, 0.0);
+    for(size_t s=0;s<K;++s){
+        const auto& v = schedules[s];
+        for(size_t i=0;i<_depth;++i){
+            max[s] += v[i];
+            prefix[(i+1)*K+s] = prefix[i*K+s] + (i==0 ? v[i]/2.0 : v[i]);
+        }
+    }
+
+    vector<vector<double>> avg_dists(K, vector<double>(row_size*row_size, 0.0));
+    vector<std::pair<size_t, size_t>> pairs;
+    pairs.reserve(row_size*(row_size-1)/2);
+    for(size_t i=0;i<row_size;++i){
+        for(size_t j=i+1;j<row_size;++j){
+            pairs.emplace_back(i,j);
+        }
+    }
+
+    vector<double> acc(PAIR_BLOCK*K);
+    for(size_t pb=0;pb<pairs.size();pb+=PAIR_BLOCK){
+        size_t block = std::min(PAIR_BLOCK, pairs.size()-pb);
+        std::fill(acc.begin(), acc.end(), 0.0);
+        for(size_t q=0;q<block;++q){
+            const double* counts = _lca_counts.data() + (pb+q)*_levels;
+            double* a = acc.data() + q*K;
+            for(size_t k=0;k<_levels;++k){
+                double c = counts[k];
+                if(c == 0.0) continue;
+                const double* pk = prefix.data() + k*K;
+                for(size_t s=0;s<K;++s){
+                    a[s] += c*pk[s];
+                }
+            }
+        }
+        for(size_t q=0;q<block;++q){
+            size_t i = pairs[pb+q].first, j = pairs[pb+q].second;
+            const double* a = acc.data() + q*K;
+            for(size_t s=0;s<K;++s){
+                double d = 2.0*(max[s]*trees - a[s])/trees;
+                avg_dists[s][i*row_size+j] = d;
+                avg_dists[s][j*row_size+i] = d;
+            }
+        }
+    }
+    return avg_dists;
+}
+
+/*
+ * These three are for going through schedules that only change a little
+ * from one to the next. Instead of a distance matrix, we keep the sum over the
+ * count table for every pair,
+ *      sum over k of count(k)*S(k)
+ * from which calc_distances_from_sums() gives the same matrix as
+ * calc_average_distances(), to the last bit if the sums are exact, like they
+ * are for 0/1 schedules. Changing the weight at depth j by delta changes S(k)
+ * by delta for every level above j, so the sums can be brought up to date
+ * with one pass over the pairs instead of over the whole table.
+ */
+vector<double> star_t::calc_ancestor_sums(const vector<double>& v) const{
+    vector<double> prefix(_levels, 0.0);
+    for(size_t i=0;i<_depth;++i){
+        prefix[i+1] = prefix[i] + (i==0 ? v[i]/2.0 : v[i]);
+    }
+    size_t pairs = _lca_counts.size()/_levels;
+    vector<double> sums(pairs, 0.0);
+    for(size_t p=0;p<pairs;++p){
+        const double* counts = _lca_counts.data() + p*_levels;
+        double acc = 0.0;
+        for(size_t k=0;k<_levels;++k){
+            acc += counts[k]*prefix[k];
+        }
+        sums[p] = acc;
+    }
+    return sums;
+}
+
+/*
+ * Updates the sums for a change of delta to the schedule weight at depth.
+ * Like everywhere else, the weight at depth zero is split in half.
+ */
+void star_t::update_ancestor_sums(vector<double>& sums, size_t depth,
+        double delta) const{
+    if(depth==0) delta/=2.0;
+    for(size_t p=0;p<sums.size();++p){
+        sums[p] += delta*_lca_suffix[p*_depth+depth];
     }
+}
+
+vector<double> star_t::calc_distances_from_sums(const vector<double>& sums,
+        double max) const{
+    size_t row_size = _labels.size();
+    double trees = (double)_tree_total;
+    vector<double> avg_dists(row_size*row_size, 0.0);
+    size_t p = 0;
+    for(size_t i=0;i<row_size;++i){
+        for(size_t j=i+1;j<row_size;++j){
+            double d = 2.0*(max*trees - sums[p++])/trees;
+            avg_dists[i*row_size+j] = d;
+            avg_dists[j*row_size+i] = d;
+        }
+    }
+    return avg_dists;
+}
+
+const vector<string>& star_t::get_labels() const{
+    return _labels;
+}
+
+const unordered_map<string, size_t>& star_t::get_label_map() const{
+    return _label_map;
+}
+
+tree_t star_t::get_tree(){
     calc_average_distances();
-    return nj(_avg_dists, invert_label_map(_label_map));
+    return nj(_avg_dists, _labels, _nj_search, _nj_threads);
 }
 
-tree_t star_t::get_tree(const vector<double>& v){
+tree_t star_t::get_tree(const function<double(size_t)>& f) const{
     double max = 0.0;
-    size_t depth = get_size();
-    for(size_t i =0;i<depth;++i){
-        max+= v[i];
+    vector<double> w(_depth);
+    for(size_t i =0;i<_depth;++i){
+        w[i] = f(i);
+        max += w[i];
     }
-    for(auto& t:_tree_collection){
-        t.set_weights(v, max);
-        debug_string(t.to_string().c_str());
+    return nj(calc_average_distances(w, max), _labels, _nj_search,
+            _nj_threads);
+}
+
+tree_t star_t::get_tree(const vector<double>& v) const{
+    return nj(calc_average_distances(v), _labels, _nj_search, _nj_threads);
+}
+
+vector<tree_t> star_t::get_trees(const vector<vector<double>>& schedules)
+    const{
+    vector<tree_t> ret;
+    ret.reserve(schedules.size());
+    for(auto&& d : calc_average_distances(schedules)){
+        ret.push_back(nj(d, _labels, _nj_search, _nj_threads));
     }
-    calc_average_distances();
-    return nj(_avg_dists, invert_label_map(_label_map));
+    return ret;
 }
 
-size_t star_t::get_size(){
-    size_t max = 0;
-    for(const auto& t:_tree_collection){
-        size_t tmp = t.get_depth();
-        if(max < tmp){
-            max = tmp;
-        }
+/*
+ * The same, but each tree is warm started from the join sequence of the one
+ * before it, see nj_with_hint(). joins is the hint for the first tree, and
+ * gets left as the join sequence of the last one. If margins is given, it
+ * gets the decision margin of each tree.
+ */
+vector<tree_t> star_t::get_trees(const vector<vector<double>>& schedules,
+        vector<std::pair<size_t, size_t>>& joins, vector<double>* margins)
+    const{
+    vector<tree_t> ret;
+    ret.reserve(schedules.size());
+    if(margins) margins->clear();
+    vector<std::pair<size_t, size_t>> next;
+    for(auto&& d : calc_average_distances(schedules)){
+        double margin;
+        ret.push_back(nj_with_hint(d, _labels, joins, next, &margin,
+                    _nj_search, _nj_threads));
+        if(margins) margins->push_back(margin);
+        joins.swap(next);
     }
-    return max;
+    return ret;
 }
 
+size_t star_t::get_size() const{
+    return _depth;
+}
+
+/*
+ * Rerooting can make trees that were written differently the same, so we
+ * merge them again afterwards.
+ */
 void star_t::set_outgroup(const string& outgroup){
     for(auto& t:_tree_collection){
 		if(!t.is_rooted()){
 			t.set_outgroup(outgroup);
 		}
     }
+    merge_duplicate_trees();
+    calc_lca_counts();
+}
+
+/*
+ * Which search NJ uses to find each pair to join, see nj_search_t. It doesn't
+ * change the trees, only how long they take.
+ */
+void star_t::set_nj_search(nj_search_t search){
+    _nj_search = search;
+}
+
+nj_search_t star_t::get_nj_search() const{
+    return _nj_search;
+}
+
+/*
+ * How many threads NJ splits each step of a big table over, see nj(). That
+ * is on top of any threads the trials are run on.
+ */
+void star_t::set_nj_threads(size_t threads){
+    _nj_threads = threads;
+}
+
+size_t star_t::get_nj_threads() const{
+    return _nj_threads;
+}
+
+const vector<size_t>& star_t::get_schedule_classes() const{
+    return _schedule_classes;
+}
+
+size_t star_t::get_class_count() const{
+    return _class_depths.size();
+}
+
+size_t star_t::get_distinct_count() const{
+    return _tree_collection.size();
 }
 
 /*
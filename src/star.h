@@ -6,24 +6,78 @@
 //  http://www.dms.uaf.edu/~jrhodes/papers/STARandGeneralizations.pdf
 #pragma once
 #include "tree.h"
+#include "nj.h"
 #include <vector>
 #include <string>
 #include <unordered_map>
 #include <functional>
+#include <utility>
 
 class star_t{
     public:
         star_t(const std::vector<std::string>&);
         tree_t get_tree();
-        tree_t get_tree(const std::function<double(size_t)>&);
-        tree_t get_tree(const std::vector<double>&);
-        size_t get_size();
+        tree_t get_tree(const std::function<double(size_t)>&) const;
+        tree_t get_tree(const std::vector<double>&) const;
+        std::vector<tree_t> get_trees(const std::vector<std::vector<double>>&)
+            const;
+        std::vector<tree_t> get_trees(const std::vector<std::vector<double>>&,
+                std::vector<std::pair<size_t, size_t>>&,
+                std::vector<double>* margins = nullptr) const;
+        std::vector<double> calc_average_distances(const std::vector<double>&)
+            const;
+        std::vector<std::vector<double>> calc_average_distances(
+                const std::vector<std::vector<double>>&) const;
+        std::vector<double> calc_ancestor_sums(const std::vector<double>&)
+            const;
+        void update_ancestor_sums(std::vector<double>&, size_t, double) const;
+        std::vector<double> calc_distances_from_sums(const std::vector<double>&,
+                double) const;
+        const std::vector<std::string>& get_labels() const;
+        const std::unordered_map<std::string, size_t>& get_label_map() const;
+        size_t get_size() const;
+        size_t get_distinct_count() const;
+        const std::vector<size_t>& get_schedule_classes() const;
+        size_t get_class_count() const;
+        void set_nj_search(nj_search_t);
+        nj_search_t get_nj_search() const;
+        void set_nj_threads(size_t);
+        size_t get_nj_threads() const;
         void set_outgroup(const std::string&);
         std::string get_first_label();
     private:
         void calc_average_distances();
+        std::vector<double> calc_average_distances(const std::vector<double>&,
+                double) const;
+        void calc_lca_counts();
+        void calc_schedule_classes();
+        void merge_duplicate_trees();
 
         std::vector<double> _avg_dists;
+        //one copy of each distinct gene tree, and how many times it was given
         std::vector<tree_t> _tree_collection;
+        std::vector<size_t> _tree_counts;
+        size_t _tree_total;
         std::unordered_map<std::string, size_t> _label_map;
+        std::vector<std::string> _labels;
+
+        //_lca_counts[p*_levels+k] is the number of gene trees where the pair
+        //p has its common ancestor at level k, see tree_t::calc_lca_levels()
+        std::vector<double> _lca_counts;
+        //_lca_suffix[p*_depth+j] is the number of gene trees where the pair p
+        //has its common ancestor below depth j, i.e. at a level above j
+        std::vector<double> _lca_suffix;
+        size_t _levels;
+        size_t _depth;
+
+        //_schedule_classes[j] is the class of depth j, or NO_SCHEDULE_CLASS
+        //if its weight makes no difference, see calc_schedule_classes().
+        //_class_depths[c] is the first depth in class c.
+        std::vector<size_t> _schedule_classes;
+        std::vector<size_t> _class_depths;
+
+        nj_search_t _nj_search = nj_search_t::exhaustive;
+        size_t _nj_threads = 1;
 };
+
+const size_t NO_SCHEDULE_CLASS = (size_t)-1;
@@ -0,0 +1,68 @@
+//topology.cpp
+//Implementation of the topology keys
+
+#include "topology.h"
+
+#include <vector>
+using std::vector;
+#include <algorithm>
+
+inline uint64_t mix64(uint64_t x){
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+inline size_t popcount(const taxa_set_t& s){
+    size_t count = 0;
+    for(auto w : s){
+        count += __builtin_popcountll(w);
+    }
+    return count;
+}
+
+/*
+ * Every split is turned into the side that doesn't hold taxa 0, so that both
+ * sides of an edge give the same set. Then the sets are sorted, so repeats can
+ * be dropped, and each one is hashed into two independent 64 bit lanes. The
+ * lanes are summed over the splits, which makes the key independent of the
+ * order the splits were found in.
+ */
+topology_key_t make_topology_key(vector<taxa_set_t>& clusters, size_t taxa){
+    size_t words = taxa_set_words(taxa);
+    uint64_t last_mask = taxa % 64 == 0 ? ~0ull : (1ull << (taxa % 64)) - 1;
+
+    vector<taxa_set_t*> splits;
+    splits.reserve(clusters.size());
+    for(auto& c : clusters){
+        if(c[0] & 1ull){
+            for(size_t w = 0; w < words; ++w){
+                c[w] = ~c[w];
+            }
+            c[words-1] &= last_mask;
+        }
+        size_t size = popcount(c);
+        if(size < 2 || size + 2 > taxa) continue;
+        splits.push_back(&c);
+    }
+    std::sort(splits.begin(), splits.end(),
+            [](const taxa_set_t* a, const taxa_set_t* b){ return *a < *b; });
+
+    topology_key_t key{mix64(taxa), mix64(~(uint64_t)taxa)};
+    const taxa_set_t* prev = nullptr;
+    for(auto s : splits){
+        if(prev && *prev == *s) continue;
+        prev = s;
+        uint64_t a = 0x243f6a8885a308d3ull, b = 0x13198a2e03707344ull;
+        for(size_t w = 0; w < words; ++w){
+            a = mix64(a ^ (*s)[w]);
+            b = mix64((b + (*s)[w]) * 0x9E3779B97F4A7C15ull);
+        }
+        key.hi += a;
+        key.lo += b;
+    }
+    return key;
+}
@@ -0,0 +1,54 @@
+//topology.h
+//Compact keys for tree topologies.
+//A tree's topology is fully described by its set of bipartitions, the ways
+//that removing one internal edge splits the taxa in two. We hash that set down
+//to 128 bits, so that counting topologies doesn't need a newick string for
+//every tree. The key doesn't depend on the order of children, the rooting, or
+//the branch lengths.
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <functional>
+
+struct topology_key_t{
+    uint64_t hi;
+    uint64_t lo;
+};
+
+inline bool operator==(const topology_key_t& a, const topology_key_t& b){
+    return a.hi == b.hi && a.lo == b.lo;
+}
+
+inline bool operator!=(const topology_key_t& a, const topology_key_t& b){
+    return !(a==b);
+}
+
+namespace std{
+    template<> struct hash<topology_key_t>{
+        size_t operator()(const topology_key_t& k) const{
+            return (size_t)(k.lo ^ (k.hi * 0x9E3779B97F4A7C15ull));
+        }
+    };
+}
+
+//a set of taxa, as a bitset over the taxa indices
+typedef std::vector<uint64_t> taxa_set_t;
+
+inline size_t taxa_set_words(size_t taxa){
+    return (taxa + 63)/64;
+}
+
+/*
+ * Makes the key for a topology, given the clusters of taxa below its internal
+ * nodes. The clusters can come from a tree with any rooting, or from the joins
+ * that NJ made. Trivial clusters and repeats are ignored, so it is fine to pass
+ * every internal node.
+ *
+ *  clusters:   Taxa sets, taxa_set_words(taxa) words each. Gets modified.
+ *
+ *  taxa:       Number of taxa in the tree.
+ */
+topology_key_t make_topology_key(std::vector<taxa_set_t>& clusters,
+        size_t taxa);
@@ -114,6 +114,53 @@ size_t node_t::calc_max_depth(){
     return 1;
 }
 
+/*
+ * Finds the level of the lowest common ancestor for every pair of leaves below
+ * this node, where the level is one more than the depth that set_weights()
+ * would give the ancestor. The leaves found are appended to leaves, as indices
+ * into the label map, so that the parent can pair them up in turn.
+ */
+void node_t::calc_lca_levels(size_t depth,
+        const unordered_map<string, size_t>& label_map, size_t* levels,
+        vector<size_t>& leaves){
+    if(!_children){
+        leaves.push_back(label_map.at(_label));
+        return;
+    }
+    size_t row_size = label_map.size();
+    vector<size_t> rleaves;
+    _lchild->calc_lca_levels(depth+1, label_map, levels, leaves);
+    _rchild->calc_lca_levels(depth+1, label_map, levels, rleaves);
+    for(auto l : leaves){
+        for(auto r : rleaves){
+            levels[l*row_size+r] = depth+1;
+            levels[r*row_size+l] = depth+1;
+        }
+    }
+    leaves.insert(leaves.end(), rleaves.begin(), rleaves.end());
+}
+
+/*
+ * Returns the set of taxa below this node, and adds the set for every internal
+ * node below it (including this one) to clusters.
+ */
+taxa_set_t node_t::calc_clusters(const unordered_map<string, size_t>& label_map,
+        vector<taxa_set_t>& clusters){
+    if(!_children){
+        taxa_set_t leaf(taxa_set_words(label_map.size()), 0);
+        size_t idx = label_map.at(_label);
+        leaf[idx/64] |= 1ull << (idx%64);
+        return leaf;
+    }
+    auto set = _lchild->calc_clusters(label_map, clusters);
+    auto rset = _rchild->calc_clusters(label_map, clusters);
+    for(size_t i=0;i<set.size();++i){
+        set[i] |= rset[i];
+    }
+    clusters.push_back(set);
+    return set;
+}
+
 /*
  * Set root sets the root of the tree, based on the outgroup. This is after the
  * outgroup is found on the tree. The outgroup is assumed to be on the tree. We
@@ -431,6 +478,45 @@ void tree_t::calc_distance_matrix(const std::unordered_map<string, size_t>& labe
 }
 
 
+//With the weights that set_weights() gives, the tree is ultrametric, and the
+//distance between two leaves only depends on how deep their common ancestor
+//is. Specifically, if w(i) is the weight at depth i, and the common ancestor
+//is at depth L, then the distance is
+//      2*(max - (w(0) + ... + w(L)))
+//This fills levels with L+1 for every pair of leaves, so that the distance
+//matrix for any schedule can be made without touching the tree again. Pairs
+//that only meet at the unroot get a level of zero, since their distance is
+//just 2*max.
+void tree_t::calc_lca_levels(const std::unordered_map<string, size_t>& label_map,
+        size_t* levels){
+    size_t row_size = label_map.size();
+    for(size_t i=0;i<row_size*row_size;++i){
+        levels[i] = 0;
+    }
+    vector<node_t*> tops = _unroot;
+    size_t depth = 0;
+    if(_unroot.size() == 1 && _unroot.front()->_children){
+        //set_weights_as_root() starts the children of a lone root at depth 0
+        tops = {_unroot.front()->_lchild, _unroot.front()->_rchild};
+    }
+    for(auto n : tops){
+        vector<size_t> leaves;
+        n->calc_lca_levels(depth, label_map, levels, leaves);
+    }
+}
+
+//Makes a key for the topology of the tree, ignoring the root and the branch
+//lengths. See topology.h.
+topology_key_t tree_t::calc_topology_key(
+        const std::unordered_map<string, size_t>& label_map){
+    vector<taxa_set_t> clusters;
+    clusters.reserve(_size);
+    for(auto n : _unroot){
+        n->calc_clusters(label_map, clusters);
+    }
+    return make_topology_key(clusters, label_map.size());
+}
+
 //need to make a map of labels to indices, but the order doesnt really matter
 //so, this is inteded to be called for on the first tree, and never again
 //the return of this function is meant to be fed into the function
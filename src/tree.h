@@ -18,6 +18,7 @@
 #include <unordered_map>
 #include <vector>
 #include <functional>
+#include "topology.h"
 
 class node_t{
     public:
@@ -32,6 +33,10 @@ class node_t{
         void set_weights(std::function<double(size_t)>, size_t, double);
         void set_weights_as_root(std::function<double(size_t)>, size_t, double);
         size_t calc_max_depth();
+        void calc_lca_levels(size_t, const std::unordered_map<std::string, size_t>&,
+                size_t*, std::vector<size_t>&);
+        taxa_set_t calc_clusters(const std::unordered_map<std::string, size_t>&,
+                std::vector<taxa_set_t>&);
         void update_children(std::unordered_map<node_t*, node_t*>, node_t* p = nullptr);
         std::string sort();
 
@@ -77,6 +82,8 @@ class tree_t{
         double* calc_distance_matrix(const std::unordered_map<std::string, size_t>&);
         void calc_distance_matrix(const std::unordered_map<std::string, size_t>&, double*);
         double calc_distance(node_t*, node_t*);
+        void calc_lca_levels(const std::unordered_map<std::string, size_t>&, size_t*);
+        topology_key_t calc_topology_key(const std::unordered_map<std::string, size_t>&);
 
         size_t get_depth() const;
         
@@ -0,0 +1,124 @@
+#include "catch.hpp"
+#include "../src/counts_file.cpp"
+
+#include <cstdio> //for remove
+#include <fstream>
+
+counts_file_t make_test_counts(){
+    counts_file_t cf;
+    cf.seed = 0xdeadbeefcafef00dull;
+    cf.input_hash = 12345;
+    cf.begin = 1000;
+    cf.end = 2000;
+    cf.completed = 512;
+    cf.log_offset = 77;
+    cf.finished = false;
+    cf.entries.push_back({topology_key_t{1, 2}, 300, "((a,b),c);"});
+    cf.entries.push_back({topology_key_t{~0ull, 3}, 212, "((a,c),b);"});
+    return cf;
+}
+
+void require_same_counts(const counts_file_t& a, const counts_file_t& b){
+    REQUIRE(a.seed == b.seed);
+    REQUIRE(a.input_hash == b.input_hash);
+    REQUIRE(a.begin == b.begin);
+    REQUIRE(a.end == b.end);
+    REQUIRE(a.completed == b.completed);
+    REQUIRE(a.log_offset == b.log_offset);
+    REQUIRE(a.finished == b.finished);
+    REQUIRE(a.entries.size() == b.entries.size());
+    for(size_t i = 0; i < a.entries.size(); ++i){
+        REQUIRE(a.entries[i].key == b.entries[i].key);
+        REQUIRE(a.entries[i].count == b.entries[i].count);
+        REQUIRE(a.entries[i].newick == b.entries[i].newick);
+    }
+}
+
+TEST_CASE("counts file, round trip", "[counts_file]"){
+    auto cf = make_test_counts();
+    write_counts_file("test.counts", cf);
+    require_same_counts(read_counts_file("test.counts"), cf);
+    std::remove("test.counts");
+}
+
+TEST_CASE("counts file, bad files throw", "[counts_file]"){
+    REQUIRE_THROWS(read_counts_file("does_not_exist.counts"));
+
+    {
+        std::ofstream out("test.counts");
+        out<<"((a,b),c);\n";
+    }
+    REQUIRE_THROWS(read_counts_file("test.counts"));
+
+    write_counts_file("test.counts", make_test_counts());
+    std::string buf;
+    {
+        std::ifstream in("test.counts", std::ios::binary);
+        buf.assign(std::istreambuf_iterator<char>(in),
+                std::istreambuf_iterator<char>());
+    }
+    {
+        std::ofstream out("test.counts", std::ios::binary);
+        out.write(buf.data(), buf.size()-3);
+    }
+    REQUIRE_THROWS(read_counts_file("test.counts"));
+    std::remove("test.counts");
+}
+
+TEST_CASE("counts file, writer thread", "[counts_file]"){
+    counts_writer_t writer("test.counts");
+    auto cf = make_test_counts();
+    writer.write(make_test_counts());
+    cf.completed = 1000;
+    auto cf2 = cf;
+    writer.write(std::move(cf2));
+    writer.finish();
+    REQUIRE(!writer.busy());
+    require_same_counts(read_counts_file("test.counts"), cf);
+    std::remove("test.counts");
+}
+
+TEST_CASE("counts file, input hash", "[counts_file]"){
+    auto h = hash_inputs({"(a,b);", "(c,d);"}, "a");
+    REQUIRE(h == hash_inputs({"(a,b);", "(c,d);"}, "a"));
+    REQUIRE(h != hash_inputs({"(a,b);(c,d);"}, "a"));
+    REQUIRE(h != hash_inputs({"(a,b);", "(c,d);"}, "b"));
+}
+
+TEST_CASE("counts file, merge", "[counts_file][merge]"){
+    counts_file_t a, b;
+    a.seed = b.seed = 5;
+    a.input_hash = b.input_hash = 6;
+    a.finished = b.finished = true;
+    a.begin = 0; a.end = 10; a.completed = 10;
+    b.begin = 10; b.end = 25; b.completed = 15;
+    a.entries.push_back({topology_key_t{1, 1}, 4, "x"});
+    a.entries.push_back({topology_key_t{2, 2}, 6, "y"});
+    b.entries.push_back({topology_key_t{2, 2}, 10, "y"});
+    b.entries.push_back({topology_key_t{3, 3}, 5, "z"});
+
+    auto m = merge_counts_files({b, a});
+    REQUIRE(m.begin == 0);
+    REQUIRE(m.end == 25);
+    REQUIRE(m.completed == 25);
+    REQUIRE(m.finished);
+    REQUIRE(m.entries.size() == 3);
+    size_t total = 0;
+    for(auto& e : m.entries){
+        total += e.count;
+        if(e.key == topology_key_t{2, 2}){
+            REQUIRE(e.count == 16);
+        }
+    }
+    REQUIRE(total == 25);
+
+    REQUIRE_THROWS(merge_counts_files({}));
+    REQUIRE_THROWS(merge_counts_files({a, a, b}));
+    REQUIRE_THROWS(merge_counts_files({b}));
+    auto c = b;
+    c.seed = 7;
+    REQUIRE_THROWS(merge_counts_files({a, c}));
+    c = b;
+    c.finished = false;
+    REQUIRE_THROWS(merge_counts_files({a, c}));
+}
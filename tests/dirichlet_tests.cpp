@@ -0,0 +1,51 @@
+#include "catch.hpp"
+#include "../src/dirichlet.cpp"
+
+#include <vector>
+
+TEST_CASE("dirichlet block, same as drawing each trial on its own", "[dirichlet]"){
+    const size_t len = 7;
+    for(double shape : {1.0, 0.3, 2.5}){
+        //starts and ends part way through a group of lanes
+        const uint64_t first = 5;
+        const size_t count = 2*PHILOX_LANES + 3;
+        std::vector<double> block(count*len);
+        dirichlet_block(42, first, count, len, shape, block.data());
+        for(size_t t = 0; t < count; ++t){
+            philox_t gen(42, first + t);
+            auto one = draw_schedule(gen, len, shape);
+            for(size_t k = 0; k < len; ++k){
+                REQUIRE(block[t*len+k] == one[k]);
+            }
+        }
+    }
+}
+
+TEST_CASE("dirichlet block, mean and variance", "[dirichlet]"){
+    const size_t len = 5;
+    const size_t count = 40000;
+    std::vector<double> block(count*len);
+    for(double shape : {0.2, 1.0, 4.0}){
+        dirichlet_block(7, 0, count, len, shape, block.data());
+        double mean = 1.0/len;
+        double var = mean*(1.0-mean)/(len*shape+1.0);
+        for(size_t k = 0; k < len; ++k){
+            double sum = 0.0, sum2 = 0.0;
+            for(size_t t = 0; t < count; ++t){
+                double x = block[t*len+k];
+                REQUIRE(x >= 0.0);
+                sum += x;
+                sum2 += x*x;
+            }
+            double m = sum/count;
+            double v = sum2/count - m*m;
+            CHECK(m == Approx(mean).epsilon(0.02));
+            CHECK(v == Approx(var).epsilon(0.05));
+        }
+        for(size_t t = 0; t < count; ++t){
+            double total = 0.0;
+            for(size_t k = 0; k < len; ++k) total += block[t*len+k];
+            REQUIRE(total == Approx(1.0));
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#include "catch.hpp"
+#include "../src/dtoa.cpp"
+
+#include <string>
+#include <random>
+#include <cstring>
+#include <cstdlib>
+
+std::string format_double_string(double v){
+    char buf[DTOA_BUFFER_SIZE];
+    return std::string(buf, format_double(v, buf));
+}
+
+std::string format_float_string(float v){
+    char buf[DTOA_BUFFER_SIZE];
+    return std::string(buf, format_float(v, buf));
+}
+
+TEST_CASE("dtoa, known values", "[dtoa]"){
+    REQUIRE(format_double_string(0.0) == "0");
+    REQUIRE(format_double_string(-0.0) == "-0");
+    REQUIRE(format_double_string(1.0) == "1");
+    REQUIRE(format_double_string(0.5) == "0.5");
+    REQUIRE(format_double_string(0.1) == "0.1");
+    REQUIRE(format_double_string(-2.25) == "-2.25");
+    REQUIRE(format_double_string(1.0/3) == "0.3333333333333333");
+    REQUIRE(format_double_string(123456789) == "123456789");
+    REQUIRE(format_double_string(1e-7) == "1e-07");
+    REQUIRE(format_double_string(5e-324) == "5e-324");
+    REQUIRE(format_float_string(0.1f) == "0.1");
+    REQUIRE(format_float_string(1.0f/3) == "0.33333334");
+}
+
+TEST_CASE("dtoa, random doubles read back exactly", "[dtoa]"){
+    std::mt19937_64 gen(42);
+    char buf[DTOA_BUFFER_SIZE + 1];
+    for(size_t i = 0; i < 100000; ++i){
+        uint64_t bits = gen();
+        double v;
+        std::memcpy(&v, &bits, sizeof(v));
+        if(v != v || v - v != 0) continue; //nan or inf
+        buf[format_double(v, buf)] = '\0';
+        REQUIRE(std::strtod(buf, nullptr) == v);
+    }
+}
+
+TEST_CASE("dtoa, random floats read back exactly", "[dtoa]"){
+    std::mt19937 gen(42);
+    char buf[DTOA_BUFFER_SIZE + 1];
+    for(size_t i = 0; i < 100000; ++i){
+        uint32_t bits = gen();
+        float v;
+        std::memcpy(&v, &bits, sizeof(v));
+        if(v != v || v - v != 0) continue;
+        buf[format_float(v, buf)] = '\0';
+        REQUIRE(std::strtof(buf, nullptr) == v);
+    }
+}
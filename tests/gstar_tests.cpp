@@ -2,6 +2,8 @@
 #include "../src/gstar.cpp"
 
 #include <cstdio> //for remove
+#include <sstream>
+#include <random>
 
 const double epsilon = 1e-9;
 
@@ -64,6 +66,345 @@ TEST_CASE("gstar, checking random_schedule", "[gstar][random]"){
     auto trees = gstar({s1,s2}, 10);
 }
 
+TEST_CASE("gstar, threaded random schedule matches serial", "[gstar][random][threads]"){
+    std::string s1 = "((a,((b,c),k)),e);";
+    std::string s2 = "((b,((a,c),k)),e);";
+    std::string s3 = "(((a,b),(c,k)),e);";
+    gstar_options_t opts;
+    opts.trials = 250;
+    opts.seed = 42;
+    opts.logfile = "schedule.log";
+    auto serial = gstar({s1,s2,s3}, opts);
+    opts.threads = 4;
+    auto threaded = gstar({s1,s2,s3}, opts);
+    std::remove(opts.logfile.c_str());
+
+    std::unordered_map<std::string, double> serial_map(serial.begin(),
+            serial.end());
+    REQUIRE(serial.size() == threaded.size());
+    for(auto& t : threaded){
+        REQUIRE(serial_map.count(t.first));
+        REQUIRE(serial_map[t.first] == t.second);
+    }
+}
+
+TEST_CASE("gstar, dirichlet alpha", "[gstar][random][dirichlet]"){
+    std::string s1 = "((a,((b,c),k)),e);";
+    std::string s2 = "((b,((a,c),k)),e);";
+    std::string s3 = "(((a,b),(c,k)),e);";
+    gstar_options_t opts;
+    opts.trials = 250;
+    opts.seed = 42;
+    opts.logfile = "schedule.log";
+    opts.alpha = 0.3;
+    auto serial = gstar({s1,s2,s3}, opts);
+    opts.threads = 4;
+    auto threaded = gstar({s1,s2,s3}, opts);
+    REQUIRE(serial == threaded);
+
+    opts.alpha = 0.0;
+    REQUIRE_THROWS_AS(gstar_run({s1,s2,s3}, opts), const std::runtime_error&);
+    opts.alpha = 2.0;
+    opts.sampler = sampler_t::sobol;
+    REQUIRE_THROWS_AS(gstar_run({s1,s2,s3}, opts), const std::runtime_error&);
+    opts.sampler = sampler_t::random;
+    opts.trials = 0;
+    REQUIRE_THROWS_AS(gstar_run({s1,s2,s3}, opts), const std::runtime_error&);
+    std::remove(opts.logfile.c_str());
+}
+
+/*
+ * Some random gene trees on the first taxa taxa of a to l, made by joining
+ * two random clusters until there is one left.
+ */
+std::vector<std::string> random_gene_trees(size_t taxa, size_t trees,
+        unsigned seed){
+    std::mt19937 gen(seed);
+    std::vector<std::string> ret;
+    for(size_t t = 0; t < trees; ++t){
+        std::vector<std::string> clusters;
+        for(size_t i = 0; i < taxa; ++i){
+            clusters.push_back(std::string(1, (char)('a'+i)));
+        }
+        while(clusters.size() > 1){
+            size_t i = gen() % clusters.size();
+            std::string a = clusters[i];
+            clusters.erase(clusters.begin() + i);
+            size_t j = gen() % clusters.size();
+            std::string b = clusters[j];
+            clusters.erase(clusters.begin() + j);
+            clusters.push_back("(" + a + "," + b + ")");
+        }
+        ret.push_back(clusters.front() + ";");
+    }
+    return ret;
+}
+
+TEST_CASE("gstar, default schedule matches every schedule done directly", "[gstar][default]"){
+    std::vector<std::vector<std::string>> inputs {{
+        "(((a,b),(c,d)),(((e,f),g),h));",
+        "((a,(b,(c,d))),((e,f),(g,h)));",
+        "(((a,h),(c,d)),((e,(f,b)),g));"}};
+    unsigned seed = 1;
+    for(size_t taxa : {6, 8, 10, 12}){
+        for(size_t trees : {3, 8, 20}){
+            inputs.push_back(random_gene_trees(taxa, trees, seed++));
+        }
+    }
+    for(auto& vt : inputs){
+        star_t star(vt);
+        std::string outgroup = star.get_first_label();
+        size_t depth = star.get_size();
+        size_t trials = ((size_t)1<<depth) - 1;
+        std::unordered_map<std::string, int> expected;
+        for(size_t code = 1; code <= trials; ++code){
+            std::vector<double> schedule(depth, 0.0);
+            for(size_t k = 0; k < depth; ++k){
+                if(code & ((size_t)1<<k)) schedule[k] = 1.0;
+            }
+            expected[star.get_tree(schedule).set_outgroup(outgroup).sort()
+                .clear_weights().to_string()] += 1;
+        }
+
+        gstar_options_t opts;
+        opts.logfile = "schedule.log";
+        opts.outgroup = outgroup;
+        for(size_t threads : {1, 3}){
+            opts.threads = threads;
+            auto trees = gstar(vt, opts);
+            REQUIRE(trees.size() == expected.size());
+            for(auto& t : trees){
+                REQUIRE(expected.count(t.first));
+                REQUIRE(t.second == (double)expected[t.first]/trials);
+            }
+        }
+        std::remove(opts.logfile.c_str());
+    }
+}
+
+TEST_CASE("gstar, default schedule runs one schedule of each kind without a tie", "[gstar][classes]"){
+    std::vector<std::string> vt {
+        "(((d,c),b),(a,(f,e)));",
+        "(((d,f),c),(a,(e,b)));",
+        "(((a,e),b),((f,d),c));",
+        "(((a,f),d),((b,e),c));"};
+    gstar_options_t opts;
+    opts.logfile = "schedule.log";
+    opts.log_format = log_format_t::json;
+    auto result = gstar_run(vt, opts);
+    REQUIRE(result.trials == 7);
+
+    //two classes of one depth each, and the last depth doesn't count: the
+    //kinds are (0,0), (1,0), (0,1) and (1,1). Only (0,1) has no tie, so it
+    //is run once for both of its schedules, and the others one by one.
+    std::ifstream log(opts.logfile.c_str());
+    std::string line;
+    std::vector<double> weights;
+    while(std::getline(log, line)){
+        auto at = line.find("\"importance\": ");
+        if(at == std::string::npos) continue;
+        weights.push_back(std::stod(line.substr(at + 14)));
+    }
+    REQUIRE(weights == std::vector<double>({1, 1, 1, 2, 1, 1}));
+    std::remove(opts.logfile.c_str());
+}
+
+TEST_CASE("gstar, default schedule of very deep gene trees", "[gstar][default]"){
+    //a caterpillar on 66 taxa is 65 deep, too many schedules to count
+    std::string caterpillar = "t0";
+    for(size_t i = 1; i < 66; ++i){
+        caterpillar = "(" + caterpillar + ",t" + std::to_string(i) + ")";
+    }
+    gstar_options_t opts;
+    opts.logfile = "schedule.log";
+    REQUIRE_THROWS_AS(gstar_run({caterpillar + ";"}, opts),
+            const std::runtime_error&);
+    std::remove(opts.logfile.c_str());
+}
+
+TEST_CASE("gstar, convergence check", "[gstar][converge]"){
+    topology_counts_t counts;
+    counts[topology_key_t{1,1}] = 1000;
+    REQUIRE(!check_convergence(counts, 1000, 0.001, 5));
+    REQUIRE(check_convergence(counts, 1000, 0.01, 5));
+
+    counts[topology_key_t{2,2}] = 1000;
+    REQUIRE(!check_convergence(counts, 2000, 0.01, 5));
+    REQUIRE(check_convergence(counts, 2000, 0.05, 5));
+
+    //lots of topologies seen once each, the perplexity is still moving
+    topology_counts_t spread;
+    for(uint64_t i = 0; i < 1000; ++i){
+        spread[topology_key_t{i,i}] = 1;
+    }
+    REQUIRE(!check_convergence(spread, 1000, 0.05, 1));
+}
+
+TEST_CASE("gstar, perplexity", "[gstar][converge]"){
+    REQUIRE(calc_perplexity({{"a", 1.0}}) == Approx(1.0));
+    REQUIRE(calc_perplexity({{"a", 0.25}, {"b", 0.25}, {"c", 0.25},
+                {"d", 0.25}}) == Approx(4.0));
+}
+
+TEST_CASE("gstar, adaptive random schedule stops early", "[gstar][random][converge]"){
+    std::string s1 = "((a,((b,c),k)),e);";
+    std::string s2 = "((b,((a,c),k)),e);";
+    std::string s3 = "(((a,b),(c,k)),e);";
+    gstar_options_t opts;
+    opts.trials = 100000;
+    opts.seed = 42;
+    opts.logfile = "schedule.log";
+    opts.tolerance = 0.02;
+    auto serial = gstar_run({s1,s2,s3}, opts);
+    REQUIRE(serial.converged);
+    REQUIRE(serial.trials < opts.trials);
+    REQUIRE(serial.trials % CONVERGENCE_INTERVAL == 0);
+
+    opts.threads = 3;
+    auto threaded = gstar_run({s1,s2,s3}, opts);
+    REQUIRE(threaded.trials == serial.trials);
+    std::unordered_map<std::string, double> serial_map(serial.trees.begin(),
+            serial.trees.end());
+    for(auto& t : threaded.trees){
+        REQUIRE(serial_map[t.first] == t.second);
+    }
+
+    opts.trials = 100;
+    auto capped = gstar_run({s1,s2,s3}, opts);
+    REQUIRE(capped.trials == 100);
+    REQUIRE(!capped.converged);
+    std::remove(opts.logfile.c_str());
+}
+
+//the blocks of a binary log fall wherever the checkpoints did, so compare
+//what is in the logs rather than the bytes
+std::string dump_log(const std::string& filename){
+    std::ostringstream out;
+    dump_schedule_log(filename, out);
+    return out.str();
+}
+
+TEST_CASE("gstar, resume from a checkpoint", "[gstar][random][checkpoint]"){
+    std::vector<std::string> vt {
+        "((a,((b,c),k)),e);",
+        "((b,((a,c),k)),e);",
+        "(((a,b),(c,k)),e);"};
+    gstar_options_t opts;
+    opts.trials = 1000;
+    opts.seed = 42;
+    opts.logfile = "whole.log";
+    opts.checkpoint = "whole.counts";
+    opts.checkpoint_interval = 0;
+    auto whole = gstar_run(vt, opts);
+    auto whole_log = dump_log(opts.logfile);
+    auto whole_counts = read_counts_file(opts.checkpoint);
+    REQUIRE(whole_counts.finished);
+    REQUIRE(whole_counts.completed == 1000);
+
+    //fake a run that got killed after 300 trials
+    opts.trials = 300;
+    opts.logfile = "part.log";
+    opts.checkpoint = "part.counts";
+    gstar_run(vt, opts);
+    auto part = read_counts_file(opts.checkpoint);
+    part.end = 1000;
+    part.finished = false;
+    write_counts_file(opts.checkpoint, part);
+    {
+        std::ofstream log(opts.logfile.c_str(), std::ios::app);
+        log<<"junk from after the checkpoint\n";
+    }
+
+    opts.trials = 1000;
+    opts.seed = 0;
+    opts.resume = true;
+    opts.threads = 2;
+    auto resumed = gstar_run(vt, opts);
+    REQUIRE(resumed.seed == 42);
+    REQUIRE(dump_log(opts.logfile) == whole_log);
+    std::unordered_map<std::string, double> whole_map(whole.trees.begin(),
+            whole.trees.end());
+    REQUIRE(resumed.trees.size() == whole.trees.size());
+    for(auto& t : resumed.trees){
+        REQUIRE(whole_map[t.first] == t.second);
+    }
+
+    //resuming a finished run just gives the answer again
+    auto again = gstar_run(vt, opts);
+    REQUIRE(again.trees.size() == whole.trees.size());
+    REQUIRE(dump_log(opts.logfile) == whole_log);
+
+    REQUIRE_THROWS(gstar_run({vt[0], vt[1]}, opts));
+    opts.trials = 2000;
+    REQUIRE_THROWS(gstar_run(vt, opts));
+    //the default schedules can't be checkpointed, and resuming needs a file
+    opts.trials = 0;
+    REQUIRE_THROWS(gstar_run(vt, opts));
+    opts.trials = 1000;
+    opts.checkpoint.clear();
+    REQUIRE_THROWS(gstar_run(vt, opts));
+
+    for(auto f : {"whole.log", "whole.counts", "part.log", "part.counts"}){
+        std::remove(f);
+    }
+}
+
+TEST_CASE("gstar, merged shards match one run", "[gstar][random][merge]"){
+    std::vector<std::string> vt {
+        "((a,((b,c),k)),e);",
+        "((b,((a,c),k)),e);",
+        "(((a,b),(c,k)),e);"};
+    gstar_options_t opts;
+    opts.trials = 1001;
+    opts.seed = 42;
+    opts.logfile = "shard.log";
+    opts.checkpoint = "whole.counts";
+    auto whole = gstar_run(vt, opts);
+
+    //half of it in one shard, the other half in two
+    std::vector<counts_file_t> files;
+    for(auto s : {std::make_pair(0, 2), std::make_pair(2, 4),
+            std::make_pair(3, 4)}){
+        opts.shard = s.first;
+        opts.shards = s.second;
+        opts.checkpoint = "shard.counts";
+        auto part = gstar_run(vt, opts);
+        auto range = get_shard_range(opts.trials, opts.shard, opts.shards);
+        REQUIRE(part.trials == range.second - range.first);
+        files.push_back(read_counts_file(opts.checkpoint));
+    }
+    auto merged = gstar_from_counts(merge_counts_files(files));
+    REQUIRE(merged.trials == whole.trials);
+    REQUIRE(merged.seed == whole.seed);
+    std::unordered_map<std::string, double> whole_map(whole.trees.begin(),
+            whole.trees.end());
+    REQUIRE(merged.trees.size() == whole.trees.size());
+    for(auto& t : merged.trees){
+        REQUIRE(whole_map[t.first] == t.second);
+    }
+
+    opts.shard = 4;
+    REQUIRE_THROWS(gstar_run(vt, opts));
+    opts.shard = 0;
+    opts.tolerance = 0.1;
+    REQUIRE_THROWS(gstar_run(vt, opts));
+    opts.tolerance = 0.0;
+    opts.trials = 0;
+    REQUIRE_THROWS(gstar_run(vt, opts));
+
+    for(auto f : {"shard.log", "shard.counts", "whole.counts"}){
+        std::remove(f);
+    }
+}
+
+TEST_CASE("dirichlet, same stream gives the same schedule", "[gstar][dirichlet][random]"){
+    philox_t g1(7, 1000);
+    philox_t g2(7, 1000);
+    auto d1 = dirichlet(10, 10.0, g1);
+    auto d2 = dirichlet(10, 10.0, g2);
+    REQUIRE(d1 == d2);
+}
+
 TEST_CASE("dirichlet random numbers 1, dim 3", "[gstar][dirichlet][random]"){
     auto dv = dirichlet(3);
     double total = 0.0;
@@ -127,3 +468,237 @@ TEST_CASE("dirichlet random numbers 2, average test, dim 100", "[gstar][dirichle
         REQUIRE(-(i - EXPECTED) < epsilon*1e7);
     }
 }
+
+TEST_CASE("gstar, quasi random samplers", "[gstar][random][qmc]"){
+    std::vector<std::string> vt {
+        "((a,((b,c),k)),e);",
+        "((b,((a,c),k)),e);",
+        "(((a,b),(c,k)),e);"};
+    gstar_options_t opts;
+    opts.trials = 2000;
+    opts.seed = 42;
+    opts.logfile = "schedule.log";
+    auto pseudo = gstar_run(vt, opts);
+    std::unordered_map<std::string, double> pseudo_map(pseudo.trees.begin(),
+            pseudo.trees.end());
+
+    for(auto sampler : {sampler_t::sobol, sampler_t::halton}){
+        opts.sampler = sampler;
+        opts.threads = 1;
+        auto serial = gstar_run(vt, opts);
+        double total = 0.0;
+        for(auto& t : serial.trees){
+            //same answer as the pseudo random schedules, give or take
+            REQUIRE(std::abs(t.second - pseudo_map[t.first]) < 0.05);
+            total += t.second;
+        }
+        REQUIRE(total == Approx(1.0));
+
+        opts.threads = 3;
+        auto threaded = gstar_run(vt, opts);
+        std::unordered_map<std::string, double> serial_map(
+                serial.trees.begin(), serial.trees.end());
+        REQUIRE(threaded.trees.size() == serial.trees.size());
+        for(auto& t : threaded.trees){
+            REQUIRE(serial_map[t.first] == t.second);
+        }
+    }
+    std::remove(opts.logfile.c_str());
+}
+
+TEST_CASE("gstar, allocate strata", "[gstar][importance]"){
+    auto even = allocate_strata({0.0, 0.0, 0.0, 0.0}, 1002);
+    REQUIRE(even == std::vector<size_t>({251, 251, 250, 250}));
+
+    auto skewed = allocate_strata({1.0, 0.0, 0.0, 3.0}, 1000);
+    size_t total = 0;
+    for(auto n : skewed) total += n;
+    REQUIRE(total == 1000);
+    //a tenth spread evenly, the rest by spread
+    REQUIRE(skewed[0] == 25 + 225);
+    REQUIRE(skewed[1] == 25);
+    REQUIRE(skewed[3] == 25 + 675);
+}
+
+TEST_CASE("gstar, importance sampling stays unbiased", "[gstar][random][importance]"){
+    std::vector<std::string> vt {
+        "((a,((b,c),k)),e);",
+        "((b,((a,c),k)),e);",
+        "(((a,b),(c,k)),e);",
+        "(((a,k),(c,b)),e);"};
+    gstar_options_t opts;
+    opts.trials = 20000;
+    opts.seed = 42;
+    opts.logfile = "schedule.log";
+    auto plain = gstar_run(vt, opts);
+    std::unordered_map<std::string, double> plain_map(plain.trees.begin(),
+            plain.trees.end());
+
+    opts.importance = true;
+    opts.log_format = log_format_t::json;
+    opts.seed = 43;
+    auto weighted = gstar_run(vt, opts);
+    double total = 0.0;
+    for(auto& t : weighted.trees){
+        REQUIRE(std::abs(t.second - plain_map[t.first]) < 0.02);
+        total += t.second;
+    }
+    REQUIRE(total == Approx(1.0));
+
+    //every trial is logged with its weight, and the weights add up to the
+    //number of trials
+    std::ifstream log(opts.logfile.c_str());
+    std::string line;
+    size_t lines = 0;
+    double weight_total = 0.0;
+    while(std::getline(log, line)){
+        auto at = line.find("\"importance\": ");
+        if(at == std::string::npos) continue;
+        weight_total += std::stod(line.substr(at + 14));
+        lines++;
+    }
+    REQUIRE(lines == opts.trials);
+    REQUIRE(weight_total == Approx(opts.trials));
+
+    opts.threads = 3;
+    auto threaded = gstar_run(vt, opts);
+    std::unordered_map<std::string, double> weighted_map(
+            weighted.trees.begin(), weighted.trees.end());
+    REQUIRE(threaded.trees.size() == weighted.trees.size());
+    for(auto& t : threaded.trees){
+        REQUIRE(weighted_map[t.first] == t.second);
+    }
+
+    opts.tolerance = 0.01;
+    REQUIRE_THROWS(gstar_run(vt, opts));
+    opts.tolerance = 0.0;
+    opts.trials = 10;
+    REQUIRE_THROWS(gstar_run(vt, opts));
+    std::remove(opts.logfile.c_str());
+}
+
+TEST_CASE("gstar, exact partition of the schedules", "[gstar][exact]"){
+    std::vector<std::string> vt {
+        "((a,((b,c),k)),e);",
+        "((b,((a,c),k)),e);",
+        "(((a,b),(c,k)),e);",
+        "(((a,k),(c,b)),e);"};
+    gstar_options_t opts;
+    opts.exact = 2000;
+    auto result = gstar_run(vt, opts);
+    REQUIRE(result.trials == 2000);
+    REQUIRE(result.bounds.size() == result.trees.size());
+    REQUIRE(result.unresolved > 0.0);
+    REQUIRE(result.unresolved < 1.0);
+    double total = 0.0;
+    for(size_t i = 0; i < result.trees.size(); ++i){
+        REQUIRE(result.bounds[i].first <= result.trees[i].second);
+        REQUIRE(result.trees[i].second <= result.bounds[i].second);
+        REQUIRE(result.bounds[i].second - result.bounds[i].first
+                == Approx(result.unresolved));
+        total += result.trees[i].second;
+    }
+    REQUIRE(total == Approx(1.0));
+
+    //a single gene tree gives the same topology everywhere, even if the
+    //join sequences differ
+    auto single = gstar_run({"(((a,b),(c,d)),(((e,f),g),h));"}, opts);
+    REQUIRE(single.trees.size() == 1);
+    REQUIRE(single.trees[0].second == 1.0);
+    REQUIRE(single.bounds[0].first > 0.5);
+    REQUIRE(single.bounds[0].second == 1.0);
+
+    opts.trials = 100;
+    REQUIRE_THROWS(gstar_run(vt, opts));
+}
+
+TEST_CASE("gstar, decision margins", "[gstar][margins]"){
+    std::vector<std::string> vt {
+        "((a,((b,c),k)),e);",
+        "((b,((a,c),k)),e);",
+        "(((a,b),(c,k)),e);",
+        "(((a,k),(c,b)),e);"};
+    gstar_options_t opts;
+    opts.seed = 42;
+    opts.logfile = "schedule.log";
+    opts.log_format = log_format_t::json;
+    for(size_t trials : {0, 5000}){
+        opts.trials = trials;
+        opts.margins = false;
+        auto plain = gstar_run(vt, opts);
+        REQUIRE(plain.margins.empty());
+        opts.margins = true;
+        auto result = gstar_run(vt, opts);
+        REQUIRE(result.trees == plain.trees);
+        REQUIRE(result.margins.size() == result.trees.size());
+        for(auto& m : result.margins){
+            REQUIRE(m.second >= 0.0);
+            REQUIRE(m.first >= m.second);
+        }
+
+        //every trial is logged with its margin, and the least of them is
+        //the least of any topology
+        std::ifstream log(opts.logfile.c_str());
+        std::string line;
+        double least = HUGE_VAL;
+        size_t lines = 0;
+        while(std::getline(log, line)){
+            auto at = line.find("\"margin\": ");
+            if(at == std::string::npos) continue;
+            least = std::min(least, std::stod(line.substr(at + 10)));
+            lines++;
+        }
+        REQUIRE(lines > 0);
+        double result_least = HUGE_VAL;
+        for(auto& m : result.margins){
+            result_least = std::min(result_least, m.second);
+        }
+        REQUIRE(least == Approx(result_least));
+    }
+
+    opts.resume = true;
+    opts.checkpoint = "margins.counts";
+    REQUIRE_THROWS(gstar_run(vt, opts));
+    std::remove(opts.logfile.c_str());
+}
+
+TEST_CASE("gstar, time budget", "[gstar][random][budget]"){
+    std::vector<std::string> vt {
+        "((a,((b,c),k)),e);",
+        "((b,((a,c),k)),e);",
+        "(((a,b),(c,k)),e);",
+        "(((a,k),(c,b)),e);"};
+    gstar_options_t opts;
+    opts.trials = (size_t)1 << 40;
+    opts.seed = 42;
+    opts.logfile = "schedule.log";
+    opts.log_format = log_format_t::json;
+    opts.time_budget = 0.2;
+    auto timed = gstar_run(vt, opts);
+    REQUIRE(timed.trials > 0);
+    REQUIRE(timed.trials < opts.trials);
+    REQUIRE(timed.trials_per_second > 0.0);
+
+    //every trial that got done is logged
+    std::ifstream log(opts.logfile.c_str());
+    std::string line;
+    size_t lines = 0;
+    while(std::getline(log, line)) lines++;
+    REQUIRE(lines == timed.trials + 1);
+
+    //and the results are the same as asking for that many trials
+    opts.time_budget = 0.0;
+    opts.trials = timed.trials;
+    auto fixed = gstar_run(vt, opts);
+    std::unordered_map<std::string, double> fixed_map(fixed.trees.begin(),
+            fixed.trees.end());
+    REQUIRE(timed.trees.size() == fixed.trees.size());
+    for(auto& t : timed.trees){
+        REQUIRE(fixed_map[t.first] == t.second);
+    }
+
+    opts.time_budget = 1.0;
+    opts.trials = 0;
+    REQUIRE_THROWS(gstar_run(vt, opts));
+    std::remove(opts.logfile.c_str());
+}
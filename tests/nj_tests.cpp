@@ -1,38 +1,53 @@
 #include "catch.hpp"
 #include "../src/nj.cpp"
+#include <random>
 
-TEST_CASE("nj, column and row delete", "[nj]"){
-    const d2vector_t d {{4.4, 3.3, 32.0}, 
-                        {2.1, 45.0, 22.0}, 
-                        {55, 49, 31}};
-    auto d1 = d;
-    auto d2 = d;
-    auto d3 = d;
-    delete_rowcol(d1, 0);
-    REQUIRE(d1[0][0]==45);
-    REQUIRE(d1[0][1]==22.0);
-    REQUIRE(d1[1][0]==49);
-    REQUIRE(d1[1][1]==31);
-
-    delete_rowcol(d2, 1);
-    REQUIRE(d2[0][0]==4.4);
-    REQUIRE(d2[0][1]==32.0);
-    REQUIRE(d2[1][0]==55);
-    REQUIRE(d2[1][1]==31);
-
-    delete_rowcol(d3, 2);
-    REQUIRE(d3[0][0]==4.4);
-    REQUIRE(d3[0][1]==3.3);
-    REQUIRE(d3[1][0]==2.1);
-    REQUIRE(d3[1][1]==45.0);
-}
-
-TEST_CASE("nj, add row and col", "[nj]"){
-    d2vector_t d {{4.4}};
-    add_rowcol(d);
-    REQUIRE(d[1][0]==0.0);
-    REQUIRE(d[1][1]==0.0);
-    REQUIRE(d[0][1]==0.0);
+TEST_CASE("nj, table joins in place", "[nj]"){
+    std::vector<double> d = { 0.0, 5.0, 9.0, 9.0, 8.0,
+                              5.0, 0.0, 10.0, 10.0, 9.0,
+                              9.0, 10.0, 0.0, 8.0, 7.0,
+                              9.0, 10.0, 8.0, 0.0, 3.0,
+                              8.0, 9.0, 7.0, 3.0, 0.0 };
+    nj_table_t t(d, 5);
+    REQUIRE(t.size() == 5);
+    REQUIRE(t.row_sum(1) == 34.0);
+    REQUIRE(t.q(0, 1) == -50.0);
+
+    //joining b and d leaves a, c, e in order, and the new node on the end
+    t.join(1, 3);
+    REQUIRE(t.size() == 4);
+    std::vector<double> left {0.0, 9.0, 8.0, 2.0,
+                              9.0, 0.0, 7.0, 4.0,
+                              8.0, 7.0, 0.0, 1.0,
+                              2.0, 4.0, 1.0, 0.0};
+    for(size_t i = 0; i < 4; ++i){
+        double sum = 0.0;
+        for(size_t j = 0; j < 4; ++j){
+            REQUIRE(t.dist(i, j) == left[i*4+j]);
+            sum += left[i*4+j];
+        }
+        REQUIRE(t.row_sum(i) == sum);
+    }
+
+    //the order of the pair doesn't matter
+    nj_table_t u(d, 5);
+    u.join(3, 1);
+    for(size_t i = 0; i < 4; ++i){
+        for(size_t j = 0; j < 4; ++j){
+            REQUIRE(u.dist(i, j) == t.dist(i, j));
+        }
+    }
+
+    //once half the slots are gone, the rows left get moved to the front
+    t.join(0, 3);
+    REQUIRE(t.compactions() == 0);
+    REQUIRE(t.indices()[1] == NJ_NOT_IN_TABLE);
+    REQUIRE(std::isinf(t.sums()[1]));
+    t.join(0, 1);
+    REQUIRE(t.compactions() == 1);
+    REQUIRE(t.stride() == 2);
+    REQUIRE(t.dist(0, 1) == 1.0);
+    REQUIRE(t.row_sum(1) == 1.0);
 }
 
 TEST_CASE("new nj with simple distance table", "[nj]"){
@@ -146,3 +161,290 @@ TEST_CASE("nj, from large tree distance matrix", "[nj]"){
     nj_tree.clear_weights();
     REQUIRE(nj_tree.to_string() == "(a,b,((c,d),(((e,f),g),h)));");
 }
+
+TEST_CASE("nj, join sequences", "[nj]"){
+    std::vector<double> d = { 0.0, 5.0, 9.0, 9.0, 8.0,
+                              5.0, 0.0, 10.0, 10.0, 9.0,
+                              9.0, 10.0, 0.0, 8.0, 7.0,
+                              9.0, 10.0, 8.0, 0.0, 3.0,
+                              8.0, 9.0, 7.0, 3.0, 0.0 };
+    std::vector<std::string> l {"a", "b", "c", "d", "e"};
+    auto joins = nj_joins(d, l.size());
+    REQUIRE(joins.size() == 2);
+    REQUIRE(nj_allows(d, l.size(), joins));
+
+    auto tree = nj_with_joins(d, l, joins);
+    auto plain = nj(d, l);
+    tree.sort();
+    plain.sort();
+    REQUIRE(tree.to_string() == plain.to_string());
+
+    //(d,e) is the best pair to start with, so joining (a,c) first is wrong
+    REQUIRE_FALSE(nj_allows(d, l.size(), {{0, 2}, {0, 1}}));
+    REQUIRE_FALSE(nj_allows(d, l.size(), {joins[0]}));
+}
+
+TEST_CASE("nj, join sequences with ties", "[nj]"){
+    //every pair looks the same, so the last one find_pair looks at wins, and
+    //every other pair is allowed too
+    std::vector<double> d(16, 1.0);
+    for(size_t i = 0; i < 4; ++i) d[i*4+i] = 0.0;
+    auto joins = nj_joins(d, 4);
+    REQUIRE(joins.size() == 1);
+    REQUIRE(joins[0] == std::make_pair((size_t)2, (size_t)3));
+    REQUIRE(nj_allows(d, 4, {{0, 1}}));
+    REQUIRE(nj_allows(d, 4, {{1, 3}}));
+    REQUIRE_FALSE(nj_is_clear(d, 4));
+}
+
+TEST_CASE("nj, tables without ties", "[nj]"){
+    //(a,b) is the best start by a long way, and after that (c,u) and (d,e)
+    //tie, but they are the same split of the four rows left
+    std::vector<double> d = { 0.0, 5.0, 9.0, 9.0, 8.0,
+                              5.0, 0.0, 10.0, 10.0, 9.0,
+                              9.0, 10.0, 0.0, 8.0, 7.0,
+                              9.0, 10.0, 8.0, 0.0, 3.0,
+                              8.0, 9.0, 7.0, 3.0, 0.0 };
+    REQUIRE(nj_is_clear(d, 5));
+
+    //now c and d are the same distance from everything else, so (c,e) and
+    //(d,e) tie
+    d[2*5+4] = d[4*5+2] = 3.0;
+    REQUIRE_FALSE(nj_is_clear(d, 5));
+}
+
+TEST_CASE("nj, warm started from a hint", "[nj]"){
+    std::vector<double> d = { 0.0, 5.0, 9.0, 9.0, 8.0,
+                              5.0, 0.0, 10.0, 10.0, 9.0,
+                              9.0, 10.0, 0.0, 8.0, 7.0,
+                              9.0, 10.0, 8.0, 0.0, 3.0,
+                              8.0, 9.0, 7.0, 3.0, 0.0 };
+    std::vector<std::string> l {"a", "b", "c", "d", "e"};
+    auto plain = nj(d, l);
+    plain.sort();
+    std::vector<std::pair<size_t, size_t>> joins;
+
+    //no hint, the right hint and a wrong one all make the same tree
+    std::vector<std::vector<std::pair<size_t, size_t>>> hints {
+        {}, nj_joins(d, l.size()), {{0, 2}, {0, 1}}};
+    for(auto&& hint : hints){
+        auto tree = nj_with_hint(d, l, hint, joins);
+        tree.sort();
+        REQUIRE(tree.to_string() == plain.to_string());
+        REQUIRE(nj_allows(d, l.size(), joins));
+    }
+
+    //a hinted pair that ties with a later one isn't the pair find_pair picks
+    std::vector<double> tied(16, 1.0);
+    for(size_t i = 0; i < 4; ++i) tied[i*4+i] = 0.0;
+    nj_with_hint(tied, {"a", "b", "c", "d"}, {{0, 1}}, joins);
+    REQUIRE(joins == nj_joins(tied, 4));
+}
+
+TEST_CASE("nj, decision margins", "[nj]"){
+    std::vector<double> d = { 0.0, 5.0, 9.0, 9.0, 8.0,
+                              5.0, 0.0, 10.0, 10.0, 9.0,
+                              9.0, 10.0, 0.0, 8.0, 7.0,
+                              9.0, 10.0, 8.0, 0.0, 3.0,
+                              8.0, 9.0, 7.0, 3.0, 0.0 };
+    std::vector<std::string> l {"a", "b", "c", "d", "e"};
+    //(a,b) goes first with a Q of -50, and the best of the pairs with a or b
+    //in them is -38. Then (a,b) ties with (d,e) at -28, but those don't
+    //conflict, and the other pairs are all -24.
+    std::vector<std::vector<std::pair<size_t, size_t>>> hints {
+        {}, nj_joins(d, l.size())};
+    std::vector<std::pair<size_t, size_t>> joins;
+    for(auto&& hint : hints){
+        double margin;
+        nj_with_hint(d, l, hint, joins, &margin);
+        REQUIRE(margin == 4.0);
+    }
+
+    std::vector<double> small = {0.0, 1.0, 1.0,
+                                 1.0, 0.0, 1.0,
+                                 1.0, 1.0, 0.0};
+    double margin;
+    nj_with_hint(small, {"a", "b", "c"}, {}, joins, &margin);
+    REQUIRE(std::isinf(margin));
+}
+
+TEST_CASE("nj, bounded search makes the same trees", "[nj][bounded]"){
+    std::mt19937_64 gen(11);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::uniform_int_distribution<int> small(1, 3);
+    for(size_t n : {4, 5, 9, 30, 80}){
+        std::vector<std::string> l;
+        for(size_t i = 0; i < n; ++i) l.push_back("t" + std::to_string(i));
+        //real valued distances, and small whole ones, which tie a lot
+        for(int kind = 0; kind < 2; ++kind){
+            std::vector<double> d(n*n, 0.0);
+            for(size_t i = 0; i < n; ++i){
+                for(size_t j = i+1; j < n; ++j){
+                    d[i*n+j] = d[j*n+i] = kind == 0 ? uniform(gen) :
+                        (double)small(gen);
+                }
+            }
+            std::vector<std::pair<size_t, size_t>> exhaustive, bounded;
+            double exhaustive_margin, bounded_margin;
+            auto plain = nj_with_hint(d, l, {}, exhaustive,
+                    &exhaustive_margin);
+            auto tree = nj_with_hint(d, l, exhaustive, bounded,
+                    &bounded_margin, nj_search_t::bounded);
+            REQUIRE(bounded == exhaustive);
+            REQUIRE(bounded_margin == exhaustive_margin);
+            REQUIRE(tree.to_string() == plain.to_string());
+            REQUIRE(nj(d, l, nj_search_t::bounded).to_string()
+                    == plain.to_string());
+        }
+    }
+    REQUIRE(parse_nj_search("bounded") == nj_search_t::bounded);
+    REQUIRE_THROWS_AS(parse_nj_search("rapid"), const std::invalid_argument&);
+}
+
+/*
+ * The join sequence the NJ from before the table rewrite made, for checking
+ * ties against. R is summed over the whole row every step, the lowest Q starts
+ * at zero, and the last pair with the lowest Q wins.
+ */
+std::vector<std::pair<size_t, size_t>> baseline_joins(
+        const std::vector<double>& d, size_t row_size){
+    std::vector<std::vector<double>> dists(row_size,
+            std::vector<double>(row_size));
+    for(size_t i = 0; i < row_size; ++i){
+        for(size_t j = 0; j < row_size; ++j){
+            dists[i][j] = d[i*row_size+j];
+        }
+    }
+    std::vector<std::pair<size_t, size_t>> joins;
+    while(dists.size() > 3){
+        size_t n = dists.size();
+        std::vector<double> R(n, 0);
+        for(size_t i = 0; i < n; ++i){
+            for(size_t j = 0; j < n; ++j){
+                R[i] += dists[i][j];
+            }
+        }
+        size_t a = 0, b = 0;
+        double lowest = 0.0;
+        for(size_t i = 0; i < n; ++i){
+            for(size_t j = i+1; j < n; ++j){
+                double tmp = (n-2)*dists[i][j] - R[i] - R[j];
+                if(tmp <= lowest){
+                    a = i; b = j;
+                    lowest = tmp;
+                }
+            }
+        }
+        joins.emplace_back(a, b);
+        std::vector<size_t> rest;
+        for(size_t k = 0; k < n; ++k){
+            if(k != a && k != b) rest.push_back(k);
+        }
+        std::vector<std::vector<double>> next(n-1,
+                std::vector<double>(n-1, 0.0));
+        for(size_t i = 0; i < rest.size(); ++i){
+            for(size_t j = 0; j < rest.size(); ++j){
+                next[i][j] = dists[rest[i]][rest[j]];
+            }
+            double u = (dists[a][rest[i]] + dists[b][rest[i]]
+                    - dists[a][b])/2.0;
+            next[i][n-2] = u;
+            next[n-2][i] = u;
+        }
+        dists.swap(next);
+    }
+    return joins;
+}
+
+TEST_CASE("nj, ties go the way they did before the table rewrite", "[nj][ties]"){
+    //small whole numbers, so every sum is exact, and lots of them tie. Half
+    //of the tables also have rows copied from other rows, which ties every
+    //pair with one of them in it against the same pair with the other.
+    std::mt19937_64 gen(21);
+    std::uniform_int_distribution<int> small(1, 3);
+    for(size_t n : {4, 5, 9, 30, 80}){
+        std::vector<std::string> l;
+        for(size_t i = 0; i < n; ++i) l.push_back("t" + std::to_string(i));
+        for(int copies = 0; copies < 2; ++copies){
+            std::vector<double> d(n*n, 0.0);
+            for(size_t i = 0; i < n; ++i){
+                for(size_t j = i+1; j < n; ++j){
+                    d[i*n+j] = d[j*n+i] = (double)small(gen);
+                }
+            }
+            for(size_t i = 1; copies && i < n; i += 3){
+                for(size_t k = 0; k < n; ++k){
+                    if(k == i || k == i-1) continue;
+                    d[i*n+k] = d[k*n+i] = d[(i-1)*n+k];
+                }
+            }
+            auto expected = baseline_joins(d, n);
+            std::vector<std::pair<size_t, size_t>> joins;
+            nj_with_hint(d, l, {}, joins);
+            REQUIRE(joins == expected);
+            nj_sequence_with_hint(d, n, {}, joins);
+            REQUIRE(joins == expected);
+            nj_sequence_with_hint(d, n, {}, joins, nullptr,
+                    nj_search_t::bounded);
+            REQUIRE(joins == expected);
+        }
+    }
+}
+
+TEST_CASE("nj, join sequences without the tree", "[nj]"){
+    std::mt19937_64 gen(13);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::uniform_int_distribution<int> small(1, 3);
+    for(size_t n : {3, 4, 5, 9, 30, 80}){
+        std::vector<std::string> l;
+        std::unordered_map<std::string, size_t> label_map;
+        for(size_t i = 0; i < n; ++i){
+            l.push_back("t" + std::to_string(i));
+            label_map[l.back()] = i;
+        }
+        for(int kind = 0; kind < 2; ++kind){
+            std::vector<double> d(n*n, 0.0);
+            for(size_t i = 0; i < n; ++i){
+                for(size_t j = i+1; j < n; ++j){
+                    d[i*n+j] = d[j*n+i] = kind == 0 ? uniform(gen) :
+                        (double)small(gen);
+                }
+            }
+            std::vector<std::pair<size_t, size_t>> with_tree, without;
+            double tree_margin, margin;
+            auto tree = nj_with_hint(d, l, {}, with_tree, &tree_margin);
+            nj_sequence_with_hint(d, n, {}, without, &margin);
+            REQUIRE(without == with_tree);
+            REQUIRE(margin == tree_margin);
+            REQUIRE(nj_topology_key(without, n)
+                    == tree.calc_topology_key(label_map));
+        }
+    }
+}
+
+TEST_CASE("nj, split over threads makes the same trees", "[nj][threads]"){
+    std::mt19937_64 gen(12);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::uniform_int_distribution<int> small(1, 3);
+    //big enough for the first steps to be split up
+    size_t n = NJ_PARALLEL_ROWS + 88;
+    std::vector<std::string> l;
+    for(size_t i = 0; i < n; ++i) l.push_back("t" + std::to_string(i));
+    for(int kind = 0; kind < 2; ++kind){
+        std::vector<double> d(n*n, 0.0);
+        for(size_t i = 0; i < n; ++i){
+            for(size_t j = i+1; j < n; ++j){
+                d[i*n+j] = d[j*n+i] = kind == 0 ? uniform(gen) :
+                    (double)small(gen);
+            }
+        }
+        std::vector<std::pair<size_t, size_t>> serial, split;
+        double serial_margin, split_margin;
+        auto plain = nj_with_hint(d, l, {}, serial, &serial_margin);
+        auto tree = nj_with_hint(d, l, serial, split, &split_margin,
+                nj_search_t::exhaustive, 3);
+        REQUIRE(split == serial);
+        REQUIRE(split_margin == serial_margin);
+        REQUIRE(tree.to_string() == plain.to_string());
+    }
+}
@@ -0,0 +1,57 @@
+#include "catch.hpp"
+#include "../src/partition.cpp"
+
+#include <vector>
+#include <cmath>
+
+TEST_CASE("partition, a region that bisection can cut exactly", "[partition]"){
+    //x0 >= x1 is half of the triangle, split along the first cut
+    auto locate = [](const std::vector<double>& p) -> size_t {
+        return p[0] >= p[1] ? 0 : 1;
+    };
+    auto allows = [](size_t r, const std::vector<double>& p){
+        return r == 0 ? p[0] >= p[1] : p[0] <= p[1];
+    };
+    auto result = partition_simplex(3, 100, locate, allows);
+    REQUIRE(result.pieces == 3);
+    REQUIRE(result.certain[0] == 0.5);
+    REQUIRE(result.certain[1] == 0.5);
+    REQUIRE(result.unresolved[0] == 0.0);
+    REQUIRE(result.unresolved[1] == 0.0);
+}
+
+TEST_CASE("partition, bounds close in on the volumes", "[partition]"){
+    //each coordinate being the biggest is a third of the triangle
+    auto locate = [](const std::vector<double>& p) -> size_t {
+        return std::max_element(p.begin(), p.end()) - p.begin();
+    };
+    auto allows = [](size_t r, const std::vector<double>& p){
+        return p[r] >= *std::max_element(p.begin(), p.end()) - 1e-12;
+    };
+    double last_unresolved = 1.0;
+    for(size_t pieces : {1, 10, 100, 1000, 10000}){
+        auto result = partition_simplex(3, pieces, locate, allows);
+        REQUIRE(result.pieces == pieces);
+        double unresolved = 0.0, total = 0.0;
+        for(size_t r = 0; r < result.certain.size(); ++r){
+            unresolved += result.unresolved[r];
+            total += result.certain[r] + result.unresolved[r];
+        }
+        REQUIRE(total == 1.0);
+        REQUIRE(unresolved <= last_unresolved);
+        for(size_t r = 0; r < result.certain.size(); ++r){
+            REQUIRE(result.certain[r] <= 1.0/3);
+            REQUIRE(result.certain[r] + unresolved >= 1.0/3);
+        }
+        last_unresolved = unresolved;
+    }
+    REQUIRE(last_unresolved < 0.05);
+}
+
+TEST_CASE("partition, one dimension", "[partition]"){
+    auto result = partition_simplex(1, 10,
+            [](const std::vector<double>&) -> size_t { return 0; },
+            [](size_t, const std::vector<double>&){ return true; });
+    REQUIRE(result.pieces == 1);
+    REQUIRE(result.certain == std::vector<double>({1.0}));
+}
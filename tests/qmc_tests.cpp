@@ -0,0 +1,93 @@
+#include "catch.hpp"
+#include "../src/qmc.cpp"
+
+#include <vector>
+#include <algorithm>
+
+/*
+ * Checks that the first base^k points of dimension d land one in each of the
+ * base^k equal slices of [0,1).
+ */
+bool stratified(const qmc_t& q, size_t d, size_t base, size_t k){
+    size_t n = 1;
+    for(size_t i = 0; i < k; ++i) n *= base;
+    std::vector<size_t> hits(n, 0);
+    std::vector<double> u(q.get_dims());
+    for(size_t i = 0; i < n; ++i){
+        q.point(i, u.data());
+        if(u[d] < 0.0 || u[d] >= 1.0) return false;
+        //unscrambled points sit right on the edges of the slices
+        hits[std::min((size_t)(u[d]*n + 1e-9), n-1)]++;
+    }
+    return std::all_of(hits.begin(), hits.end(),
+            [](size_t h){ return h == 1; });
+}
+
+TEST_CASE("qmc, sobol is stratified", "[qmc]"){
+    for(uint64_t seed : {0ull, 12345ull}){
+        qmc_t q(sampler_t::sobol, 20, seed);
+        for(size_t d = 0; d < 20; ++d){
+            REQUIRE(stratified(q, d, 2, 10));
+        }
+    }
+}
+
+TEST_CASE("qmc, sobol first two dimensions are a net", "[qmc]"){
+    //every 2^a by 2^(m-a) box gets exactly one of the first 2^m points
+    const size_t m = 8, n = 1 << m;
+    for(uint64_t seed : {0ull, 777ull}){
+        qmc_t q(sampler_t::sobol, 2, seed);
+        std::vector<double> u(2);
+        for(size_t a = 0; a <= m; ++a){
+            std::vector<size_t> hits(n, 0);
+            for(size_t i = 0; i < n; ++i){
+                q.point(i, u.data());
+                size_t x = u[0]*(1 << a), y = u[1]*(1 << (m-a));
+                hits[(x << (m-a)) | y]++;
+            }
+            REQUIRE(std::count(hits.begin(), hits.end(), 1) == (long)n);
+        }
+    }
+}
+
+TEST_CASE("qmc, unscrambled sobol", "[qmc]"){
+    qmc_t q(sampler_t::sobol, 2, 0);
+    std::vector<double> u(2);
+    double expected[4][2] = {{0, 0}, {0.5, 0.5}, {0.25, 0.75}, {0.75, 0.25}};
+    for(size_t i = 0; i < 4; ++i){
+        q.point(i, u.data());
+        REQUIRE(u[0] == Approx(expected[i][0]).epsilon(1e-9));
+        REQUIRE(u[1] == Approx(expected[i][1]).epsilon(1e-9));
+    }
+}
+
+TEST_CASE("qmc, halton is stratified", "[qmc]"){
+    size_t primes[] = {2, 3, 5, 7, 11};
+    for(uint64_t seed : {0ull, 12345ull}){
+        qmc_t q(sampler_t::halton, 5, seed);
+        for(size_t d = 0; d < 5; ++d){
+            REQUIRE(stratified(q, d, primes[d], d < 2 ? 6 : 3));
+        }
+    }
+}
+
+TEST_CASE("qmc, scrambling depends on the seed", "[qmc]"){
+    for(auto kind : {sampler_t::sobol, sampler_t::halton}){
+        qmc_t a(kind, 8, 1), b(kind, 8, 2), c(kind, 8, 1);
+        std::vector<double> ua(8), ub(8), uc(8);
+        a.point(100, ua.data());
+        b.point(100, ub.data());
+        c.point(100, uc.data());
+        REQUIRE(ua != ub);
+        REQUIRE(ua == uc);
+    }
+}
+
+TEST_CASE("qmc, parse sampler", "[qmc]"){
+    REQUIRE(parse_sampler("random") == sampler_t::random);
+    REQUIRE(parse_sampler("sobol") == sampler_t::sobol);
+    REQUIRE(parse_sampler("halton") == sampler_t::halton);
+    REQUIRE(sampler_name(sampler_t::halton) == "halton");
+    REQUIRE_THROWS(parse_sampler("lattice"));
+    REQUIRE_THROWS(qmc_t(sampler_t::random, 3, 1));
+}
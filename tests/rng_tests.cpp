@@ -0,0 +1,93 @@
+#include "catch.hpp"
+#include "../src/rng.cpp"
+
+#include <vector>
+#include <algorithm>
+
+//Known answer tests from the Random123 distribution
+TEST_CASE("philox, known answer, zeros", "[rng]"){
+    uint32_t ctr[4] = {0, 0, 0, 0};
+    uint32_t key[2] = {0, 0};
+    philox4x32(ctr, key);
+    REQUIRE(ctr[0] == 0x6627e8d5);
+    REQUIRE(ctr[1] == 0xe169c58d);
+    REQUIRE(ctr[2] == 0xbc57ac4c);
+    REQUIRE(ctr[3] == 0x9b00dbd8);
+}
+
+TEST_CASE("philox, known answer, ones", "[rng]"){
+    uint32_t ctr[4] = {0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff};
+    uint32_t key[2] = {0xffffffff, 0xffffffff};
+    philox4x32(ctr, key);
+    REQUIRE(ctr[0] == 0x408f276d);
+    REQUIRE(ctr[1] == 0x41c83b0e);
+    REQUIRE(ctr[2] == 0xa20bc7c6);
+    REQUIRE(ctr[3] == 0x6d5451fd);
+}
+
+TEST_CASE("philox, known answer, pi", "[rng]"){
+    uint32_t ctr[4] = {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344};
+    uint32_t key[2] = {0xa4093822, 0x299f31d0};
+    philox4x32(ctr, key);
+    REQUIRE(ctr[0] == 0xd16cfe09);
+    REQUIRE(ctr[1] == 0x94fdcceb);
+    REQUIRE(ctr[2] == 0x5001e420);
+    REQUIRE(ctr[3] == 0x24126ea1);
+}
+
+TEST_CASE("philox, lanes give the same as one at a time", "[rng]"){
+    uint32_t key[2] = {0x13198a2e, 0x03707344};
+    uint32_t lanes[4][PHILOX_LANES];
+    for(size_t l = 0; l < PHILOX_LANES; ++l){
+        for(size_t k = 0; k < 4; ++k) lanes[k][l] = (uint32_t)(l*4 + k);
+    }
+    philox4x32_lanes(lanes, key);
+    for(size_t l = 0; l < PHILOX_LANES; ++l){
+        uint32_t ctr[4];
+        for(size_t k = 0; k < 4; ++k) ctr[k] = (uint32_t)(l*4 + k);
+        philox4x32(ctr, key);
+        for(size_t k = 0; k < 4; ++k) REQUIRE(lanes[k][l] == ctr[k]);
+    }
+}
+
+TEST_CASE("philox, streams are reproducible", "[rng]"){
+    philox_t g1(1234, 17);
+    std::vector<uint64_t> first;
+    for(size_t i = 0; i < 10; ++i){
+        first.push_back(g1());
+    }
+    philox_t g2(1234, 17);
+    for(size_t i = 0; i < 10; ++i){
+        REQUIRE(g2() == first[i]);
+    }
+}
+
+TEST_CASE("philox, streams and seeds differ", "[rng]"){
+    philox_t g1(1234, 17);
+    philox_t g2(1234, 18);
+    philox_t g3(1235, 17);
+    auto a = g1(), b = g2(), c = g3();
+    REQUIRE(a != b);
+    REQUIRE(a != c);
+    REQUIRE(b != c);
+}
+
+TEST_CASE("philox, uniform is in [0,1)", "[rng]"){
+    philox_t g(99, 0);
+    double total = 0.0, lo = 1.0, hi = 0.0;
+    const size_t TRIALS = 100000;
+    for(size_t i = 0; i < TRIALS; ++i){
+        double u = g.uniform();
+        lo = std::min(lo, u);
+        hi = std::max(hi, u);
+        total += u;
+    }
+    REQUIRE(lo >= 0.0);
+    REQUIRE(hi < 1.0);
+    REQUIRE(total/TRIALS - 0.5 < 1e-2);
+    REQUIRE(-(total/TRIALS - 0.5) < 1e-2);
+}
+
+TEST_CASE("random seed is never zero", "[rng]"){
+    REQUIRE(random_seed() != 0);
+}
@@ -0,0 +1,206 @@
+#include "catch.hpp"
+#include "../src/schedule_log.cpp"
+
+#include <cstdio> //for remove
+#include <sstream>
+
+std::string dump_to_string(const std::string& filename){
+    std::ostringstream out;
+    dump_schedule_log(filename, out);
+    return out.str();
+}
+
+/*
+ * Writes the same made up trials to a log of the given format, and to a json
+ * string the old way. A binary32 log only keeps the weights as floats, so the
+ * json gets them rounded and printed the same way.
+ */
+std::string write_test_log(const std::string& filename, log_format_t format,
+        size_t trials, size_t ring_size = LOG_RING_SIZE){
+    std::ostringstream expected;
+    expected<<"using root: 'a'"<<std::endl;
+    schedule_log_t log(ring_size);
+    log.create(filename, format, "a", 3);
+    for(size_t i = 0; i < trials; ++i){
+        std::vector<double> w {0.5, 0.25, 1.0/(i+1)};
+        topology_key_t key{i%3, i%3};
+        std::string newick = "((a,b),c" + std::to_string(i%3) + ");";
+        log.write(i, key, newick, w);
+        bool as_float = format == log_format_t::binary32;
+        if(as_float){
+            for(auto& v : w) v = (float)v;
+        }
+        write_sequence_to_file(w, newick, expected, as_float);
+    }
+    log.flush();
+    return expected.str();
+}
+
+TEST_CASE("schedule log, dump matches json", "[schedule_log]"){
+    for(auto format : {log_format_t::json, log_format_t::binary32,
+            log_format_t::binary64}){
+        auto expected = write_test_log("test.log", format, 10000);
+        REQUIRE(dump_to_string("test.log") == expected);
+    }
+    std::remove("test.log");
+}
+
+TEST_CASE("schedule log, a full ring waits for the writer", "[schedule_log]"){
+    for(auto format : {log_format_t::json, log_format_t::binary32}){
+        auto expected = write_test_log("test.log", format, 20000, 4);
+        REQUIRE(dump_to_string("test.log") == expected);
+    }
+    std::remove("test.log");
+}
+
+TEST_CASE("schedule log, json weights read back exactly", "[schedule_log]"){
+    std::ostringstream out;
+    write_sequence_to_file({0.1, 1.0/3, 2.5e-300, 1e21, 7}, "(a,b);", out);
+    REQUIRE(out.str() == "{\"tree\":\"(a,b);\",\"weights\": "
+            "[0.1,0.3333333333333333,2.5e-300,1e+21,7]}\n");
+}
+
+TEST_CASE("schedule log, importance weights", "[schedule_log]"){
+    for(auto format : {log_format_t::json, log_format_t::binary32,
+            log_format_t::binary64}){
+        std::ostringstream expected;
+        expected<<"using root: 'a'"<<std::endl;
+        {
+            schedule_log_t log;
+            log.create("test.log", format, "a", 2, true);
+            for(size_t i = 0; i < 5000; ++i){
+                std::vector<double> w {0.5, 0.25};
+                double importance = i < 1000 ? 1.0 : 1.0/(i%7 + 1);
+                log.set_importance(importance);
+                log.write(i, topology_key_t{i%2, 0}, "(a,b);", w);
+                write_sequence_to_file(w, "(a,b);", expected,
+                        format == log_format_t::binary32, importance);
+            }
+        }
+        REQUIRE(dump_to_string("test.log") == expected.str());
+    }
+    std::remove("test.log");
+}
+
+TEST_CASE("schedule log, decision margins", "[schedule_log]"){
+    for(auto format : {log_format_t::json, log_format_t::binary32,
+            log_format_t::binary64}){
+        std::ostringstream expected;
+        expected<<"using root: 'a'"<<std::endl;
+        {
+            schedule_log_t log;
+            log.create("test.log", format, "a", 2, true, true);
+            for(size_t i = 0; i < 5000; ++i){
+                std::vector<double> w {0.5, 0.25};
+                double importance = 1.0/(i%3 + 1);
+                double margin = i%11 == 0 ? HUGE_VAL : 1.0/(i+1);
+                log.set_importance(importance);
+                log.write(i, topology_key_t{i%2, 0}, "(a,b);", w, margin);
+                write_sequence_to_file(w, "(a,b);", expected,
+                        format == log_format_t::binary32, importance, margin);
+            }
+        }
+        REQUIRE(dump_to_string("test.log") == expected.str());
+    }
+    std::ostringstream out;
+    write_sequence_to_file({1}, "(a,b);", out, false, 0.0, HUGE_VAL);
+    REQUIRE(out.str() == "{\"tree\":\"(a,b);\",\"weights\": [1],"
+            "\"margin\": null}\n");
+    std::remove("test.log");
+}
+
+TEST_CASE("schedule log, binary is smaller", "[schedule_log]"){
+    write_test_log("test.log", log_format_t::json, 5000);
+    std::ifstream json("test.log", std::ios::binary | std::ios::ate);
+    auto json_size = json.tellg();
+    write_test_log("test.log", log_format_t::binary32, 5000);
+    std::ifstream binary("test.log", std::ios::binary | std::ios::ate);
+    REQUIRE(binary.tellg()*5 < json_size);
+    std::remove("test.log");
+}
+
+TEST_CASE("schedule log, resume", "[schedule_log]"){
+    for(auto format : {log_format_t::json, log_format_t::binary32}){
+        auto expected = write_test_log("whole.log", format, 100);
+
+        uint64_t offset;
+        {
+            schedule_log_t log;
+            log.create("part.log", format, "a", 3);
+            for(size_t i = 0; i < 100; ++i){
+                std::vector<double> w {0.5, 0.25, 1.0/(i+1)};
+                topology_key_t key{i%3, i%3};
+                std::string newick = "((a,b),c" + std::to_string(i%3) + ");";
+                log.write(i, key, newick, w);
+                if(i == 39){
+                    offset = log.flush();
+                }
+            }
+        }
+        schedule_log_t log;
+        log.resume("part.log", format, 3, offset);
+        for(size_t i = 40; i < 100; ++i){
+            std::vector<double> w {0.5, 0.25, 1.0/(i+1)};
+            topology_key_t key{i%3, i%3};
+            log.write(i, key, "((a,b),c" + std::to_string(i%3) + ");", w);
+        }
+        log.flush();
+        REQUIRE(dump_to_string("part.log") == expected);
+    }
+    std::remove("whole.log");
+    std::remove("part.log");
+}
+
+TEST_CASE("schedule log, resume from a mark", "[schedule_log]"){
+    for(auto format : {log_format_t::json, log_format_t::binary32}){
+        auto expected = write_test_log("whole.log", format, 100);
+
+        //the offset is asked for after more trials are written, like the
+        //counts writer does
+        uint64_t offset = 0;
+        {
+            schedule_log_t log(4);
+            log.create("part.log", format, "a", 3);
+            uint64_t mark = 0;
+            for(size_t i = 0; i < 100; ++i){
+                std::vector<double> w {0.5, 0.25, 1.0/(i+1)};
+                topology_key_t key{i%3, i%3};
+                std::string newick = "((a,b),c" + std::to_string(i%3) + ");";
+                log.write(i, key, newick, w);
+                if(i == 39){
+                    mark = log.mark();
+                }
+                if(i == 70){
+                    offset = log.offset_at(mark);
+                }
+            }
+        }
+        schedule_log_t log;
+        log.resume("part.log", format, 3, offset);
+        for(size_t i = 40; i < 100; ++i){
+            std::vector<double> w {0.5, 0.25, 1.0/(i+1)};
+            topology_key_t key{i%3, i%3};
+            log.write(i, key, "((a,b),c" + std::to_string(i%3) + ");", w);
+        }
+        log.flush();
+        REQUIRE(dump_to_string("part.log") == expected);
+    }
+    std::remove("whole.log");
+    std::remove("part.log");
+}
+
+TEST_CASE("schedule log, damaged logs throw", "[schedule_log]"){
+    write_test_log("test.log", log_format_t::binary32, 100);
+    std::ifstream in("test.log", std::ios::binary);
+    std::string buf((std::istreambuf_iterator<char>(in)),
+            std::istreambuf_iterator<char>());
+    in.close();
+    {
+        std::ofstream out("test.log", std::ios::binary);
+        out.write(buf.data(), buf.size()-10);
+    }
+    REQUIRE_THROWS(dump_to_string("test.log"));
+    REQUIRE_THROWS(dump_to_string("does_not_exist.log"));
+    REQUIRE_THROWS(parse_log_format("xml"));
+    std::remove("test.log");
+}
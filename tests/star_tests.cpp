@@ -1,6 +1,8 @@
 #include "catch.hpp"
 #include "../src/star.cpp"
 #include <fstream>
+#include <cmath>
+#include <random>
 
 TEST_CASE("star, one tree","[star]"){
     std::string t1="(a:1.0,b:1.0);";
@@ -85,6 +87,215 @@ TEST_CASE("star, with weight schedule as function", "[star][regression][fweights
     REQUIRE(star_tree.to_string() == "((((a,b),(c,d)),((e,f),g)),h);");
 }
 
+/*
+ * Averages the distance matrices the slow way, by setting the weights on every
+ * tree, to check the count table against.
+ */
+std::vector<double> reweighted_average(const std::vector<std::string>& vt,
+        const std::vector<double>& v, size_t depth){
+    auto lm = tree_t(vt.front()).make_label_map();
+    double max = 0.0;
+    for(size_t i=0;i<depth;++i){ max+=v[i]; }
+    std::vector<double> avg(lm.size()*lm.size(), 0.0);
+    std::vector<double> d(lm.size()*lm.size(), 0.0);
+    for(auto& s : vt){
+        tree_t t(s);
+        t.set_weights(v, max);
+        t.calc_distance_matrix(lm, d.data());
+        for(size_t i=0;i<d.size();++i){ avg[i]+=d[i]; }
+    }
+    for(auto& a : avg){ a/=vt.size(); }
+    return avg;
+}
+
+TEST_CASE("star, count table matches reweighting the trees", "[star][lca]"){
+    std::vector<std::string> vt {
+        "(((a,b),(c,d)),(((e,f),g),h));",
+        "((a,(b,(c,d))),((e,f),(g,h)));",
+        "(((a,h),(c,d)),((e,(f,b)),g));",
+        "((a,b),(c,d),((e,f),(g,h)));"};
+    star_t s(vt);
+    std::vector<std::vector<double>> schedules {
+        {1,1,1,1,1},
+        {0.1,0.2,0.3,0.15,0.25},
+        {0,1,0,1,0},
+        {0.5,0,0,0.5,0}};
+    for(auto& v : schedules){
+        auto expected = reweighted_average(vt, v, s.get_size());
+        auto got = s.calc_average_distances(v);
+        REQUIRE(got.size() == expected.size());
+        for(size_t i=0;i<got.size();++i){
+            REQUIRE(std::abs(got[i] - expected[i]) < 1e-12);
+        }
+    }
+}
+
+TEST_CASE("star, 0/1 schedules match reweighting exactly", "[star][lca][ties]"){
+    //balanced trees, so the averaged matrices are full of exact ties in Q
+    std::vector<std::string> vt {
+        "(((a,b),(c,d)),((e,f),(g,h)));",
+        "(((a,c),(b,d)),((e,g),(f,h)));",
+        "(((a,b),(e,f)),((c,d),(g,h)));"};
+    star_t s(vt);
+    size_t depth = s.get_size();
+    auto labels = s.get_labels();
+    for(size_t code=1;code<((size_t)1<<depth);++code){
+        std::vector<double> v(depth);
+        for(size_t k=0;k<depth;++k){ v[k] = (double)((code>>k)&1); }
+        auto expected = reweighted_average(vt, v, depth);
+        REQUIRE(s.calc_average_distances(v) == expected);
+        auto t1 = s.get_tree(v);
+        auto t2 = nj(expected, labels);
+        REQUIRE(t1.set_outgroup("a").sort().clear_weights().to_string() ==
+                t2.set_outgroup("a").sort().clear_weights().to_string());
+    }
+}
+
+TEST_CASE("star, batched schedules match one at a time", "[star][lca]"){
+    std::vector<std::string> vt {
+        "(((a,b),(c,d)),(((e,f),g),h));",
+        "((a,(b,(c,d))),((e,f),(g,h)));",
+        "(((a,h),(c,d)),((e,(f,b)),g));",
+        "((a,b),(c,d),((e,f),(g,h)));"};
+    star_t s(vt);
+    std::vector<std::vector<double>> schedules;
+    for(size_t i=0;i<70;++i){
+        std::vector<double> v;
+        for(size_t k=0;k<s.get_size();++k){
+            v.push_back((double)((i*7 + k*3) % 11)/11.0);
+        }
+        schedules.push_back(v);
+    }
+    auto batched = s.calc_average_distances(schedules);
+    REQUIRE(batched.size() == schedules.size());
+    for(size_t i=0;i<schedules.size();++i){
+        REQUIRE(batched[i] == s.calc_average_distances(schedules[i]));
+    }
+}
+
+TEST_CASE("star, ancestor sums updated a depth at a time", "[star][lca]"){
+    std::vector<std::string> vt {
+        "(((a,b),(c,d)),(((e,f),g),h));",
+        "((a,(b,(c,d))),((e,f),(g,h)));",
+        "(((a,h),(c,d)),((e,(f,b)),g));"};
+    star_t s(vt);
+    size_t depth = s.get_size();
+    //every 0/1 schedule in Gray code order, one depth flipped each time
+    std::vector<double> v(depth, 0.0);
+    v[0] = 1.0;
+    auto sums = s.calc_ancestor_sums(v);
+    double max = 1.0;
+    for(size_t i = 1; i < ((size_t)1<<depth) - 1; ++i){
+        size_t k = 0;
+        while(!((i+1) & ((size_t)1<<k))) k++;
+        double delta = v[k] == 0.0 ? 1.0 : -1.0;
+        v[k] += delta;
+        max += delta;
+        s.update_ancestor_sums(sums, k, delta);
+        REQUIRE(s.calc_distances_from_sums(sums, max)
+                == s.calc_average_distances(v));
+    }
+}
+
+TEST_CASE("star, duplicate trees are merged", "[star][dedup]"){
+    std::vector<std::string> vt {
+        "(((a,b),(c,d)),(((e,f),g),h));",
+        "((a,(b,(c,d))),((e,f),(g,h)));",
+        "(((a,b),(c,d)),(((e,f),g),h));",
+        "((h,(g,(f,e))),((d,c),(b,a)));",
+        "((a,(b,(c,d))),((e,f),(g,h)));",
+        "(((a,b),(c,d)),(((e,f),g),h));"};
+    star_t s(vt);
+    REQUIRE(s.get_distinct_count() == 2);
+    std::vector<std::vector<double>> schedules {
+        {1,1,1,1,1},
+        {0.1,0.2,0.3,0.15,0.25}};
+    for(auto& v : schedules){
+        auto expected = reweighted_average(vt, v, s.get_size());
+        auto got = s.calc_average_distances(v);
+        for(size_t i=0;i<got.size();++i){
+            REQUIRE(std::abs(got[i] - expected[i]) < 1e-12);
+        }
+    }
+}
+
+TEST_CASE("star, trees with different branch lengths are kept apart", "[star][dedup]"){
+    std::vector<std::string> vt {
+        "(a:1.0,(b:1.0,c:1.0):1.0);",
+        "(a:1.0,(b:1.0,c:2.0):1.0);",
+        "((c:1.0,b:1.0):1.0,a:1.0);"};
+    star_t s(vt);
+    REQUIRE(s.get_distinct_count() == 2);
+}
+
+TEST_CASE("star, schedule classes", "[star][classes]"){
+    std::vector<std::string> vt {
+        "((a,((b,c),k)),e);",
+        "((b,((a,c),k)),e);",
+        "(((a,b),(c,k)),e);",
+        "(((a,k),(c,b)),e);"};
+    star_t s(vt);
+    REQUIRE(s.get_size() == 4);
+    //e is split off at the root of every tree, and the deepest weight is
+    //only ever on the edges to the leaves
+    REQUIRE(s.get_schedule_classes() == std::vector<size_t>({
+                NO_SCHEDULE_CLASS, 0, 1, NO_SCHEDULE_CLASS}));
+    REQUIRE(s.get_class_count() == 2);
+}
+
+TEST_CASE("star, weight can be moved within a class", "[star][classes]"){
+    std::vector<std::string> vt {
+        "(((a,b),(c,d)),(((e,f),g),h));",
+        "((a,(b,(c,d))),((e,f),(g,h)));",
+        "(((a,h),(c,d)),((e,(f,b)),g));"};
+    star_t s(vt);
+    REQUIRE(s.get_class_count() < s.get_size());
+    const auto& classes = s.get_schedule_classes();
+    std::mt19937_64 gen(7);
+    std::exponential_distribution<double> exp_dist(1.0);
+    for(size_t i = 0; i < 200; ++i){
+        std::vector<double> v(s.get_size());
+        for(auto& w : v) w = exp_dist(gen);
+        //all of the weight of each class on its first depth, and none on the
+        //depths that don't count
+        std::vector<double> moved(v.size(), 0.0);
+        std::vector<size_t> first(s.get_class_count(), NO_SCHEDULE_CLASS);
+        for(size_t d = 0; d < v.size(); ++d){
+            size_t c = classes[d];
+            if(c == NO_SCHEDULE_CLASS) continue;
+            if(first[c] == NO_SCHEDULE_CLASS) first[c] = d;
+            moved[first[c]] += v[d];
+        }
+        auto lhs = s.get_tree(v).calc_topology_key(s.get_label_map());
+        auto rhs = s.get_tree(moved).calc_topology_key(s.get_label_map());
+        REQUIRE(lhs == rhs);
+    }
+}
+
+TEST_CASE("star, bounded nj search gives the same trees", "[star][bounded]"){
+    std::vector<std::string> vt {
+        "(((a,b),(c,d)),(((e,f),g),h));",
+        "((a,(b,(c,d))),((e,f),(g,h)));",
+        "(((a,h),(c,d)),((e,(f,b)),g));"};
+    star_t exhaustive(vt), bounded(vt);
+    bounded.set_nj_search(nj_search_t::bounded);
+    REQUIRE(bounded.get_nj_search() == nj_search_t::bounded);
+    std::mt19937_64 gen(5);
+    std::exponential_distribution<double> exp_dist(1.0);
+    std::vector<std::vector<double>> schedules(50,
+            std::vector<double>(exhaustive.get_size()));
+    for(auto& v : schedules){
+        for(auto& w : v) w = exp_dist(gen);
+    }
+    //a schedule of all ones, where the gene trees tie a lot of pairs
+    schedules.push_back(std::vector<double>(exhaustive.get_size(), 1.0));
+    auto lhs = exhaustive.get_trees(schedules);
+    auto rhs = bounded.get_trees(schedules);
+    for(size_t i = 0; i < schedules.size(); ++i){
+        REQUIRE(lhs[i].to_string() == rhs[i].to_string());
+    }
+}
+
 TEST_CASE("star, massive trees from ASTRID","[star][astrid]"){
     std::string astrid_tree_string = "(((Tree_Shrew,((Rabbit,Pika),(Squirrel,(Guinea_Pig,(Kangaroo_Rat,(Rat,Mouse)))))),((Mouse_Lemur,Galagos),(Tarsier,(Marmoset,(Macaque,(Orangutan,(Gorilla,(Human,Chimpanzee)))))))),((Shrew,Hedgehog),((Megabat,Microbat),((Alpaca,(Pig,(Dolphin,Cow))),(Horse,(Cat,Dog))))),(((Armadillos,Sloth),(Lesser_Hedgehog_Tenrec,(Elephant,Hyrax))),((Wallaby,Opossum),(Platypus,Chicken))));";
     std::string astrid_tree_isomorphic = "((Alpaca,((Cow,Dolphin),Pig)),((((((Armadillos,Sloth),((Elephant,Hyrax),Lesser_Hedgehog_Tenrec)),((Chicken,Platypus),(Opossum,Wallaby))),((((((((Chimpanzee,Human),Gorilla),Orangutan),Macaque),Marmoset),Tarsier),(Galagos,Mouse_Lemur)),((((Guinea_Pig,(Kangaroo_Rat,(Mouse,Rat))),Squirrel),(Pika,Rabbit)),Tree_Shrew))),(Hedgehog,Shrew)),(Megabat,Microbat)),((Cat,Dog),Horse));";
@@ -0,0 +1,90 @@
+#include "catch.hpp"
+#include "../src/topology.cpp"
+#include "../src/tree.h"
+
+#include <string>
+#include <unordered_map>
+
+topology_key_t key_for(const std::string& newick){
+    tree_t t(newick);
+    return t.calc_topology_key(t.make_label_map());
+}
+
+/*
+ * The label maps from the different trees might not agree, so build the keys
+ * with one shared map.
+ */
+topology_key_t key_for(const std::string& newick,
+        const std::unordered_map<std::string, size_t>& lm){
+    tree_t t(newick);
+    return t.calc_topology_key(lm);
+}
+
+TEST_CASE("topology key, child order doesn't matter", "[topology]"){
+    tree_t t("((a,b),(c,d));");
+    auto lm = t.make_label_map();
+    REQUIRE(key_for("((a,b),(c,d));", lm) == key_for("((d,c),(b,a));", lm));
+}
+
+TEST_CASE("topology key, rooting doesn't matter", "[topology]"){
+    tree_t t("((a,b),(c,(d,e)));");
+    auto lm = t.make_label_map();
+    auto k = key_for("((a,b),(c,(d,e)));", lm);
+    REQUIRE(k == key_for("(a,b,(c,(d,e)));", lm));
+    REQUIRE(k == key_for("((a,b),c,(d,e));", lm));
+    REQUIRE(k == key_for("(((a,b),c),(d,e));", lm));
+    tree_t rerooted("((a,b),(c,(d,e)));");
+    rerooted.set_outgroup("d");
+    REQUIRE(k == rerooted.calc_topology_key(lm));
+}
+
+TEST_CASE("topology key, branch lengths don't matter", "[topology]"){
+    tree_t t("((a,b),(c,d));");
+    auto lm = t.make_label_map();
+    REQUIRE(key_for("((a:1.0,b:2.0):0.5,(c:1.0,d:1.0):3.0);", lm)
+            == key_for("((a,b),(c,d));", lm));
+}
+
+TEST_CASE("topology key, different topologies differ", "[topology]"){
+    tree_t t("((a,b),(c,(d,e)));");
+    auto lm = t.make_label_map();
+    auto k1 = key_for("((a,b),(c,(d,e)));", lm);
+    auto k2 = key_for("((a,c),(b,(d,e)));", lm);
+    auto k3 = key_for("((a,b),(d,(c,e)));", lm);
+    REQUIRE(k1 != k2);
+    REQUIRE(k1 != k3);
+    REQUIRE(k2 != k3);
+}
+
+TEST_CASE("topology key, every topology on 3 taxa is the same", "[topology]"){
+    tree_t t("((a,b),c);");
+    auto lm = t.make_label_map();
+    REQUIRE(key_for("((a,b),c);", lm) == key_for("((a,c),b);", lm));
+}
+
+TEST_CASE("topology key, more than 64 taxa", "[topology]"){
+    std::string caterpillar = "t0";
+    std::string swapped = "t1";
+    for(size_t i = 1; i < 100; ++i){
+        caterpillar = "(" + caterpillar + ",t" + std::to_string(i) + ")";
+        size_t j = i == 1 ? 0 : i;
+        swapped = "(" + swapped + ",t" + std::to_string(j) + ")";
+    }
+    caterpillar += ";";
+    swapped += ";";
+    tree_t t(caterpillar);
+    auto lm = t.make_label_map();
+    REQUIRE(key_for(caterpillar, lm) == key_for(caterpillar, lm));
+    //swapping the first two taxa of a caterpillar gives the same tree
+    REQUIRE(key_for(caterpillar, lm) == key_for(swapped, lm));
+    tree_t other(caterpillar);
+    other.set_outgroup("t50");
+    REQUIRE(key_for(caterpillar, lm) == other.calc_topology_key(lm));
+}
+
+TEST_CASE("topology key, hand made clusters", "[topology]"){
+    //((a,b),(c,d),e) and the same thing with the clusters given the other way
+    std::vector<taxa_set_t> c1 {{0x3}, {0xc}};
+    std::vector<taxa_set_t> c2 {{0x1c}, {0x13}, {0x3}};
+    REQUIRE(make_topology_key(c1, 5) == make_topology_key(c2, 5));
+}